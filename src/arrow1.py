@@ -1,12 +1,111 @@
 import subprocess
 import tempfile
+import struct
+import uuid
 import os
 import numpy as _np
 import scipy.io.wavfile as _wf
 
+try:
+    from multiprocessing import shared_memory as _shared_memory
+except ImportError:
+    _shared_memory = None
+if os.name != 'posix':
+    # arrow1 supports POSIX shared memory only
+    _shared_memory = None
 
-with subprocess.Popen(['arrow1', '--version'], stdout=subprocess.PIPE, universal_newlines=True) as _p:
-    __version__, _ = _p.communicate()
+# Header of shared memory segments, see src/shm.hpp
+_SHM_HEADER = struct.Struct('=8sIIQQQ')
+_SHM_DATA_OFFSET = 64
+
+
+try:
+    # Extension module built with cmake -DENABLE_PYTHON=ON, runs the engine in this process
+    import _arrow1
+except ImportError:
+    _arrow1 = None
+    with subprocess.Popen(['arrow1', '--version'], stdout=subprocess.PIPE, universal_newlines=True) as _p:
+        __version__, _ = _p.communicate()
+else:
+    __version__ = '2.0'
+
+_engine = None
+
+
+def _get_engine():
+    global _engine
+    if _engine is None:
+        _engine = _arrow1.Engine()
+    return _engine
+
+
+def _as_float32(arr):
+    """Returns C-contiguous float32 samples of array. Integer samples are scaled from their
+    full scale to [-1, 1), as libsndfile does with integer WAV files.
+    """
+    if arr.dtype.kind in 'iu':
+        half = 2.0 ** (arr.dtype.itemsize * 8 - 1)
+        # Unsigned samples, such as 8-bit WAV ones, are centered on half of their range
+        offset = half if arr.dtype.kind == 'u' else 0
+        return _np.ascontiguousarray((arr - offset) / half, dtype=_np.float32)
+    if arr.dtype.kind != 'f':
+        raise TypeError('samples must be of integer or floating point type, not {}'.format(arr.dtype))
+    # No-op for C-contiguous float32 arrays
+    return _np.ascontiguousarray(arr, dtype=_np.float32)
+
+
+def _shm_write(arr, fs):
+    """Copies array of shape (frames,) or (frames, channels) to a new shared memory segment,
+    as float32 samples scaled like _as_float32() does
+    """
+    arr = _as_float32(arr)
+    frames = arr.shape[0]
+    channels = arr.shape[1] if arr.ndim == 2 else 1
+    shm = _shared_memory.SharedMemory('arrow1-' + uuid.uuid4().hex, create=True,
+                                      size=_SHM_DATA_OFFSET + arr.nbytes)
+    _SHM_HEADER.pack_into(shm.buf, 0, b'ARROW1SH', 1, channels, fs, frames, 0)
+    shm.buf[_SHM_DATA_OFFSET:_SHM_DATA_OFFSET + arr.nbytes] = arr.tobytes()
+    return shm
+
+
+def _shm_read(name):
+    """Returns recording from shared memory segment created by arrow1 as float32 array in
+    [-1, 1], and removes the segment
+    """
+    shm = _shared_memory.SharedMemory(name)
+    try:
+        _, _, channels, fs, _, frames = _SHM_HEADER.unpack_from(shm.buf, 0)
+        arr = _np.frombuffer(shm.buf, dtype=_np.float32, count=frames * channels,
+                             offset=_SHM_DATA_OFFSET).reshape(frames, channels).copy()
+    finally:
+        shm.close()
+        shm.unlink()
+    return arr, fs
+
+
+def _play_rec_native(play, rec, input_ports, output_ports, duration_secs, start_offset_secs, fs):
+    engine = _get_engine()
+    if play is not None:
+        if fs != engine.sample_rate:
+            raise ValueError('sample rate {} differs from Jack one {}'.format(fs, engine.sample_rate))
+        if start_offset_secs:
+            play = play[int(start_offset_secs * fs + .5):]
+        if duration_secs:
+            play = play[:int(duration_secs * fs + .5)]
+        play = _as_float32(play)
+    rec_out = None
+    if rec is True:
+        if duration_secs:
+            frames = int(duration_secs * engine.sample_rate + .5)
+        elif play is not None:
+            frames = play.shape[0]
+        else:
+            raise ValueError('recording requires play data and/or a duration')
+        channels = len(input_ports) if input_ports else min(2, len(engine.capture_ports()))
+        rec = rec_out = _np.zeros((frames, channels), dtype=_np.float32)
+    engine.play_rec(play, rec, input_ports, output_ports)
+    if rec_out is not None:
+        return rec_out, engine.sample_rate
 
 
 def play_rec(play=None, rec=None, input_ports=None, output_ports=None, duration_secs=None, start_offset_secs=None, fs=None):
@@ -25,18 +124,47 @@ def play_rec(play=None, rec=None, input_ports=None, output_ports=None, duration_
     :param fs: required if play is numpy array (must match Jack engine sample rate),
     otherwise ignored.
     :returns: if rec is True the recorded audio as numpy array, otherwise None.
+
+    With the _arrow1 extension module available, numpy arrays are played and recorded in
+    this process without temp files; rec may also be a preallocated float32 array of shape
+    (frames, channels) to record into.
+
+    Integer play arrays are scaled from their full scale, as if read from a WAV file of that
+    type. Recordings made in this process or handed over in shared memory are returned as
+    float32 arrays with samples in [-1, 1], rather than as int32 ones read back from a
+    recorded WAV file.
     """
+    if _arrow1 is not None and (play is None or isinstance(play, _np.ndarray)) \
+            and (rec is None or rec is True or isinstance(rec, _np.ndarray)):
+        return _play_rec_native(play, rec, input_ports, output_ports, duration_secs, start_offset_secs, fs)
+
+    # Arrays are handed over in shared memory where possible, otherwise in temp files
+    play_frames = None
+    play_shm = None
     play_cleanup = False
     if isinstance(play, _np.ndarray):
-        f = tempfile.NamedTemporaryFile(suffix='.wav', delete=False)
-        _wf.write(f, fs, play)
-        play = f.name
-        play_cleanup = True
+        play_frames = play.shape[0]
+        if _shared_memory is not None:
+            play_shm = _shm_write(play, fs)
+            play = 'shm:' + play_shm.name
+        else:
+            f = tempfile.NamedTemporaryFile(suffix='.wav', delete=False)
+            _wf.write(f, fs, play)
+            play = f.name
+            play_cleanup = True
 
+    rec_shm = None
     rec_cleanup = False
     if rec is True:
-        rec = tempfile.NamedTemporaryFile(suffix='.wav', delete=False).name
-        rec_cleanup = True
+        if _shared_memory is not None and (duration_secs or play_frames is not None):
+            # arrow1 creates the segment, sized by duration
+            if not duration_secs:
+                duration_secs = play_frames / fs
+            rec_shm = 'arrow1-' + uuid.uuid4().hex
+            rec = 'shm:' + rec_shm
+        else:
+            rec = tempfile.NamedTemporaryFile(suffix='.wav', delete=False).name
+            rec_cleanup = True
 
     args=['arrow1']
     if input_ports:
@@ -44,9 +172,9 @@ def play_rec(play=None, rec=None, input_ports=None, output_ports=None, duration_
     if output_ports:
         args.append('--out={}'.format(','.join(output_ports)))
     if play:
-        args.append('--play-file={}'.format(play))
+        args.append('--read-file={}'.format(play))
     if rec:
-        args.append('--record-file={}'.format(rec))
+        args.append('--write-file={}'.format(rec))
     if duration_secs is not None:
         args.append('--duration={}'.format(duration_secs))
     if start_offset_secs is not None:
@@ -56,15 +184,116 @@ def play_rec(play=None, rec=None, input_ports=None, output_ports=None, duration_
         std_out, _ = p.communicate()
         print(std_out)
 
+    if play_shm is not None:
+        play_shm.close()
+        play_shm.unlink()
+
     if play_cleanup:
         os.remove(play)
 
+    if rec_shm is not None:
+        return _shm_read(rec_shm)
+
     if rec_cleanup:
         fs, arr = _wf.read(rec)
         os.remove(rec)
         return arr, fs
 
 def get_ports():
+    if _arrow1 is not None:
+        engine = _get_engine()
+        res = ''
+        for title, ports in (('Output (playback)', engine.playback_ports()), ('Input (record)', engine.capture_ports())):
+            res += '{} {} channels:\n'.format(len(ports), title)
+            res += ''.join('  {:2}: {}\n'.format(i + 1, p) for i, p in enumerate(ports))
+        return res
     with subprocess.Popen(['arrow1', '--channels'], stdout=subprocess.PIPE, universal_newlines=True) as p:
         std_out, _ = p.communicate()
         return std_out
+
+
+class Daemon:
+    """Client of arrow1 running with --daemon, which keeps Jack ports and buffers ready,
+    so jobs start without spawning a process and reconnecting to Jack each time.
+
+    :param socket_path: control socket of the daemon, as given with its --socket option.
+    """
+
+    def __init__(self, socket_path='/tmp/arrow1.sock'):
+        import socket
+        self._sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self._sock.connect(socket_path)
+        self._file = self._sock.makefile('rw')
+
+    def close(self):
+        self._file.close()
+        self._sock.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def _request(self, line):
+        self._file.write(line + '\n')
+        self._file.flush()
+        reply = self._file.readline().rstrip('\n')
+        if not reply:
+            raise RuntimeError('arrow1 daemon closed connection')
+        status, _, rest = reply.partition(' ')
+        if status != 'ok':
+            raise RuntimeError(rest)
+        return rest
+
+    @staticmethod
+    def _state(reply):
+        state = {}
+        fields = reply.split(' ')
+        for i, field in enumerate(fields):
+            key, _, value = field.partition('=')
+            if key == 'error':
+                # Message may contain spaces and is always last
+                state[key] = ' '.join([value] + fields[i + 1:])
+                break
+            state[key] = int(value) if key in ('id', 'read', 'written') else value
+        return state
+
+    def submit(self, play=None, rec=None, input_ports=None, output_ports=None, duration_secs=None,
+               start_offset_secs=None, gap_secs=None):
+        """Queues job with the same meaning of arguments as play_rec(), except play and rec must
+        be file paths. Returns job id.
+        """
+        items = []
+        if play:
+            items.append('read={}'.format(play))
+        if rec:
+            items.append('write={}'.format(rec))
+        if input_ports:
+            items.append('in={}'.format(','.join(input_ports)))
+        if output_ports:
+            items.append('out={}'.format(','.join(output_ports)))
+        if duration_secs is not None:
+            items.append('duration={}'.format(duration_secs))
+        if start_offset_secs is not None:
+            items.append('start={}'.format(start_offset_secs))
+        if gap_secs is not None:
+            items.append('gap={}'.format(gap_secs))
+        return int(self._request('job ' + ' '.join('"{}"'.format(i) for i in items)))
+
+    def status(self, job_id):
+        """Returns dict with id, state (queued, running, done, cancelled or failed), frames
+        read and written once finished and error message of failed job.
+        """
+        return self._state(self._request('status {}'.format(job_id)))
+
+    def wait(self, job_id):
+        """Blocks until job has finished and returns its status"""
+        return self._state(self._request('wait {}'.format(job_id)))
+
+    def cancel(self, job_id):
+        self._request('cancel {}'.format(job_id))
+
+    def quit(self):
+        """Cancels all jobs and stops the daemon"""
+        self._request('quit')
@@ -0,0 +1,31 @@
+#include "backend.hpp"
+
+#include <cstdio>
+
+namespace olo {
+
+const char* engine_event_name(EngineEvent event) {
+    switch (event) {
+    case EngineEvent::XRUN: return "xrun";
+    case EngineEvent::BUFFER_SIZE: return "buffer_size";
+    case EngineEvent::SAMPLE_RATE: return "sample_rate";
+    case EngineEvent::GRAPH_ORDER: return "graph_order";
+    }
+    return "unknown";
+}
+
+void Backend::dump_ports() const {
+    using std::printf;
+    auto playback = playback_ports();
+    printf("%zd Output (playback) channels:\n", playback.size());
+    for (size_t i = 0; i != playback.size(); ++i) {
+        printf("  %2zd: %s\n", i + 1, playback[i].c_str());
+    }
+    auto capture = capture_ports();
+    printf("%zd Input (record) channels:\n", capture.size());
+    for (size_t i = 0; i != capture.size(); ++i) {
+        printf("  %2zd: %s\n", i + 1, capture[i].c_str());
+    }
+}
+
+}
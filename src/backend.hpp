@@ -0,0 +1,97 @@
+#pragma once
+#include "types.hpp"
+
+#include <cstdint>
+
+namespace olo {
+
+// Opaque handle of a client-side port, owned by the backend which registered it
+struct Port;
+
+enum class PortDirection {
+    // Port receives samples from the engine (recording)
+    INPUT,
+    // Port sends samples to the engine (playback)
+    OUTPUT
+};
+
+// Changes of engine state which may affect samples of a run
+enum class EngineEvent {
+    // Engine missed a deadline, so some periods were dropped or delayed
+    XRUN,
+    // Argument is the new period size
+    BUFFER_SIZE,
+    // Argument is the new sample rate
+    SAMPLE_RATE,
+    // Processing order of clients changed, e.g. on connections by others
+    GRAPH_ORDER
+};
+
+// Short name of the event used in reports
+const char* engine_event_name(EngineEvent event);
+
+// Audio engine driving Reactor: Jack server, or a loop running without any audio server.
+class Backend {
+public:
+    // Called once per period with the number of frames to process, must not throw
+    using ProcessCallback = void (*)(size_t frame_count, void* arg);
+    // Called when the engine stops processing on its own
+    using ShutdownCallback = void (*)(void* arg);
+    // Called on engine events with their argument or 0, must not throw, block or allocate
+    using EventCallback = void (*)(EngineEvent event, size_t value, void* arg);
+    // Called with the new period size when it changes, before the first period of that size.
+    // Engine doesn't start periods meanwhile, though one may still be finishing. Must not
+    // throw, but may allocate and wait for a while.
+    using BufferSizeCallback = void (*)(size_t period_size, void* arg);
+
+    virtual ~Backend() = default;
+
+    // Client name used as port name prefix
+    virtual const char* name() const = 0;
+    virtual size_t sample_rate() const = 0;
+    // Number of frames per process cycle as of now
+    virtual size_t period_size() const = 0;
+    // True if periods are paced by the wall clock, so the process callback must never block.
+    // Otherwise it may wait for the disk threads instead of dropping samples. May change
+    // while active, e.g. when engine enters freewheel mode.
+    virtual bool realtime() const noexcept = 0;
+    // Asks engine to run periods as fast as clients process them instead of pacing them by
+    // the wall clock; returns 0 on success or engine error code
+    virtual int set_freewheel(bool onoff) = 0;
+
+    // Full names of physical ports
+    virtual vector<string> capture_ports() const = 0;
+    virtual vector<string> playback_ports() const = 0;
+    void dump_ports() const;
+
+    // Throws on failure. Registered ports must be released with unregister_port().
+    virtual Port* register_port(const string& short_name, PortDirection direction) = 0;
+    // Disconnects and releases the port
+    virtual void unregister_port(Port* port) = 0;
+    // Connects ports given by full names; returns 0 on success or engine error code
+    virtual int connect(const string& source, const string& destination) = 0;
+    virtual int disconnect(const string& source, const string& destination) = 0;
+
+    // The following may be called only from the process callback and don't block
+    virtual Sample* port_buffer(Port* port, size_t frame_count) noexcept = 0;
+    // Engine time of the start of current period, for logging
+    virtual std::uint32_t frame_time() const noexcept = 0;
+
+    // Callbacks must be set before activate()
+    virtual void set_process_callback(ProcessCallback callback, void* arg) = 0;
+    virtual void set_shutdown_callback(ShutdownCallback callback, void* arg) = 0;
+    // Events are delivered by one thread at a time, which may be other than the one running
+    // process callback. May be called at any time; once it returns, the previous callback
+    // isn't running and won't be called again, so owners clear it with nullptr before they
+    // go away. Engines without any needn't override this.
+    virtual void set_event_callback(EventCallback, void*) {}
+    // Same guarantees as set_event_callback(). Engines with fixed period size needn't override
+    // this.
+    virtual void set_buffer_size_callback(BufferSizeCallback, void*) {}
+    // Throws on failure
+    virtual void activate() = 0;
+    // Returns after the last process callback has finished
+    virtual void deactivate() = 0;
+};
+
+}
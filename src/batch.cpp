@@ -0,0 +1,317 @@
+#include "batch.hpp"
+#include "backend.hpp"
+#include "calibrate.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <stdexcept>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+namespace {
+void validate(const Job& job) {
+    const Args& args = job.args;
+    if (args.input_file.empty() && args.output_file.empty()) {
+        throw runtime_error{str(format("job %1%: no playback or record file") % job.id)};
+    }
+    if (!args.output_file.empty() && args.input_file.empty() && !args.duration_secs
+            && !is_shared_memory(args.output_file)) {
+        throw runtime_error{str(format("job %1%: recording requires a playback file and/or a duration")
+            % job.id)};
+    }
+    if (args.duration_secs && *args.duration_secs <= 0) {
+        throw runtime_error{str(format("job %1%: duration must be positive") % job.id)};
+    }
+    if (args.start_offset_secs < 0 || job.gap_secs < 0) {
+        throw runtime_error{str(format("job %1%: start and gap must not be negative") % job.id)};
+    }
+}
+
+// Splits line on spaces, except within double quotes. Backslashes are left alone, as they're
+// path separators on Windows.
+vector<string> split_line(const string& line) {
+    vector<string> res;
+    string item;
+    bool quoted = false;
+    bool pending = false;
+    for (char ch: line) {
+        if (ch == '"') {
+            quoted = !quoted;
+            pending = true;
+        } else if (!quoted && (ch == ' ' || ch == '\t' || ch == '\r')) {
+            if (pending) {
+                res.push_back(item);
+                item.clear();
+                pending = false;
+            }
+        } else {
+            item += ch;
+            pending = true;
+        }
+    }
+    if (pending) {
+        res.push_back(item);
+    }
+    return res;
+}
+
+double parse_secs(const Job& job, const string& key, const string& value) {
+    try {
+        return boost::lexical_cast<double>(value);
+    } catch (boost::bad_lexical_cast&) {
+        throw runtime_error{str(format("job %1%: invalid %2% value: %3%") % job.id % key % value)};
+    }
+}
+
+void print_frames(const char* what, size_t frames, size_t sample_rate) {
+    std::cout << what << frames << " ("
+        << std::fixed << std::setprecision(3) << frames / (double)sample_rate << "s)";
+}
+}
+
+optional<Job> parse_job(const string& text, size_t id, const Args& defaults) {
+    auto items = split_line(text);
+    if (items.empty() || items[0][0] == '#') {
+        return boost::none;
+    }
+    Job job{id, defaults, defaults.gap_secs};
+    for (const auto& item: items) {
+        auto eq = item.find('=');
+        if (eq == string::npos) {
+            throw runtime_error{str(format("job %1%: expected key=value, got %2%") % id % item)};
+        }
+        auto key = item.substr(0, eq);
+        auto value = item.substr(eq + 1);
+        if (key == "read") {
+            job.args.input_file = value;
+        } else if (key == "write") {
+            job.args.output_file = value;
+        } else if (key == "in") {
+            job.args.input_ports = split_ports({value});
+        } else if (key == "out") {
+            job.args.output_ports = split_ports({value});
+        } else if (key == "duration") {
+            job.args.duration_secs = parse_secs(job, key, value);
+        } else if (key == "start") {
+            job.args.start_offset_secs = parse_secs(job, key, value);
+        } else if (key == "gap") {
+            job.gap_secs = parse_secs(job, key, value);
+        } else {
+            throw runtime_error{str(format("job %1%: unknown key %2%") % id % key)};
+        }
+    }
+    validate(job);
+    return job;
+}
+
+vector<Job> read_jobs(const string& path, const Args& defaults) {
+    std::ifstream in{path};
+    if (!in) {
+        throw runtime_error{str(format("can't open job list: %1%") % path)};
+    }
+    vector<Job> jobs;
+    string line;
+    for (size_t line_no = 1; std::getline(in, line); ++line_no) {
+        if (auto job = parse_job(line, line_no, defaults)) {
+            jobs.push_back(*job);
+        }
+    }
+    ldebug("read_jobs(): %zd jobs in %s\n", jobs.size(), path.c_str());
+    return jobs;
+}
+
+Session::Session(Backend& backend, const Args& args, size_t input_count, size_t output_count):
+    backend_{backend},
+    reactor_{backend, input_count, output_count, args.freewheel},
+    transport_{args.planar ? Transport::PLANAR : Transport::INTERLEAVED},
+    wav_io_{args.direct_io ? WavIo::URING_DIRECT : args.uring ? WavIo::URING : WavIo::SYNC},
+    mark_events_{args.mark_events}
+{
+}
+
+Session::~Session() noexcept(false) {
+    if (reader_) {
+        reader_->stop();
+    }
+    if (writer_) {
+        writer_->stop();
+    }
+}
+
+void Session::start(Job job) {
+    Args& a = job.args;
+    fixup_default_ports(a, backend_);
+    const double duration = a.duration_secs.value_or(0);
+    const auto sample_rate = backend_.sample_rate();
+    const size_t buffer_size = a.buffer_periods != 0 ? a.buffer_periods * backend_.period_size() : a.buffer_size;
+    if (a.input_file.empty()) {
+        reader_.reset();
+    } else if (reader_ && reader_->channel_count() == a.output_ports.size()) {
+        try {
+            // Before the ringbuffer is filled from the new file, which would make it stay larger
+            reader_->fit_period(backend_.period_size());
+            reader_->open(a.input_file, duration, a.start_offset_secs);
+        } catch (...) {
+            // Worker may have died, so don't reuse it for the next job
+            reader_.reset();
+            throw;
+        }
+    } else {
+        reader_.reset();
+        reader_.reset(new Reader {
+            a.input_file,
+            sample_rate,
+            a.output_ports.size(),
+            buffer_size,
+            duration,
+            a.start_offset_secs,
+            transport_,
+            a.low_watermark,
+            a.preload
+        });
+        reader_->set_buffer_periods(a.buffer_periods);
+    }
+    output_file_ = a.output_file;
+    if (a.output_file.empty()) {
+        writer_.reset();
+    } else if (writer_ && writer_->channel_count() == a.input_ports.size()) {
+        try {
+            writer_->open(a.output_file, duration);
+        } catch (...) {
+            writer_.reset();
+            throw;
+        }
+    } else {
+        writer_.reset();
+        writer_.reset(new Writer {
+            a.output_file,
+            sample_rate,
+            a.input_ports.size(),
+            buffer_size,
+            duration,
+            transport_,
+            a.high_watermark,
+            a.record_float,
+            wav_io_
+        });
+        writer_->set_buffer_periods(a.buffer_periods);
+    }
+    reactor_.start(
+        a.input_ports,
+        a.output_ports,
+        reader_.get(),
+        writer_.get(),
+        false,
+        static_cast<size_t>(job.gap_secs * sample_rate + .5)
+    );
+}
+
+void Session::finish() {
+    if (writer_) {
+        if (mark_events_) {
+            report_events(reactor_.events(), *writer_, output_file_, backend_.sample_rate());
+        }
+        writer_->close();
+    }
+}
+
+optional<size_t> Session::frames_read() const {
+    if (!reader_) {
+        return boost::none;
+    }
+    return reader_->frames_done();
+}
+
+optional<size_t> Session::frames_written() const {
+    if (!writer_) {
+        return boost::none;
+    }
+    return writer_->frames_done();
+}
+
+void report_events(const vector<RunEvent>& events, Writer& writer, const string& output_file, size_t sample_rate) {
+    if (is_shared_memory(output_file)) {
+        return;
+    }
+    for (const auto& e: events) {
+        const string name = engine_event_name(e.event);
+        writer.mark(e.frame, e.value != 0 ? str(format("%1% %2%") % name % e.value) : name);
+    }
+    const string path = output_file + ".events.json";
+    std::ofstream out{path};
+    out << std::fixed << std::setprecision(6) << "{\n  \"sample_rate\": " << sample_rate << ",\n  \"events\": [";
+    const char* separator = "\n";
+    for (const auto& e: events) {
+        out << separator << "    {\"event\": \"" << engine_event_name(e.event) << "\", \"value\": " << e.value
+            << ", \"frame\": " << e.frame << ", \"seconds\": " << e.frame / (double)sample_rate
+            << ", \"frame_time\": " << e.frame_time << "}";
+        separator = ",\n";
+    }
+    out << (events.empty() ? "]\n}\n" : "\n  ]\n}\n");
+    out.close();
+    if (!out) {
+        throw runtime_error{str(format("failed writing engine events to %1%") % path)};
+    }
+    ldebug("report_events(): %zd events written to %s\n", events.size(), path.c_str());
+}
+
+void run_batch(Backend& backend, const Args& args) {
+    auto jobs = read_jobs(args.batch_file, args);
+    // Ports are registered once, for the job using most of them
+    size_t input_count = 0;
+    size_t output_count = 0;
+    for (auto& job: jobs) {
+        fixup_default_ports(job.args, backend);
+        if (!job.args.output_file.empty()) {
+            input_count = std::max(input_count, job.args.input_ports.size());
+        }
+        if (!job.args.input_file.empty()) {
+            output_count = std::max(output_count, job.args.output_ports.size());
+        }
+    }
+    if (args.auto_buffer_ms) {
+        // One size for all jobs, so that workers can be reused between them
+        vector<Args*> job_args;
+        for (auto& job: jobs) {
+            job_args.push_back(&job.args);
+        }
+        auto_size_buffers(job_args, backend.sample_rate(), backend.period_size(), *args.auto_buffer_ms);
+    }
+
+    Session session{backend, args, input_count, output_count};
+    size_t done = 0;
+    for (auto& job: jobs) {
+        session.start(job);
+        session.wait();
+        // Interrupted take is closed and reported all the same, as with a single run
+        session.finish();
+
+        std::cout << "job " << job.id << ":";
+        if (auto frames = session.frames_read()) {
+            print_frames(" frames read: ", *frames, backend.sample_rate());
+        }
+        if (auto frames = session.frames_written()) {
+            print_frames(" frames written: ", *frames, backend.sample_rate());
+        }
+        std::cout << "\n";
+        if (session.stopped()) {
+            break;
+        }
+        ++done;
+    }
+    if (!args.stats_file.empty()) {
+        session.write_stats(args.stats_file);
+    }
+    if (done != jobs.size()) {
+        throw runtime_error{str(format("batch stopped after %1% of %2% jobs") % done % jobs.size())};
+    }
+}
+
+}
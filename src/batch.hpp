@@ -0,0 +1,73 @@
+#pragma once
+#include "types.hpp"
+#include "cli.hpp"
+#include "io.hpp"
+#include "reactor.hpp"
+
+#include <memory>
+#include <chrono>
+
+namespace olo {
+
+// Play/record run of a session
+struct Job {
+    // Line number in job list or id assigned by daemon, for diagnostics
+    size_t id;
+    // Command line arguments with the options given for the job replaced
+    Args args;
+    // Silence before the job, counted from the end of the previous one
+    double gap_secs;
+};
+
+// Parses job given by key=value pairs separated with spaces: read, write, in, out, duration,
+// start, gap. Values containing spaces may be double-quoted. Options not given default to
+// those in `defaults`. Returns none for empty lines and comments starting with #.
+optional<Job> parse_job(const string& text, size_t id, const Args& defaults);
+
+// Parses job list, one job per line.
+vector<Job> read_jobs(const string& path, const Args& defaults);
+
+// Runs jobs one after another with the same ports and, where channel counts allow, the same
+// ringbuffers and IO threads. Only connections are changed between jobs.
+class Session {
+    Backend& backend_;
+    Reactor reactor_;
+    Transport transport_;
+    WavIo wav_io_;
+    bool mark_events_;
+    // Recording of the current job
+    string output_file_;
+    std::unique_ptr<Reader> reader_;
+    std::unique_ptr<Writer> writer_;
+
+public:
+    explicit Session(Backend& backend, const Args& args, size_t input_count, size_t output_count);
+    // Reader and Writer must be stopped before Reactor is destroyed
+    ~Session() noexcept(false);
+
+    // Opens files of the job and starts it, the previous one must have finished
+    void start(Job job);
+    // Returns true once the job has finished, rethrows failures of the session
+    bool wait(std::chrono::milliseconds timeout) { return reactor_.wait_finished(timeout); }
+    void wait() { reactor_.wait_finished(); }
+    // Ends the job early
+    void cancel() { reactor_.cancel(); }
+    // Closes files of the finished job
+    void finish();
+    // True if session was stopped by a signal, engine shutdown or failure
+    bool stopped() const { return reactor_.stopped(); }
+    // Frames read and written by the last job, none if it didn't play or record
+    optional<size_t> frames_read() const;
+    optional<size_t> frames_written() const;
+    // Writes Jack thread measurements of all jobs so far to a JSON file
+    void write_stats(const string& path) const { write_stats_file(path, reactor_.stats(), backend_.sample_rate()); }
+};
+
+// Marks engine events of a finished run as cue points in the recording of `writer`, to be
+// added when it's closed, and lists them in <output_file>.events.json
+void report_events(const vector<RunEvent>& events, Writer& writer, const string& output_file, size_t sample_rate);
+
+// Runs jobs of the list given with --batch back to back in a single session.
+void run_batch(Backend& backend, const Args& args);
+
+}
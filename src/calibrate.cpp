@@ -0,0 +1,184 @@
+#include "calibrate.hpp"
+#include "shm.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <map>
+#include <chrono>
+#include <random>
+#include <limits>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#ifdef __linux__
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+namespace {
+// Long enough to get past write caches of the device, short enough not to delay the start much
+const size_t PROBE_BLOCK = 1 << 20;
+const size_t PROBE_BLOCKS = 16;
+// Samples are moved to and from disk as 32-bit values at most
+const size_t BYTES_PER_SAMPLE = 4;
+
+using Clock = std::chrono::steady_clock;
+
+double seconds(Clock::time_point begin, Clock::time_point end) {
+    return std::chrono::duration<double>(end - begin).count();
+}
+
+StorageSpeed speed(size_t bytes, double total_secs, double worst_secs) {
+    return {
+        total_secs > 0 ? bytes / total_secs : std::numeric_limits<double>::infinity(),
+        worst_secs
+    };
+}
+
+string directory_of(const string& path) {
+    const auto slash = path.rfind('/');
+    if (slash == string::npos) {
+        return ".";
+    }
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+}
+
+#ifdef __linux__
+StorageSpeed measure_write(const string& path) {
+    const string probe = str(format("%1%/.arrow1-probe-%2%") % directory_of(path) % getpid());
+    const int fd = open(probe.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        throw runtime_error{str(format("can't create storage probe %1%: %2%") % probe % std::strerror(errno))};
+    }
+    // Random bytes, so that compressing filesystems can't cheat
+    vector<unsigned char> block(PROBE_BLOCK);
+    std::minstd_rand random;
+    std::generate(block.begin(), block.end(), [&random] { return static_cast<unsigned char>(random()); });
+    double total = 0;
+    double worst = 0;
+    int error = 0;
+    for (size_t i = 0; i != PROBE_BLOCKS && error == 0; ++i) {
+        errno = 0;
+        const auto begin = Clock::now();
+        if (write(fd, block.data(), block.size()) != static_cast<ssize_t>(block.size()) || fdatasync(fd) != 0) {
+            error = errno != 0 ? errno : ENOSPC;
+        }
+        const double secs = seconds(begin, Clock::now());
+        total += secs;
+        worst = std::max(worst, secs);
+    }
+    close(fd);
+    unlink(probe.c_str());
+    if (error != 0) {
+        throw runtime_error{str(format("failed writing storage probe %1%: %2%") % probe % std::strerror(error))};
+    }
+    return speed(PROBE_BLOCK * PROBE_BLOCKS, total, worst);
+}
+
+StorageSpeed measure_read(const string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error{str(format("can't open %1% for storage probe: %2%") % path % std::strerror(errno))};
+    }
+    // Pages cached from earlier runs would make any storage look fast
+    posix_fadvise(fd, 0, PROBE_BLOCK * PROBE_BLOCKS, POSIX_FADV_DONTNEED);
+    vector<unsigned char> block(PROBE_BLOCK);
+    size_t bytes = 0;
+    double total = 0;
+    double worst = 0;
+    for (size_t i = 0; i != PROBE_BLOCKS; ++i) {
+        const auto begin = Clock::now();
+        const ssize_t n = read(fd, block.data(), block.size());
+        const double secs = seconds(begin, Clock::now());
+        if (n < 0) {
+            const int error = errno;
+            close(fd);
+            throw runtime_error{str(format("failed reading %1% for storage probe: %2%") % path % std::strerror(error))};
+        }
+        if (n == 0) {
+            break;
+        }
+        bytes += n;
+        total += secs;
+        worst = std::max(worst, secs);
+    }
+    close(fd);
+    return speed(bytes, total, worst);
+}
+#else
+StorageSpeed measure_write(const string&) {
+    throw runtime_error{"storage calibration is not supported on this platform"};
+}
+
+StorageSpeed measure_read(const string&) {
+    throw runtime_error{"storage calibration is not supported on this platform"};
+}
+#endif
+
+size_t calibrate_buffer_size(const vector<StreamDemand>& streams, size_t sample_rate, size_t period_size, double headroom_ms) {
+    // Jobs of a batch tend to share directories, which need measuring only once
+    std::map<string, StorageSpeed> measured;
+    // Frames that must be buffered when IO thread is woken, for it to have `headroom_ms` to spare
+    double margin_frames = headroom_ms / 1000 * sample_rate;
+    for (auto& stream: streams) {
+        if (is_shared_memory(stream.path)) {
+            continue;
+        }
+        const string key = stream.record ? "w:" + directory_of(stream.path) : "r:" + stream.path;
+        auto it = measured.find(key);
+        if (it == measured.end()) {
+            it = measured.emplace(key, stream.record ? measure_write(stream.path) : measure_read(stream.path)).first;
+            linfo("calibrate_buffer_size(): %s %s: %.1f MB/s, worst block %.1f ms\n",
+                stream.record ? "writing next to" : "reading", stream.path.c_str(),
+                it->second.bytes_per_sec / 1e6, it->second.worst_latency_secs * 1e3);
+        }
+        const StorageSpeed& speed = it->second;
+        const double required = static_cast<double>(stream.channels) * sample_rate * BYTES_PER_SAMPLE;
+        if (speed.bytes_per_sec <= required) {
+            throw runtime_error{str(format("storage is too slow for %1% %2%: it sustains %3$.1f MB/s, "
+                "but %4% channels at %5% Hz need %6$.1f MB/s")
+                % (stream.record ? "recording to" : "playing") % stream.path
+                % (speed.bytes_per_sec / 1e6) % stream.channels % sample_rate % (required / 1e6))};
+        }
+        // While IO thread moves a cycle worth of the margin, Jack thread consumes or produces
+        // it: latency + margin * required / speed must fit in margin / rate, with headroom
+        const double secs = (speed.worst_latency_secs + headroom_ms / 1000) / (1 - required / speed.bytes_per_sec);
+        margin_frames = std::max(margin_frames, secs * sample_rate);
+    }
+    // IO thread is only woken at period boundaries
+    const size_t margin = static_cast<size_t>(std::ceil(margin_frames)) + period_size;
+    const size_t periods = (2 * margin + period_size - 1) / period_size;
+    const size_t buffer_size = periods * period_size;
+    linfo("calibrate_buffer_size(): ringbuffers of %zd frames (%.1f ms) for %.1f ms of headroom\n",
+        buffer_size, buffer_size * 1e3 / sample_rate, headroom_ms);
+    return buffer_size;
+}
+
+void auto_size_buffers(const vector<Args*>& args, size_t sample_rate, size_t period_size, double headroom_ms) {
+    vector<StreamDemand> streams;
+    for (auto a: args) {
+        if (!a->input_file.empty() && !a->preload) {
+            streams.push_back({a->input_file, a->output_ports.size(), false});
+        }
+        if (!a->output_file.empty()) {
+            streams.push_back({a->output_file, a->input_ports.size(), true});
+        }
+    }
+    const size_t buffer_size = calibrate_buffer_size(streams, sample_rate, period_size, headroom_ms);
+    for (auto a: args) {
+        a->buffer_size = buffer_size;
+        a->low_watermark = CALIBRATED_WATERMARK;
+        a->high_watermark = CALIBRATED_WATERMARK;
+    }
+}
+
+}
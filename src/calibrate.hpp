@@ -0,0 +1,43 @@
+#pragma once
+#include "types.hpp"
+#include "cli.hpp"
+
+namespace olo {
+
+// Sizing of ringbuffers from throughput and latency of the storage behind playback and record
+// files, measured with short probes before a run.
+
+// Watermark of both Reader and Writer with calibrated ringbuffers: IO thread is woken with half
+// of the ringbuffer left as margin and moves the other half in a cycle
+const double CALIBRATED_WATERMARK = .5;
+
+struct StorageSpeed {
+    double bytes_per_sec;
+    // Longest single block transfer, in seconds
+    double worst_latency_secs;
+};
+
+// Writes a probe file next to `path`, syncing each block to the device, and removes it
+StorageSpeed measure_write(const string& path);
+// Reads the start of file at `path` after dropping it from page cache
+StorageSpeed measure_read(const string& path);
+
+// Disk stream an IO thread has to keep up with
+struct StreamDemand {
+    string path;
+    size_t channels;
+    // Recording to `path` rather than playing it
+    bool record;
+};
+
+// Measures storage behind `streams` and returns ringbuffer size in frames, in whole periods,
+// which with CALIBRATED_WATERMARK gives IO threads `headroom_ms` over the worst latency seen.
+// Throws if the storage can't sustain 4 bytes a sample for any of the streams. Shared memory
+// isn't measured.
+size_t calibrate_buffer_size(const vector<StreamDemand>& streams, size_t sample_rate, size_t period_size, double headroom_ms);
+
+// Calibrates for the playback and record files of all `args`, whose port lists must be
+// final, and sets their buffer sizes and watermarks to the result
+void auto_size_buffers(const vector<Args*>& args, size_t sample_rate, size_t period_size, double headroom_ms);
+
+}
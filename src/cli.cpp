@@ -1,4 +1,6 @@
 #include "cli.hpp"
+#include "backend.hpp"
+#include "io.hpp"
 
 #include <boost/program_options.hpp>
 #include <boost/tokenizer.hpp>
@@ -12,27 +14,30 @@ const vector<string> Args::PORTS_DEFAULT = {"__default"};
 namespace po = boost::program_options;
 
 namespace {
-auto split_ports(const vector<string>& ports) {
-    vector<string> res;
-    for (auto& port: ports) {
-        boost::tokenizer<boost::char_separator<char>> tok(port,
-            boost::char_separator<char>(","));
-        std::copy(tok.begin(), tok.end(), std::back_inserter(res));
-    }
-    return res;
-}
-
 bool validate(const po::variables_map& vm, Args& args) {
     if (args.show_ports || args.show_version) {
         // These args override any others and disable their validation
         return true;
     }
-    if (args.output_file.empty() && args.input_file.empty()) {
+    if (args.daemon && !args.batch_file.empty()) {
+        std::cerr << "Options --daemon and --batch cannot be set at the same time\n";
+        return false;
+    }
+    if (!args.batch_file.empty() || args.daemon) {
+        if (!args.output_file.empty() || !args.input_file.empty()) {
+            std::cerr << "Playback and record files are given by jobs with --batch and --daemon\n";
+            return false;
+        }
+        if (args.gap_secs < 0) {
+            std::cerr << "Gap must not be negative\n";
+            return false;
+        }
+    } else if (args.output_file.empty() && args.input_file.empty()) {
         std::cerr << ABOUT <<
         "\nNo playback or record files specified. Nothing to do!\n";
         return false;
     }
-    if (!args.output_file.empty() && args.input_file.empty() && !args.duration_secs) {
+    if (!args.output_file.empty() && args.input_file.empty() && !args.duration_secs && !is_shared_memory(args.output_file)) {
         std::cerr << "Recording requires a playback file name and/or a duration to be specified\n";
         return false;
     }
@@ -44,10 +49,40 @@ bool validate(const po::variables_map& vm, Args& args) {
         std::cerr << "Duration must not be negative\n";
         return false;
     }
+    if (args.low_watermark < 0 || args.low_watermark > 1 || args.high_watermark < 0 || args.high_watermark > 1) {
+        std::cerr << "Watermarks must be within [0, 1] range\n";
+        return false;
+    }
+    if (args.auto_buffer_ms) {
+        if (*args.auto_buffer_ms < 0) {
+            std::cerr << "Buffer headroom must not be negative\n";
+            return false;
+        }
+        if (args.daemon) {
+            std::cerr << "Option --auto-buffer is not supported with --daemon\n";
+            return false;
+        }
+        if (vm.count("buffer") != 0 || args.buffer_periods != 0) {
+            std::cerr << "Options --auto-buffer and --buffer/--buffer-periods cannot be set at the same time\n";
+            return false;
+        }
+    }
+    if (args.uring && !args.record_float) {
+        std::cerr << "Option --uring requires --float\n";
+        return false;
+    }
+    if (args.direct_io && !args.uring) {
+        std::cerr << "Option --direct requires --uring\n";
+        return false;
+    }
     if (args.start_offset_secs < 0) {
         std::cerr << "Start offset must not be negative\n";
         return false;
     }
+    if (args.offline && (args.offline_rate == 0 || args.offline_period == 0)) {
+        std::cerr << "Offline sample rate and period must be positive\n";
+        return false;
+    }
     // For compatibility with comma-separated input
     args.input_ports = split_ports(args.input_ports);
     args.output_ports = split_ports(args.output_ports);
@@ -55,6 +90,32 @@ bool validate(const po::variables_map& vm, Args& args) {
 }
 }
 
+vector<string> split_ports(const vector<string>& ports) {
+    vector<string> res;
+    for (auto& port: ports) {
+        boost::tokenizer<boost::char_separator<char>> tok(port,
+            boost::char_separator<char>(","));
+        std::copy(tok.begin(), tok.end(), std::back_inserter(res));
+    }
+    return res;
+}
+
+void fixup_default_ports(Args& args, const Backend& backend) {
+    if(args.input_ports == Args::PORTS_DEFAULT) {
+        args.input_ports = backend.capture_ports();
+        if (args.input_channel_count) {
+            args.input_ports.resize(std::min(*args.input_channel_count, args.input_ports.size()));
+        }
+    }
+    if(args.output_ports == Args::PORTS_DEFAULT) {
+        args.output_ports = backend.playback_ports();
+        if (!args.input_file.empty()) {
+            auto channels = query_audio_file_channels(args.input_file);
+            args.output_ports.resize(std::min(args.output_ports.size(), channels));
+        }
+    }
+}
+
 Args handle_cli(int argc, char** argv) {
     Args args;
     po::options_description opts("Options");
@@ -69,6 +130,30 @@ Args handle_cli(int argc, char** argv) {
             "Allow debugging output")
         ("buffer,b", po::value(&args.buffer_size),
             "Jack buffer size in samples")
+        ("buffer-periods", po::value(&args.buffer_periods),
+            "Size buffers to this many Jack periods instead of --buffer, and resize them when Jack period size changes during a run")
+        ("auto-buffer", po::value(&args.auto_buffer_ms),
+            "Measure storage throughput and latency with short probe files before starting, and size buffers and watermarks to leave disk threads this many ms of headroom ; refuses to start if storage can't keep up")
+        ("low-watermark", po::value(&args.low_watermark),
+            "Fraction of --buffer ; playback disk thread is woken to refill when the buffer fill drops to this level")
+        ("high-watermark", po::value(&args.high_watermark),
+            "Fraction of --buffer ; recording disk thread is woken to drain when the buffer fill reaches this level")
+        ("planar", po::bool_switch(&args.planar),
+            "Use a separate ringbuffer per channel, so that samples are (de)interleaved by disk threads instead of Jack thread ; reduces Jack thread load with high channel counts")
+        ("preload", po::bool_switch(&args.preload),
+            "Decode the whole playback range into locked memory before starting, so that playback needs no disk thread and no ringbuffer ; for playback files which fit in RAM")
+        ("freewheel", po::bool_switch(&args.freewheel),
+            "Put Jack into freewheel mode, running the graph as fast as it and the disk allow instead of in real time ; no samples are dropped, but hardware isn't played or recorded meanwhile")
+        ("offline", po::bool_switch(&args.offline),
+            "Run without Jack, processing periods as fast as the disk allows ; for file-to-file runs and benchmarks")
+        ("offline-rate", po::value(&args.offline_rate),
+            "Sample rate of the --offline engine")
+        ("offline-period", po::value(&args.offline_period),
+            "Period size of the --offline engine in samples")
+        ("offline-channels", po::value(&args.offline_channels),
+            "Number of playback and record channels of the --offline engine")
+        ("offline-capture", po::value(&args.offline_capture),
+            "Signal recorded from the --offline engine: silence, noise, sine:<frequency in Hz>, loopback (what was played back) or a sound file path ; a sound file sets the number of record channels and stops processing at its end")
         ("in,i", po::value(&args.input_ports),
             "Jack input (record) channels, specified using a comma-separated list ; first item specifies which Jack channel to route to soundfile ch 1, etc")
         ("input-channel-count,I", po::value(&args.input_channel_count),
@@ -79,8 +164,28 @@ Args handle_cli(int argc, char** argv) {
             "Duration of playback and recording in s ; if not set, the duration of playback file will be used ; required for recording without playback ; use 0 to record until terminated with ^C")
         ("start,s", po::value(&args.start_offset_secs),
             "Offset to start at when reading playback file, in s")
-        ("read-file,r", po::value(&args.input_file), "File path to read playback audio data from, in any format supported by libsndfile")
-        ("write-file,w", po::value(&args.output_file), "File path to write recorded audio data to, in wav format ; warning, existing files will be overwritten")
+        ("read-file,r", po::value(&args.input_file), "File path to read playback audio data from, in any format supported by libsndfile ; or shm:<name> of a POSIX shared memory segment with arrow1 header")
+        ("write-file,w", po::value(&args.output_file), "File path to write recorded audio data to, in wav format ; warning, existing files will be overwritten ; or shm:<name> of a shared memory segment, created with the size given by duration unless it exists")
+        ("float", po::bool_switch(&args.record_float),
+            "Record 32-bit float WAV instead of 32-bit integer one ; samples are written as they are without conversion, and files past 4 GiB become RF64")
+        ("uring", po::bool_switch(&args.uring),
+            "With --float, write recordings through io_uring in large blocks, several at a time, so that a slow write doesn't hold up draining the buffer ; Linux only, falls back to plain writes if unavailable")
+        ("direct", po::bool_switch(&args.direct_io),
+            "With --uring, bypass page cache using direct IO where the filesystem supports it")
+        ("batch", po::value(&args.batch_file),
+            "File listing jobs to run one after another reusing the same ports, buffers and threads ; one job per line as key=value pairs: read, write, in, out, duration, start, gap ; quote values containing spaces ; other options are used as defaults")
+        ("gap", po::value(&args.gap_secs),
+            "Silence between --batch jobs in s, counted from the end of the previous job to the sample if it's long enough to set up the next one")
+        ("daemon", po::bool_switch(&args.daemon),
+            "Keep running and accept jobs over a Unix domain socket, see --socket ; requests are lines: job <key=value...> as with --batch, status [id], wait <id>, cancel <id> or quit ; other options are used as job defaults")
+        ("socket", po::value(&args.socket_path),
+            "Socket path of --daemon")
+        ("stats", po::value(&args.stats_file),
+            "Write JSON summary of Jack callback durations, deadline margins and ringbuffer fill levels to this file at exit ; for telling how close to xruns a configuration runs")
+        ("trace", po::value(&args.trace_file),
+            "Write timeline of Jack callbacks, ringbuffer fill levels and IO thread activity to this file at exit ; Chrome trace event JSON for chrome://tracing or Perfetto")
+        ("events", po::bool_switch(&args.mark_events),
+            "Mark Jack xruns, buffer size, sample rate and graph order changes during a recording as cue points in the file and list them with their frame offsets in <record-file>.events.json")
     ;
     po::positional_options_description pos;
     pos.add("play-file", 1).add("record-file", 1);
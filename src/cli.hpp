@@ -10,15 +10,43 @@ struct Args {
     bool debug = false;
     bool show_version = false;
     size_t buffer_size = BUFFER_SIZE_DEFAULT;
+    size_t buffer_periods = 0;
+    optional<double> auto_buffer_ms;
+    bool planar = false;
+    double low_watermark = LOW_WATERMARK_DEFAULT;
+    double high_watermark = HIGH_WATERMARK_DEFAULT;
+    bool preload = false;
     optional<size_t> input_channel_count;
     vector<string> input_ports = PORTS_DEFAULT;
     vector<string> output_ports = PORTS_DEFAULT;
     string input_file;
     string output_file;
+    bool record_float = false;
+    bool uring = false;
+    bool direct_io = false;
     optional<double> duration_secs;
     double start_offset_secs = 0.;
+    bool freewheel = false;
+    bool offline = false;
+    size_t offline_rate = OFFLINE_RATE_DEFAULT;
+    size_t offline_period = OFFLINE_PERIOD_DEFAULT;
+    size_t offline_channels = OFFLINE_CHANNELS_DEFAULT;
+    string offline_capture = "silence";
+    string batch_file;
+    double gap_secs = 0.;
+    bool daemon = false;
+    string socket_path = DAEMON_SOCKET_DEFAULT;
+    string stats_file;
+    string trace_file;
+    bool mark_events = false;
 };
 
 Args handle_cli(int argc, char** argv);
 
+// Splits comma-separated port lists
+vector<string> split_ports(const vector<string>& ports);
+
+// Replaces PORTS_DEFAULT with physical ports of the engine
+void fixup_default_ports(Args& args, const Backend& backend);
+
 }
@@ -0,0 +1,496 @@
+#include "daemon.hpp"
+#include "batch.hpp"
+#include "backend.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <stdexcept>
+
+#ifdef _WIN32
+
+namespace olo {
+
+void run_daemon(Backend&, const Args&) {
+    throw std::runtime_error{"daemon mode is not supported on this platform"};
+}
+
+}
+
+#else
+
+#include <map>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+namespace {
+// How often the queue is checked for finished jobs while one is running. Submissions are
+// dispatched as soon as they arrive regardless.
+const int BUSY_POLL_INTERVAL_MS = 1;
+const int IDLE_POLL_INTERVAL_MS = 50;
+// Number of finished jobs remembered for status queries
+const size_t HISTORY_MAX = 1000;
+// Longest request accepted, clients sending longer lines are dropped
+const size_t LINE_MAX_SIZE = 65536;
+
+enum class State {
+    QUEUED,
+    RUNNING,
+    DONE,
+    CANCELLED,
+    FAILED
+};
+
+const char* state_name(State state) {
+    switch (state) {
+    case State::QUEUED: return "queued";
+    case State::RUNNING: return "running";
+    case State::DONE: return "done";
+    case State::CANCELLED: return "cancelled";
+    case State::FAILED: return "failed";
+    }
+    return "unknown";
+}
+
+struct Entry {
+    Job job;
+    State state;
+    optional<size_t> frames_read;
+    optional<size_t> frames_written;
+    string error;
+    // Set when cancel was requested while the job was running
+    bool cancelled = false;
+    // Clients waiting for the job to finish
+    vector<int> waiters;
+};
+
+// Closes file descriptor on scope exit
+class FileDescriptor {
+    int fd_;
+
+public:
+    explicit FileDescriptor(int fd = -1): fd_{fd} {}
+    ~FileDescriptor() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+    int get() const { return fd_; }
+    void reset(int fd) {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        fd_ = fd;
+    }
+    int release() {
+        int fd = fd_;
+        fd_ = -1;
+        return fd;
+    }
+};
+
+struct Client {
+    FileDescriptor fd;
+    // Received bytes not terminated by newline yet
+    string input;
+
+    explicit Client(int fd): fd{fd} {}
+};
+
+sockaddr_un socket_address(const string& path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw runtime_error{str(format("socket path is too long: %1%") % path)};
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+void set_nonblocking(int fd) {
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        throw runtime_error{str(format("failed setting socket non-blocking: %1%") % std::strerror(errno))};
+    }
+}
+
+class Daemon {
+    const Args& args_;
+    string path_;
+    Session session_;
+    FileDescriptor listener_;
+    bool listening_ = false;
+    vector<std::unique_ptr<Client>> clients_;
+    std::map<size_t, Entry> jobs_;
+    std::deque<size_t> queue_;
+    optional<size_t> running_;
+    size_t next_id_ = 1;
+    bool quit_ = false;
+
+    void listen();
+    void accept();
+    // Returns false if client should be dropped
+    bool receive(Client& client);
+    void handle(int fd, const string& line);
+    void reply(int fd, const string& line);
+    string describe(size_t id, const Entry& entry) const;
+    Entry* find(const string& id_text);
+    void submit(int fd, const string& spec);
+    void cancel(int fd, const string& id_text);
+    void dispatch();
+    void poll_running(std::chrono::milliseconds timeout);
+    void complete(size_t id, State state, const string& error = {});
+    void drop(int fd);
+
+public:
+    Daemon(Backend& backend, const Args& args, size_t input_count, size_t output_count);
+    ~Daemon();
+    void run();
+};
+
+Daemon::Daemon(Backend& backend, const Args& args, size_t input_count, size_t output_count):
+    args_{args},
+    path_{args.socket_path},
+    session_{backend, args, input_count, output_count}
+{
+    listen();
+}
+
+Daemon::~Daemon() {
+    if (listening_) {
+        ::unlink(path_.c_str());
+    }
+}
+
+void Daemon::listen() {
+    auto addr = socket_address(path_);
+    struct stat st;
+    if (::stat(path_.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            throw runtime_error{str(format("socket path exists and isn't a socket: %1%") % path_)};
+        }
+        // Leftover of a daemon which didn't exit cleanly is removed, a live one is left alone
+        FileDescriptor probe{::socket(AF_UNIX, SOCK_STREAM, 0)};
+        if (::connect(probe.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+            throw runtime_error{str(format("another daemon is listening on %1%") % path_)};
+        }
+        ldebug("Daemon::listen(): removing stale socket %s\n", path_.c_str());
+        ::unlink(path_.c_str());
+    }
+
+    FileDescriptor fd{::socket(AF_UNIX, SOCK_STREAM, 0)};
+    if (fd.get() < 0) {
+        throw runtime_error{str(format("failed creating socket: %1%") % std::strerror(errno))};
+    }
+    if (::bind(fd.get(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        throw runtime_error{str(format("failed binding socket %1%: %2%") % path_ % std::strerror(errno))};
+    }
+    listening_ = true;
+    // Jobs write files wherever asked, so only the owner may submit them
+    ::chmod(path_.c_str(), S_IRUSR | S_IWUSR);
+    if (::listen(fd.get(), SOMAXCONN) != 0) {
+        throw runtime_error{str(format("failed listening on socket %1%: %2%") % path_ % std::strerror(errno))};
+    }
+    set_nonblocking(fd.get());
+    listener_.reset(fd.release());
+    linfo("Daemon: listening on %s\n", path_.c_str());
+}
+
+void Daemon::accept() {
+    int fd = ::accept(listener_.get(), nullptr, nullptr);
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            lerror("Daemon::accept(): failed accepting connection: %s\n", std::strerror(errno));
+        }
+        return;
+    }
+    clients_.emplace_back(new Client{fd});
+    set_nonblocking(fd);
+    ldebug("Daemon::accept(): client %d connected\n", fd);
+}
+
+bool Daemon::receive(Client& client) {
+    char buff[4096];
+    ssize_t count = ::recv(client.fd.get(), buff, sizeof(buff), 0);
+    if (count < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (count == 0) {
+        return false;
+    }
+    client.input.append(buff, count);
+    size_t pos;
+    while ((pos = client.input.find('\n')) != string::npos) {
+        auto line = client.input.substr(0, pos);
+        client.input.erase(0, pos + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        handle(client.fd.get(), line);
+    }
+    return client.input.size() <= LINE_MAX_SIZE;
+}
+
+void Daemon::reply(int fd, const string& line) {
+    auto msg = line + "\n";
+    // Replies are short enough to fit socket buffer, a client not reading them is its problem
+    if (::send(fd, msg.data(), msg.size(), 0) != static_cast<ssize_t>(msg.size())) {
+        ldebug("Daemon::reply(): failed replying to client %d\n", fd);
+    }
+}
+
+string Daemon::describe(size_t id, const Entry& entry) const {
+    auto res = str(format("ok id=%1% state=%2%") % id % state_name(entry.state));
+    if (entry.frames_read) {
+        res += str(format(" read=%1%") % *entry.frames_read);
+    }
+    if (entry.frames_written) {
+        res += str(format(" written=%1%") % *entry.frames_written);
+    }
+    if (!entry.error.empty()) {
+        // Message may contain spaces, so it goes last
+        res += " error=" + entry.error;
+    }
+    return res;
+}
+
+Entry* Daemon::find(const string& id_text) {
+    size_t id = 0;
+    try {
+        id = std::stoul(id_text);
+    } catch (std::exception&) {
+        throw runtime_error{str(format("invalid job id: %1%") % id_text)};
+    }
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) {
+        throw runtime_error{str(format("no such job: %1%") % id)};
+    }
+    return &it->second;
+}
+
+void Daemon::handle(int fd, const string& line) {
+    auto space = line.find(' ');
+    auto command = line.substr(0, space);
+    auto rest = space == string::npos ? string{} : line.substr(space + 1);
+    ldebug("Daemon::handle(): client %d: %s\n", fd, line.c_str());
+    try {
+        if (command == "job") {
+            submit(fd, rest);
+        } else if (command == "status") {
+            if (rest.empty()) {
+                reply(fd, str(format("ok running=%1% queued=%2%")
+                    % (running_ ? std::to_string(*running_) : "none") % queue_.size()));
+            } else {
+                reply(fd, describe(std::stoul(rest), *find(rest)));
+            }
+        } else if (command == "wait") {
+            auto entry = find(rest);
+            if (entry->state == State::QUEUED || entry->state == State::RUNNING) {
+                entry->waiters.push_back(fd);
+            } else {
+                reply(fd, describe(std::stoul(rest), *entry));
+            }
+        } else if (command == "cancel") {
+            cancel(fd, rest);
+        } else if (command == "quit") {
+            quit_ = true;
+            reply(fd, "ok");
+        } else {
+            throw runtime_error{str(format("unknown command: %1%") % command)};
+        }
+    } catch (std::exception& ex) {
+        reply(fd, string{"error "} + ex.what());
+    }
+}
+
+void Daemon::submit(int fd, const string& spec) {
+    auto job = parse_job(spec, next_id_, args_);
+    if (!job) {
+        throw runtime_error{"empty job"};
+    }
+    auto id = next_id_++;
+    jobs_.emplace(id, Entry{*job, State::QUEUED, boost::none, boost::none, {}, false, {}});
+    queue_.push_back(id);
+    reply(fd, str(format("ok %1%") % id));
+    dispatch();
+}
+
+void Daemon::cancel(int fd, const string& id_text) {
+    auto entry = find(id_text);
+    auto id = std::stoul(id_text);
+    switch (entry->state) {
+    case State::QUEUED:
+        queue_.erase(std::find(queue_.begin(), queue_.end(), id));
+        complete(id, State::CANCELLED);
+        break;
+    case State::RUNNING:
+        // Reported as cancelled once Jack thread has ended it
+        entry->cancelled = true;
+        session_.cancel();
+        break;
+    default:
+        throw runtime_error{str(format("job %1% has already finished") % id)};
+    }
+    reply(fd, "ok");
+}
+
+void Daemon::dispatch() {
+    while (!running_ && !queue_.empty() && !session_.stopped()) {
+        auto id = queue_.front();
+        queue_.pop_front();
+        auto& entry = jobs_.at(id);
+        try {
+            session_.start(entry.job);
+        } catch (std::exception& ex) {
+            complete(id, State::FAILED, ex.what());
+            continue;
+        }
+        entry.state = State::RUNNING;
+        running_ = id;
+        ldebug("Daemon::dispatch(): started job %zd\n", id);
+    }
+}
+
+void Daemon::poll_running(std::chrono::milliseconds timeout) {
+    if (!running_) {
+        return;
+    }
+    auto id = *running_;
+    try {
+        if (!session_.wait(timeout)) {
+            return;
+        }
+    } catch (std::exception& ex) {
+        running_ = boost::none;
+        complete(id, State::FAILED, ex.what());
+        throw;
+    }
+    running_ = boost::none;
+    if (session_.stopped()) {
+        complete(id, State::FAILED, "session stopped");
+        return;
+    }
+    auto& entry = jobs_.at(id);
+    try {
+        session_.finish();
+        entry.frames_read = session_.frames_read();
+        entry.frames_written = session_.frames_written();
+    } catch (std::exception& ex) {
+        complete(id, State::FAILED, ex.what());
+        return;
+    }
+    complete(id, entry.cancelled ? State::CANCELLED : State::DONE);
+}
+
+void Daemon::complete(size_t id, State state, const string& error) {
+    auto& entry = jobs_.at(id);
+    entry.state = state;
+    entry.error = error;
+    ldebug("Daemon::complete(): job %zd %s\n", id, state_name(state));
+    for (int fd: entry.waiters) {
+        reply(fd, describe(id, entry));
+    }
+    entry.waiters.clear();
+    // Forget the oldest finished jobs, ids grow so they're first in the map
+    while (jobs_.size() > HISTORY_MAX) {
+        auto it = std::find_if(jobs_.begin(), jobs_.end(), [](const std::pair<const size_t, Entry>& e) {
+            return e.second.state != State::QUEUED && e.second.state != State::RUNNING;
+        });
+        if (it == jobs_.end()) {
+            break;
+        }
+        jobs_.erase(it);
+    }
+}
+
+void Daemon::drop(int fd) {
+    ldebug("Daemon::drop(): client %d disconnected\n", fd);
+    for (auto& job: jobs_) {
+        auto& waiters = job.second.waiters;
+        waiters.erase(std::remove(waiters.begin(), waiters.end(), fd), waiters.end());
+    }
+    clients_.erase(std::remove_if(clients_.begin(), clients_.end(),
+        [fd](const std::unique_ptr<Client>& c) { return c->fd.get() == fd; }), clients_.end());
+}
+
+void Daemon::run() {
+    vector<pollfd> fds;
+    while (!quit_ && !session_.stopped()) {
+        fds.clear();
+        fds.push_back({listener_.get(), POLLIN, 0});
+        for (auto& client: clients_) {
+            fds.push_back({client->fd.get(), POLLIN, 0});
+        }
+        int timeout = running_ ? BUSY_POLL_INTERVAL_MS : IDLE_POLL_INTERVAL_MS;
+        if (::poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+            throw runtime_error{str(format("failed polling sockets: %1%") % std::strerror(errno))};
+        }
+        // Jack thread can't print, so meanwhile format whatever it has logged
+        rt_log_drain();
+        for (size_t i = 1; i < fds.size(); ++i) {
+            if (fds[i].revents != 0) {
+                auto client = std::find_if(clients_.begin(), clients_.end(),
+                    [&](const std::unique_ptr<Client>& c) { return c->fd.get() == fds[i].fd; });
+                if (!receive(**client)) {
+                    drop(fds[i].fd);
+                }
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            accept();
+        }
+        poll_running(std::chrono::milliseconds{0});
+        dispatch();
+    }
+
+    // Anything left is cancelled
+    if (running_) {
+        jobs_.at(*running_).cancelled = true;
+        session_.cancel();
+        while (running_) {
+            poll_running(std::chrono::milliseconds{IDLE_POLL_INTERVAL_MS});
+        }
+    }
+    for (auto id: queue_) {
+        complete(id, State::CANCELLED);
+    }
+    queue_.clear();
+    if (!args_.stats_file.empty()) {
+        session_.write_stats(args_.stats_file);
+    }
+    linfo("Daemon: exiting after %zd jobs\n", next_id_ - 1);
+}
+}
+
+void run_daemon(Backend& backend, const Args& args) {
+    // Ports are registered once, as many as the engine has unless limited by options
+    Args defaults = args;
+    fixup_default_ports(defaults, backend);
+    // Writes to clients which went away must fail instead of killing us
+    std::signal(SIGPIPE, SIG_IGN);
+    Daemon daemon{backend, args, defaults.input_ports.size(), defaults.output_ports.size()};
+    daemon.run();
+}
+
+}
+
+#endif
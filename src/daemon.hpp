@@ -0,0 +1,18 @@
+#pragma once
+#include "types.hpp"
+#include "cli.hpp"
+
+namespace olo {
+
+// Keeps the engine client with its ports and buffers alive and runs jobs submitted over a
+// Unix domain socket, one after another in the order received. Protocol is line based, each
+// request gets a single line reply starting with "ok" or "error":
+//   job <key=value...>  queue job given like in --batch lists, replies with its id
+//   status [id]         state of the job, or of the queue if id is omitted
+//   wait <id>           replies with the state once the job has finished
+//   cancel <id>         drop queued job or end running one early
+//   quit                cancel all jobs and exit
+// Returns when quit is requested or the session is stopped.
+void run_daemon(Backend& backend, const Args& args);
+
+}
@@ -6,13 +6,24 @@
 
 #include <stdexcept>
 #include <cstring>
+#include <cerrno>
 #include <cassert>
+#include <algorithm>
+
+#ifndef _WIN32
+# include <sys/mman.h>
+#endif
 
 namespace olo {
 using std::runtime_error;
 using boost::format;
 
 namespace {
+// Least amount of mapped file requested to be read ahead
+const size_t PREFETCH_MIN = 1 << 20;
+// Least size of chunks decoded ahead of the ringbuffer
+const size_t READ_AHEAD_CHUNK = 4 << 20;
+
 auto open_sndfile(const string& path, int mode, SF_INFO& si) {
     std::unique_ptr<SNDFILE, decltype(&sf_close)> sf {
         sf_open(path.c_str(), mode, &si),
@@ -30,21 +41,130 @@ auto open_sndfile(const string& path, int mode, SF_INFO& si) {
 }
 }
 
-IoWorker::IoWorker(size_t sample_rate, size_t channel_count, size_t buffer_size):
+IoWorker::IoWorker(size_t sample_rate, size_t channel_count, size_t buffer_size, Transport transport, double watermark):
     sample_rate_{sample_rate},
     channel_count_{channel_count},
     frame_size_{channel_count * sizeof(Sample)},
     buffer_size_{buffer_size},
-    ring_ {
-        jack_ringbuffer_create(buffer_size_ * frame_size_),
-        &jack_ringbuffer_free
-    },
-    buff_{new Sample[buffer_size_ * channel_count_]},
+    transport_{transport},
+    watermark_ratio_{watermark},
+    frame_{new Sample[channel_count_]},
     sf_ {nullptr, sf_close}
 {
-    if (!ring_) {
-        throw runtime_error{str(format("reader unable to allocate ring buffer of %1% bytes")
-            % (buffer_size_ * frame_size_))};
+    create_rings(buffer_size_);
+    if (planar()) {
+        kernels_ = select_kernels(channel_count_);
+        segments_.resize(2 * channel_count_);
+    }
+}
+
+void IoWorker::create_rings(size_t frames) {
+    const size_t ring_count = planar() ? channel_count_ : 1;
+    const size_t ring_size = frames * (planar() ? sizeof(Sample) : frame_size_);
+    decltype(rings_) rings;
+    rings.reserve(ring_count);
+    for (size_t i = 0; i != ring_count; ++i) {
+        rings.emplace_back(jack_ringbuffer_create(ring_size), &jack_ringbuffer_free);
+        if (!rings.back()) {
+            throw runtime_error{str(format("unable to allocate ring buffer of %1% bytes")
+                % ring_size)};
+        }
+    }
+    if (planar()) {
+        buff_.reset(new Sample[frames * channel_count_]);
+    }
+    // Whatever is in the old ringbuffers moves over, all channels hold the same frames when
+    // neither side is in the middle of a transfer
+    for (size_t i = 0; i != rings_.size(); ++i) {
+        jack_ringbuffer_data_t vec[2];
+        jack_ringbuffer_get_read_vector(rings_[i].get(), vec);
+        jack_ringbuffer_write(rings[i].get(), vec[0].buf, vec[0].len);
+        jack_ringbuffer_write(rings[i].get(), vec[1].buf, vec[1].len);
+    }
+    rings_ = std::move(rings);
+    // Jack ringbuffer holds one byte less than its size, so a watermark of the whole buffer
+    // would never be reached by a full one
+    const size_t capacity = (rings_[0]->size - 1) / (planar() ? sizeof(Sample) : frame_size_);
+    watermark_ = std::min(static_cast<size_t>(watermark_ratio_ * frames), capacity - 1);
+}
+
+void IoWorker::fit_period(size_t period_size) {
+    if (buffer_periods_ == 0 || buffer_periods_ * period_size == buffer_size_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock{mutex_};
+    // Shrinking mustn't drop frames which are on their way, so it stops at whole periods
+    // holding them. Ringbuffers hold one byte less than they're created with.
+    const size_t periods = std::max(buffer_periods_, frames_readable() / period_size + 1);
+    const size_t frames = periods * period_size;
+    if (frames == buffer_size_) {
+        return;
+    }
+    ldebug("IoWorker::fit_period(): resizing ringbuffers from %zd to %zd frames for period of %zd frames\n",
+        buffer_size_, frames, period_size);
+    create_rings(frames);
+    buffer_size_ = frames;
+}
+
+size_t IoWorker::frames_readable() const {
+    if (!planar()) {
+        return jack_ringbuffer_read_space(buffer()) / frame_size_;
+    }
+    // Channel ringbuffers are updated one after another, so only the minimum is safe to use
+    size_t frames = jack_ringbuffer_read_space(rings_[0].get());
+    for (auto& ring: rings_) {
+        frames = std::min(frames, jack_ringbuffer_read_space(ring.get()));
+    }
+    return frames / sizeof(Sample);
+}
+
+size_t IoWorker::frames_writable() const {
+    if (!planar()) {
+        return jack_ringbuffer_write_space(buffer()) / frame_size_;
+    }
+    size_t frames = jack_ringbuffer_write_space(rings_[0].get());
+    for (auto& ring: rings_) {
+        frames = std::min(frames, jack_ringbuffer_write_space(ring.get()));
+    }
+    return frames / sizeof(Sample);
+}
+
+void IoWorker::write_planar(const Sample* src, size_t frames) {
+    assert(frames <= frames_writable());
+    // Channel ringbuffers are always advanced together, so their write vectors split at the same frame
+    Sample** head = segments_.data();
+    Sample** tail = head + channel_count_;
+    size_t split = frames;
+    for (size_t c = 0; c != channel_count_; ++c) {
+        jack_ringbuffer_data_t vec[2];
+        jack_ringbuffer_get_write_vector(rings_[c].get(), vec);
+        head[c] = reinterpret_cast<Sample*>(vec[0].buf);
+        tail[c] = reinterpret_cast<Sample*>(vec[1].buf);
+        split = std::min(split, vec[0].len / sizeof(Sample));
+    }
+    kernels_.deinterleave(src, split, channel_count_, head, 0);
+    kernels_.deinterleave(src + split * channel_count_, frames - split, channel_count_, tail, 0);
+    for (auto& ring: rings_) {
+        jack_ringbuffer_write_advance(ring.get(), frames * sizeof(Sample));
+    }
+}
+
+void IoWorker::read_planar(Sample* dst, size_t frames) {
+    assert(frames <= frames_readable());
+    Sample** head = segments_.data();
+    Sample** tail = head + channel_count_;
+    size_t split = frames;
+    for (size_t c = 0; c != channel_count_; ++c) {
+        jack_ringbuffer_data_t vec[2];
+        jack_ringbuffer_get_read_vector(rings_[c].get(), vec);
+        head[c] = reinterpret_cast<Sample*>(vec[0].buf);
+        tail[c] = reinterpret_cast<Sample*>(vec[1].buf);
+        split = std::min(split, vec[0].len / sizeof(Sample));
+    }
+    kernels_.interleave(head, 0, split, channel_count_, dst);
+    kernels_.interleave(tail, 0, frames - split, channel_count_, dst + split * channel_count_);
+    for (auto& ring: rings_) {
+        jack_ringbuffer_read_advance(ring.get(), frames * sizeof(Sample));
     }
 }
 
@@ -63,108 +183,424 @@ void IoWorker::join() {
     }
 }
 
-void IoWorker::wake() {
-    cv_.notify_one();
+void IoWorker::notify() noexcept {
+    if (needs_work() && !wake_pending_.exchange(true)) {
+        if (trace_ != nullptr) {
+            woken_at_ = trace_now();
+        }
+        wake_sem_.post();
+    }
+}
+
+void IoWorker::wake() noexcept {
+    if (trace_ != nullptr) {
+        woken_at_ = trace_now();
+    }
+    wake_pending_ = true;
+    wake_sem_.post();
+}
+
+void IoWorker::wait_progress() {
+    // Set before waking, so that the cycle it wakes the worker for can't miss it
+    progress_wanted_ = true;
+    wake();
+    progress_sem_.wait();
 }
 
 void IoWorker::stop() {
-    if (!break_) {
+    if (!quit_) {
         ldebug("IoWorker::stop(): requesting worker stop\n");
+        quit_ = true;
         break_ = true;
         wake();
     }
     join();
 }
 
+void IoWorker::start() {
+    if (!thread_) {
+        thread_.reset(new std::thread(&IoWorker::pump, this));
+    }
+}
+
+void IoWorker::check_worker() {
+    if (quit_) {
+        join();
+        throw runtime_error{"IO worker is already stopped"};
+    }
+}
+
+void IoWorker::reset_rings() {
+    for (auto& ring: rings_) {
+        jack_ringbuffer_reset(ring.get());
+    }
+}
+
 void IoWorker::pump() {
     try {
-        std::unique_lock<std::mutex> lock{mx_};
-        while (!break_) {
-            cv_.wait(lock);
-            if (break_) {
+        while (!quit_) {
+            wake_sem_.wait();
+            const std::uint64_t woken = trace_ != nullptr ? trace_now() : 0;
+            trace(trace_, TR_WAKE, woken_at_, woken);
+            // Clear before the cycle so that Jack thread may request another one meanwhile
+            wake_pending_ = false;
+            if (quit_) {
                 break;
             }
-            // No need to hold mutex - jack_ringbuffer is lock-free
-            lock.unlock();
-
-            work_cycle();
-
-            lock.lock();
+            {
+                // Worker idles between files
+                std::lock_guard<std::mutex> lock{mutex_};
+                if (!break_) {
+                    const size_t done = done_;
+                    work_cycle();
+                    if (trace_ != nullptr) {
+                        trace(trace_, cycle_event_, woken, trace_now(), done_ - done);
+                    }
+                }
+            }
+            if (progress_wanted_.exchange(false)) {
+                progress_sem_.post();
+            }
         }
+        std::lock_guard<std::mutex> lock{mutex_};
+        flush();
     } catch (...) {
         lerror("IoWorker::pump(): exception in worker thread, will be rethrown on join()\n");
         ex_ = std::current_exception();
+        // Don't leave anybody waiting for progress which won't come
+        quit_ = true;
+        break_ = true;
     }
+    progress_sem_.post();
 }
 
 IoWorker::~IoWorker() noexcept(false) {
     stop();
 }
 
+LockedBuffer::LockedBuffer(size_t size):
+    data_{new Sample[size]},
+    size_{size}
+{
+    if (size_ == 0) {
+        return;
+    }
+#ifndef _WIN32
+    // Faults all pages in, so that the buffer is resident before Jack thread touches it
+    locked_ = mlock(data_.get(), size_ * sizeof(Sample)) == 0;
+    if (!locked_) {
+        linfo("LockedBuffer: failed locking %zd bytes in memory, raise RLIMIT_MEMLOCK to avoid page faults: %s\n",
+            size_ * sizeof(Sample), strerror(errno));
+    }
+#else
+    linfo("LockedBuffer: locking memory is not supported on this platform\n");
+#endif
+}
+
+LockedBuffer::~LockedBuffer() {
+#ifndef _WIN32
+    if (locked_) {
+        munlock(data_.get(), size_ * sizeof(Sample));
+    }
+#endif
+}
+
 Reader::Reader(
     const string& path,
     size_t sample_rate,
     size_t channel_count,
     size_t buffer_size,
     double duration_secs,
-    double start_offset_secs
+    double start_offset_secs,
+    Transport transport,
+    double low_watermark,
+    bool preload
 ):
-    IoWorker{sample_rate, channel_count, buffer_size}
+    IoWorker{sample_rate, channel_count, buffer_size, transport, low_watermark},
+    preload_{preload}
 {
-    SF_INFO si = {0};
-    sf_ = open_sndfile(path, SFM_READ, si);
-    if (si.samplerate != sample_rate_) {
-        throw runtime_error{str(format("playback file sample rate: %1%; engine sample rate: %2%")
-            % si.samplerate % sample_rate_)};
+    trace_ = trace_buffer("reader");
+    open(path, duration_secs, start_offset_secs);
+}
+
+void Reader::open(const string& path, double duration_secs, double start_offset_secs) {
+    check_worker();
+    std::unique_lock<std::mutex> lock{mutex_};
+    if (is_shared_memory(path)) {
+        std::unique_ptr<SharedMemory> shm{new SharedMemory{path, false}};
+        const auto& h = shm->header();
+        check_source("playback shared memory", h.sample_rate, h.channels);
+        size_t start_frame = std::min<size_t>(h.frames, start_offset_secs * sample_rate_ + .5);
+        close_source();
+        memory_ = shm->samples() + start_frame * channel_count_;
+        const size_t frames_avail = h.frames - start_frame;
+        shm_ = std::move(shm);
+        begin(frames_avail, duration_secs, lock);
+        return;
     }
-    if (si.channels != channel_count_) {
-        throw runtime_error{str(format("playback file channels: %1%; engine channels: %2%")
-            % si.channels % channel_count_)};
+    if (open_mapped(path, duration_secs, start_offset_secs, lock)) {
+        return;
     }
+    SF_INFO si = {0};
+    auto sf = open_sndfile(path, SFM_READ, si);
+    check_source("playback file", si.samplerate, si.channels);
     ldebug("Reader: reading from %s with %zd sample rate and %zd channels\n",
         path.c_str(), sample_rate_, channel_count_);
     sf_count_t frames_avail = si.frames;
     sf_count_t start_frame = start_offset_secs * sample_rate_ + .5;
     start_frame = std::min(frames_avail, start_frame);
-    if (sf_seek(sf_.get(), start_frame, SEEK_SET) < 0) {
+    if (sf_seek(sf.get(), start_frame, SEEK_SET) < 0) {
         throw runtime_error{str(format("failed seeking input file to frame %1%")
             % start_frame)};
     }
+    close_source();
     frames_avail -= start_frame;
+    if (preload_) {
+        // Decoded in one go anyway
+        sf_ = std::move(sf);
+    } else {
+        const size_t chunk = std::max(buffer_size_, READ_AHEAD_CHUNK / frame_size_);
+        read_ahead_.reset(new ReadAhead{std::move(sf), path, channel_count_, static_cast<size_t>(si.frames),
+            static_cast<size_t>(start_frame), limit_duration(frames_avail, duration_secs), chunk});
+    }
+    begin(frames_avail, duration_secs, lock);
+}
+
+bool Reader::open_mapped(const string& path, double duration_secs, double start_offset_secs, std::unique_lock<std::mutex>& lock) {
+    std::unique_ptr<MappedFile> mapping;
+    try {
+        mapping.reset(new MappedFile{path});
+    } catch (runtime_error& ex) {
+        ldebug("Reader::open(): %s, falling back to libsndfile\n", ex.what());
+        return false;
+    }
+    auto layout = parse_wav(mapping->data(), mapping->size());
+    if (!layout) {
+        ldebug("Reader::open(): %s isn't uncompressed WAV, falling back to libsndfile\n", path.c_str());
+        return false;
+    }
+    check_source("playback file", layout->sample_rate, layout->channels);
+    ldebug("Reader: reading mapped %s with %zd sample rate and %zd channels\n",
+        path.c_str(), sample_rate_, channel_count_);
+    // Seeking is just pointer arithmetic
+    size_t start_frame = std::min<size_t>(layout->frames, start_offset_secs * sample_rate_ + .5);
+    close_source();
+    mapped_frame_size_ = layout->frame_size();
+    mapped_ = mapping->data() + layout->data_offset + start_frame * mapped_frame_size_;
+    encoding_ = layout->encoding;
+    prefetched_ = 0;
+    mapping_ = std::move(mapping);
+    begin(layout->frames - start_frame, duration_secs, lock);
+    return true;
+}
+
+void Reader::check_source(const char* what, size_t sample_rate, size_t channel_count) const {
+    if (sample_rate != sample_rate_) {
+        throw runtime_error{str(format("%1% sample rate: %2%; engine sample rate: %3%")
+            % what % sample_rate % sample_rate_)};
+    }
+    if (channel_count != channel_count_) {
+        throw runtime_error{str(format("%1% channels: %2%; engine channels: %3%")
+            % what % channel_count % channel_count_)};
+    }
+}
+
+void Reader::close_source() {
+    sf_.reset();
+    shm_.reset();
+    memory_ = nullptr;
+    mapped_ = nullptr;
+    mapping_.reset();
+    preloaded_.reset();
+    read_ahead_.reset();
+}
+
+Reader::Reader(
+    const Sample* data,
+    size_t frames,
+    size_t sample_rate,
+    size_t channel_count,
+    size_t buffer_size,
+    double duration_secs,
+    double start_offset_secs,
+    Transport transport,
+    double low_watermark
+):
+    IoWorker{sample_rate, channel_count, buffer_size, transport, low_watermark}
+{
+    trace_ = trace_buffer("reader");
+    open(data, frames, duration_secs, start_offset_secs);
+}
+
+void Reader::open(const Sample* data, size_t frames, double duration_secs, double start_offset_secs) {
+    check_worker();
+    std::unique_lock<std::mutex> lock{mutex_};
+    ldebug("Reader: reading %zd frames from memory with %zd sample rate and %zd channels\n",
+        frames, sample_rate_, channel_count_);
+    size_t start_frame = std::min<size_t>(frames, start_offset_secs * sample_rate_ + .5);
+    close_source();
+    memory_ = data + start_frame * channel_count_;
+    begin(frames - start_frame, duration_secs, lock);
+}
+
+void Reader::close() {
+    std::lock_guard<std::mutex> lock{mutex_};
+    close_source();
+    break_ = true;
+}
+
+size_t Reader::limit_duration(size_t frames_avail, double duration_secs) const {
+    if (duration_secs == 0) {
+        return frames_avail;
+    }
+    size_t duration_frames = duration_secs * sample_rate_ + .5;
+    return std::min(frames_avail, duration_frames);
+}
+
+void Reader::begin(size_t frames_avail, double duration_secs, std::unique_lock<std::mutex>& lock) {
     if (duration_secs != 0) {
-        sf_count_t duration_frames = duration_secs * sample_rate_ + .5;
-        frames_avail = std::min(frames_avail, duration_frames);
-        ldebug("Reader::Reader(): limiting duration to %zd frames\n", frames_avail);
+        frames_avail = limit_duration(frames_avail, duration_secs);
+        ldebug("Reader::open(): limiting duration to %zd frames\n", frames_avail);
     }
+    reset_rings();
     needed_ = frames_avail;
+    done_ = 0;
+    break_ = false;
 
+    if (preload_) {
+        preload();
+        return;
+    }
     // Prefill ringbuffer with as much input file data as possible to minimize underrun probability.
     work_cycle();
+    lock.unlock();
 
     if (!break_) {
-        thread_.reset(new std::thread(&Reader::pump, this));
+        start();
+    } else if (!thread_) {
+        ldebug("Reader::open(): not starting worker, whole file in ringbuffer\n");
+    }
+}
+
+void Reader::preload() {
+    std::unique_ptr<LockedBuffer> buff{new LockedBuffer{needed_ * channel_count_}};
+    if (planar()) {
+        // Lay channels out one after another, so that Jack thread only copies
+        for (size_t c = 0; c != channel_count_; ++c) {
+            segments_[c] = buff->data() + c * needed_;
+        }
+        while (done_ != needed_) {
+            size_t n = std::min(buffer_size_, needed_ - done_);
+            read_file(buff_.get(), n);
+            kernels_.deinterleave(buff_.get(), n, channel_count_, segments_.data(), done_);
+            done_ += n;
+        }
     } else {
-        ldebug("Reader::Reader(): not starting worker, whole file in ringbuffer\n");
+        read_file(buff->data(), needed_);
+        done_ = needed_;
+    }
+    ldebug("Reader::open(): preloaded %zd frames, not starting worker\n", done_);
+    // Nothing else is read from the source
+    close_source();
+    preloaded_ = std::move(buff);
+    preload_pos_ = 0;
+    break_ = true;
+}
+
+size_t Reader::read_preloaded(const Kernels& kernels, Sample* const* dst, size_t frames) noexcept {
+    assert(preloaded());
+    const size_t n = std::min(frames, needed_ - preload_pos_);
+    const Sample* data = preloaded_->data();
+    if (planar()) {
+        for (size_t c = 0; c != channel_count_; ++c) {
+            std::memcpy(dst[c], data + c * needed_ + preload_pos_, n * sizeof(Sample));
+        }
+    } else {
+        kernels.deinterleave(data + preload_pos_ * channel_count_, n, channel_count_, dst, 0);
+    }
+    preload_pos_ += n;
+    return n;
+}
+
+void Reader::read_file(Sample* dst, size_t frames) {
+    if (memory_ != nullptr) {
+        std::memcpy(dst, memory_, frames * frame_size_);
+        memory_ += frames * channel_count_;
+        return;
     }
+    if (mapped_ != nullptr) {
+        // Keep the kernel reading ahead of us, so that we rarely wait for page faults
+        const size_t window = std::max(PREFETCH_MIN, 2 * buffer_size_ * mapped_frame_size_);
+        const size_t pos = mapped_ - mapping_->data();
+        if (pos + window / 2 >= prefetched_) {
+            mapping_->prefetch(pos, window);
+            prefetched_ = pos + window;
+        }
+        const std::uint64_t begin = trace_ != nullptr ? trace_now() : 0;
+        convert_samples(encoding_, mapped_, frames * channel_count_, dst);
+        mapped_ += frames * mapped_frame_size_;
+        if (trace_ != nullptr) {
+            trace(trace_, TR_FILE_READ, begin, trace_now(), frames * mapped_frame_size_);
+        }
+        return;
+    }
+    if (read_ahead_) {
+        read_ahead_->read(dst, frames);
+        return;
+    }
+    const std::uint64_t begin = trace_ != nullptr ? trace_now() : 0;
+    auto read = sf_readf_float(sf_.get(), dst, frames);
+    if (read != static_cast<sf_count_t>(frames)) {
+        throw runtime_error{str(format("unexpected read of %1% frames when requested %2%, premature EOF?")
+            % read % frames)};
+    }
+    if (trace_ != nullptr) {
+        trace(trace_, TR_FILE_READ, begin, trace_now(), frames * frame_size_);
+    }
+}
+
+void Reader::read_file(const jack_ringbuffer_data_t* vec, size_t frames) {
+    Sample* head = reinterpret_cast<Sample*>(vec[0].buf);
+    Sample* tail = reinterpret_cast<Sample*>(vec[1].buf);
+    size_t n = std::min(frames, vec[0].len / frame_size_);
+    read_file(head, n);
+    if (n == frames) {
+        return;
+    }
+    // Frame straddling the end of the ringbuffer is decoded separately and split
+    size_t split = (vec[0].len / sizeof(Sample)) % channel_count_;
+    if (split != 0) {
+        read_file(frame_.get(), 1);
+        std::memcpy(head + n * channel_count_, frame_.get(), split * sizeof(Sample));
+        std::memcpy(tail, frame_.get() + split, (channel_count_ - split) * sizeof(Sample));
+        tail += channel_count_ - split;
+        ++n;
+    }
+    read_file(tail, frames - n);
 }
 
 void Reader::work_cycle() {
-    size_t writable = jack_ringbuffer_write_space(buffer()) / frame_size_;
+    size_t writable = frames_writable();
     // Don't read past `needed_` frames
     assert(done_ <= needed_);
-    // Limit the size because jack_rigbuffer_create may allocate buffer larger
-    // than buffer_size_ (rounding upwards to powers of 2) and reports the real
-    // allocated space here, leading to buffer overflow of buff_
-    writable = std::min(writable, buffer_size_);
+    if (planar()) {
+        // Limit the size because jack_rigbuffer_create may allocate buffer larger
+        // than buffer_size_ (rounding upwards to powers of 2) and reports the real
+        // allocated space here, leading to buffer overflow of buff_
+        writable = std::min(writable, buffer_size_);
+    }
     writable = std::min(needed_ - done_, writable);
-    auto read = sf_readf_float(sf_.get(), buff_.get(), writable);
-    if (read != writable) {
-        throw runtime_error{str(format("unexpected read of %1% frames when requested %2%, premature EOF?")
-            % read % writable)};
+    if (planar()) {
+        read_file(buff_.get(), writable);
+        write_planar(buff_.get(), writable);
+    } else {
+        // Decode straight into ringbuffer memory, we are the only producer
+        jack_ringbuffer_data_t vec[2];
+        jack_ringbuffer_get_write_vector(buffer(), vec);
+        read_file(vec, writable);
+        jack_ringbuffer_write_advance(buffer(), writable * frame_size_);
     }
-    size_t written = jack_ringbuffer_write(buffer(), reinterpret_cast<const char*>(buff_.get()), read * frame_size_);
-    assert(written == read * frame_size_);  // As we are the only producer
-    done_ += read;
+    done_ += writable;
     if (done_ == needed_) {
         ldebug("Reader::refill(): requesting worker stop, we're done after %zd frames\n", done_);
         break_ = true;
@@ -176,46 +612,239 @@ Writer::Writer(
     size_t sample_rate,
     size_t channel_count,
     size_t buffer_size,
-    double duration_secs
+    double duration_secs,
+    Transport transport,
+    double high_watermark,
+    bool float_samples,
+    WavIo wav_io
 ):
-    IoWorker{sample_rate, channel_count, buffer_size}
+    IoWorker{sample_rate, channel_count, buffer_size, transport, high_watermark},
+    float_{float_samples},
+    wav_io_{wav_io}
 {
-    SF_INFO si = {0};
-    si.channels = channel_count_;
-    si.samplerate = sample_rate_;
-    si.format = SF_FORMAT_WAV | SF_FORMAT_PCM_32;
-    sf_ = open_sndfile(path, SFM_WRITE, si);
+    trace_ = trace_buffer("writer");
+    cycle_event_ = TR_WRITE_CYCLE;
+    open(path, duration_secs);
+}
+
+Writer::Writer(
+    Sample* data,
+    size_t frames,
+    size_t sample_rate,
+    size_t channel_count,
+    size_t buffer_size,
+    Transport transport,
+    double high_watermark
+):
+    IoWorker{sample_rate, channel_count, buffer_size, transport, high_watermark}
+{
+    trace_ = trace_buffer("writer");
+    cycle_event_ = TR_WRITE_CYCLE;
+    open(data, frames);
+}
+
+void Writer::open(const string& path, double duration_secs) {
+    check_worker();
+    close();
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (is_shared_memory(path)) {
+        open_shared_memory(path, duration_secs * sample_rate_ + .5);
+        return;
+    }
+    const size_t frames = duration_secs * sample_rate_ + .5;
+    if (float_) {
+        wav_.reset(new WavWriter{path, sample_rate_, channel_count_, frames, wav_io_});
+    } else {
+        SF_INFO si = {0};
+        si.channels = channel_count_;
+        si.samplerate = sample_rate_;
+        si.format = SF_FORMAT_WAV | SF_FORMAT_PCM_32;
+        sf_ = open_sndfile(path, SFM_WRITE, si);
+    }
     ldebug("Writer: writing to %s with %zd sample rate and %zd channels\n",
         path.c_str(), sample_rate_, channel_count_);
-    needed_ = duration_secs * sample_rate_ + .5;
-    thread_.reset(new std::thread(&Writer::pump, this));
+    path_ = path;
+    reset_rings();
+    needed_ = frames;
+    done_ = 0;
+    break_ = false;
+    start();
+}
+
+void Writer::open(Sample* data, size_t frames) {
+    if (frames == 0) {
+        throw runtime_error{"recording buffer is empty"};
+    }
+    check_worker();
+    close();
+    std::lock_guard<std::mutex> lock{mutex_};
+    ldebug("Writer: writing %zd frames to memory with %zd sample rate and %zd channels\n",
+        frames, sample_rate_, channel_count_);
+    memory_ = data;
+    reset_rings();
+    needed_ = frames;
+    done_ = 0;
+    break_ = false;
+    start();
+}
+
+void Writer::open_shared_memory(const string& path, size_t frames) {
+    std::unique_ptr<SharedMemory> shm;
+    if (shared_memory_exists(path)) {
+        // Segment prepared by the consumer determines capacity
+        shm.reset(new SharedMemory{path, true});
+    } else if (frames != 0) {
+        shm.reset(new SharedMemory{path, sample_rate_, channel_count_, frames});
+    } else {
+        throw runtime_error{str(format("recording to new shared memory %1% requires a duration") % path)};
+    }
+    auto& h = shm->header();
+    if (h.sample_rate != sample_rate_ || h.channels != channel_count_) {
+        throw runtime_error{str(format("recording shared memory has %1% channels at %2% sample rate; engine: %3% channels at %4%")
+            % h.channels % h.sample_rate % channel_count_ % sample_rate_)};
+    }
+    if (h.frames == 0) {
+        throw runtime_error{str(format("recording shared memory %1% has no room") % path)};
+    }
+    h.frames_done = 0;
+    memory_ = shm->samples();
+    shm_ = std::move(shm);
+    reset_rings();
+    needed_ = frames != 0 ? std::min<size_t>(frames, h.frames) : h.frames;
+    done_ = 0;
+    break_ = false;
+    start();
+}
+
+void Writer::close() {
+    std::lock_guard<std::mutex> lock{mutex_};
+    flush();
+    const bool file = sf_ || wav_;
+    // Closing finalizes file header
+    sf_.reset();
+    if (wav_) {
+        auto wav = std::move(wav_);
+        wav->close();
+    }
+    memory_ = nullptr;
+    shm_.reset();
+    break_ = true;
+    vector<WavCue> cues;
+    std::swap(cues, cues_);
+    if (file && !cues.empty()) {
+        // Markers past the end of what was recorded would confuse editors
+        cues.erase(std::remove_if(cues.begin(), cues.end(),
+            [this](const WavCue& cue) { return cue.frame > done_; }), cues.end());
+        append_wav_cues(path_, cues);
+    }
+}
+
+void Writer::mark(size_t frame, const string& label) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    cues_.push_back({frame, label});
+}
+
+void Writer::write_file(const Sample* src, size_t frames) {
+    if (memory_ != nullptr) {
+        std::memcpy(memory_, src, frames * frame_size_);
+        memory_ += frames * channel_count_;
+        return;
+    }
+    const std::uint64_t begin = trace_ != nullptr ? trace_now() : 0;
+    if (wav_) {
+        wav_->write(src, frames * channel_count_);
+    } else {
+        auto written = sf_writef_float(sf_.get(), src, frames);
+        if (written != static_cast<sf_count_t>(frames)) {
+            throw runtime_error{str(format("unexpected write of %1% frames when requested %2%, no more space?")
+                % written % frames)};
+        }
+    }
+    if (trace_ != nullptr) {
+        trace(trace_, TR_FILE_WRITE, begin, trace_now(), frames * frame_size_);
+    }
+}
+
+void Writer::write_file(const jack_ringbuffer_data_t* vec, size_t frames) {
+    const Sample* head = reinterpret_cast<const Sample*>(vec[0].buf);
+    const Sample* tail = reinterpret_cast<const Sample*>(vec[1].buf);
+    if (wav_) {
+        // Samples are stored as they are, so frames may be split between writes
+        size_t count = frames * channel_count_;
+        size_t n = std::min(count, vec[0].len / sizeof(Sample));
+        const std::uint64_t begin = trace_ != nullptr ? trace_now() : 0;
+        wav_->write(head, n);
+        wav_->write(tail, count - n);
+        if (trace_ != nullptr) {
+            trace(trace_, TR_FILE_WRITE, begin, trace_now(), count * sizeof(Sample));
+        }
+        return;
+    }
+    size_t n = std::min(frames, vec[0].len / frame_size_);
+    write_file(head, n);
+    if (n == frames) {
+        return;
+    }
+    // Frame straddling the end of the ringbuffer is joined before encoding
+    size_t split = (vec[0].len / sizeof(Sample)) % channel_count_;
+    if (split != 0) {
+        std::memcpy(frame_.get(), head + n * channel_count_, split * sizeof(Sample));
+        std::memcpy(frame_.get() + split, tail, (channel_count_ - split) * sizeof(Sample));
+        write_file(frame_.get(), 1);
+        tail += channel_count_ - split;
+        ++n;
+    }
+    write_file(tail, frames - n);
 }
 
 void Writer::work_cycle() {
-    size_t readable = jack_ringbuffer_read_space(buffer()) / frame_size_;
-    // Limit the size because jack_rigbuffer_create may allocate buffer larger
-    // than buffer_size_ (rounding upwards to powers of 2) and reports the real
-    // allocated space here, leading to buffer overflow of buff_
-    readable = std::min(readable, buffer_size_);
+    size_t readable = frames_readable();
+    if (planar()) {
+        // Limit the size because jack_rigbuffer_create may allocate buffer larger
+        // than buffer_size_ (rounding upwards to powers of 2) and reports the real
+        // allocated space here, leading to buffer overflow of buff_
+        readable = std::min(readable, buffer_size_);
+    }
     if (0 != needed_) {
         assert(done_ <= needed_);
         readable = std::min(readable, needed_ - done_);
     }
-    size_t read = jack_ringbuffer_read(buffer(), reinterpret_cast<char*>(buff_.get()), readable * frame_size_);
-    assert(read == readable * frame_size_);  // As we are the only consumer
-    auto written = sf_writef_float(sf_.get(), buff_.get(), readable);
-    if (written != readable) {
-        throw runtime_error{str(format("unexpected write of %1% frames when requested %2%, no more space?")
-            % written % readable)};
+    if (planar()) {
+        read_planar(buff_.get(), readable);
+        write_file(buff_.get(), readable);
+    } else {
+        // Encode straight from ringbuffer memory, we are the only consumer
+        jack_ringbuffer_data_t vec[2];
+        jack_ringbuffer_get_read_vector(buffer(), vec);
+        write_file(vec, readable);
+        jack_ringbuffer_read_advance(buffer(), readable * frame_size_);
+    }
+    done_ += readable;
+    if (shm_) {
+        // Consumer may process the recording as it goes
+        shm_->header().frames_done.store(done_, std::memory_order_release);
     }
-    done_ += written;
     if (0 != needed_ && done_ == needed_) {
         ldebug("Writer::drain(): requesting worker stop, we're done after %zd frames\n", done_);
         break_ = true;
     }
 }
 
+void Writer::flush() {
+    if (!sf_ && !wav_ && memory_ == nullptr) {
+        // Already closed
+        return;
+    }
+    // Drain what Jack thread has written after the last wakeup
+    while (!done() && frames_readable() != 0) {
+        work_cycle();
+    }
+}
+
 size_t query_audio_file_channels(const string& path) {
+    if (is_shared_memory(path)) {
+        return SharedMemory{path, false}.header().channels;
+    }
     SF_INFO si = {0};
     auto sf = open_sndfile(path, SFM_READ, si);
     return si.channels;
@@ -1,15 +1,31 @@
 #pragma once
 #include "types.hpp"
+#include "kernels.hpp"
+#include "semaphore.hpp"
+#include "shm.hpp"
+#include "wav.hpp"
+#include "readahead.hpp"
+#include "trace.hpp"
 
 #include <sndfile.h>
 #include <jack/ringbuffer.h>
 
 #include <memory>
 #include <thread>
-#include <condition_variable>
+#include <mutex>
+#include <atomic>
+#include <cassert>
 
 namespace olo {
 
+// Layout of samples in ringbuffers shared with the Jack thread.
+enum class Transport {
+    // Single ringbuffer of interleaved frames, (de)interleaved in Jack thread
+    INTERLEAVED,
+    // Ringbuffer per channel, (de)interleaved in IO thread so that Jack thread only copies
+    PLANAR
+};
+
 // Shared properties and bits of implementation of Reader & Writer.
 class IoWorker {
 protected:
@@ -18,29 +34,84 @@ protected:
     size_t frame_size_;
     // Ringbuffer size in frames.
     size_t buffer_size_;
-    std::unique_ptr<jack_ringbuffer_t, decltype(&jack_ringbuffer_free)> ring_;
+    Transport transport_;
+    // Ringbuffer fill level in frames at which Jack thread wakes the worker, and as a fraction
+    // of ringbuffer size
+    size_t watermark_;
+    double watermark_ratio_;
+    // Ringbuffer size in engine periods kept by fit_period(), 0 if size is fixed
+    size_t buffer_periods_ = 0;
+    // Single ringbuffer with interleaved transport, one per channel with planar one.
+    vector<std::unique_ptr<jack_ringbuffer_t, decltype(&jack_ringbuffer_free)>> rings_;
+    // Scratch for (de)interleaving with planar transport
     std::unique_ptr<Sample[]> buff_;
+    // Scratch for a single frame straddling the end of interleaved ringbuffer
+    std::unique_ptr<Sample[]> frame_;
+    // Kernels and ringbuffer segment pointers for (de)interleaving planar transport
+    Kernels kernels_ = {};
+    vector<Sample*> segments_;
     std::unique_ptr<std::thread> thread_;
-    std::mutex mx_;
-    std::condition_variable cv_;
+    // Serializes work cycles of the worker with opening and closing files by control thread
+    std::mutex mutex_;
+    Semaphore wake_sem_;
+    // Set by Jack thread when posting `wake_sem_`, cleared by worker when it wakes up, so
+    // that the semaphore is posted at most once per work cycle
+    std::atomic<bool> wake_pending_{false};
+    // Posted by worker after a cycle if `progress_wanted_` was set, and when it exits. Cycles
+    // nobody waits for don't post, so no stale posts pile up in real time runs.
+    Semaphore progress_sem_;
+    std::atomic<bool> progress_wanted_{false};
     std::unique_ptr<SNDFILE, decltype(&sf_close)> sf_;
+    // Mapping of shared memory used instead of a file
+    std::unique_ptr<SharedMemory> shm_;
     // Read/write at most needed_ frames.
     size_t needed_ = 0;
     // Stores number of frames read/written so far.
     size_t done_ = 0;
-    volatile bool break_ = false;
+    // Set once the current file is done with. Published after the ringbuffer is updated, so
+    // all data is there once finished().
+    std::atomic<bool> break_{false};
+    // Set when worker thread is requested to exit or has died
+    std::atomic<bool> quit_{false};
     // Stores exception thrown in worker thread for rethrow in join()
     std::exception_ptr ex_;
+    // Timeline of the worker if tracing, the event of its work cycles and trace time of the
+    // latest wake up request
+    TraceBuffer* trace_ = nullptr;
+    TraceEvent cycle_event_ = TR_READ_CYCLE;
+    std::atomic<std::uint64_t> woken_at_{0};
 
-    explicit IoWorker(size_t sample_rate, size_t channel_count, size_t buffer_size);
+    explicit IoWorker(size_t sample_rate, size_t channel_count, size_t buffer_size, Transport transport, double watermark);
     virtual void work_cycle() = 0;
+    // True if ringbuffer fill level has crossed the watermark
+    virtual bool needs_work() const = 0;
+    // Called after worker is stopped to process what's left in the ringbuffer
+    virtual void flush() {}
     void pump();
+    // Allocates ringbuffers for `frames` frames and sets watermark for them
+    void create_rings(size_t frames);
+    // Starts worker thread unless it's already running
+    void start();
+    // Rethrows failure of the worker thread before it's given another file
+    void check_worker();
+    // Empties ringbuffers, Jack thread must not be using them
+    void reset_rings();
+    // Transfer of interleaved frames to/from planar transport ringbuffers
+    void write_planar(const Sample* src, size_t frames);
+    void read_planar(Sample* dst, size_t frames);
 
 public:
     // We're joining thread in the destructor, which may throw
     virtual ~IoWorker() noexcept(false);
 
-    jack_ringbuffer_t* buffer() const { return ring_.get(); }
+    bool planar() const { return transport_ == Transport::PLANAR; }
+    // Interleaved transport ringbuffer.
+    jack_ringbuffer_t* buffer() const { assert(!planar()); return rings_[0].get(); }
+    // Planar transport ringbuffer for channel `c`.
+    jack_ringbuffer_t* channel_buffer(size_t c) const { assert(planar()); return rings_[c].get(); }
+    // Number of whole frames which may be read from/written to ringbuffer(s), all channels considered.
+    size_t frames_readable() const;
+    size_t frames_writable() const;
     size_t frame_size() const { return frame_size_; }
     size_t channel_count() const { return channel_count_; }
     size_t buffer_size() const { return buffer_size_; }
@@ -48,14 +119,75 @@ public:
     size_t frames_needed() const { return needed_; }
     size_t frames_done() const { return done_; }
 
-    void wake();
+    // Called by Jack thread after each cycle, wakes the worker if ringbuffer fill level has
+    // crossed the watermark. Doesn't block or take locks.
+    void notify() noexcept;
+    void wake() noexcept;
+    // Wakes the worker and blocks until it completes a cycle. Only for engines which aren't
+    // paced by wall clock, Jack thread must never call this.
+    void wait_progress();
     void stop();
     void join();
     bool finished() const { return break_; }
+
+    // Keeps ringbuffer size at `periods` engine periods from the next fit_period() on, 0 keeps
+    // the current size
+    void set_buffer_periods(size_t periods) { buffer_periods_ = periods; }
+    // Resizes ringbuffers for engine period of `period_size` frames, if set_buffer_periods()
+    // asked for that. Jack thread must not be using the ringbuffers meanwhile, the worker is
+    // held between cycles. Frames in the ringbuffers are kept.
+    void fit_period(size_t period_size);
+};
+
+// Samples kept resident in RAM, so that reading them never faults. Locking is best effort,
+// failing it (e.g. due to RLIMIT_MEMLOCK) is only reported.
+class LockedBuffer {
+    std::unique_ptr<Sample[]> data_;
+    size_t size_ = 0;
+    bool locked_ = false;
+
+public:
+    explicit LockedBuffer(size_t size);
+    ~LockedBuffer();
+    LockedBuffer(const LockedBuffer&) = delete;
+    LockedBuffer& operator=(const LockedBuffer&) = delete;
+
+    Sample* data() const { return data_.get(); }
+    size_t size() const { return size_; }
 };
 
 class Reader: public IoWorker {
+    // Interleaved frames read instead of a file, owned by the caller
+    const Sample* memory_ = nullptr;
+    // Decode the whole range up front, so that Jack thread reads it without worker or ringbuffers
+    bool preload_ = false;
+    // Decoded range, interleaved or a plane per channel depending on transport
+    std::unique_ptr<LockedBuffer> preloaded_;
+    // Next frame of `preloaded_` to be played, used by Jack thread only
+    size_t preload_pos_ = 0;
+    // Uncompressed WAV file read without libsndfile and the position of the next frame in it
+    std::unique_ptr<MappedFile> mapping_;
+    const unsigned char* mapped_ = nullptr;
+    WavEncoding encoding_ = WavEncoding::FLOAT;
+    size_t mapped_frame_size_ = 0;
+    // Offset up to which readahead of the mapping has been requested
+    size_t prefetched_ = 0;
+    // Decoder thread for files read through libsndfile
+    std::unique_ptr<ReadAhead> read_ahead_;
+
+    // Returns false if file isn't a WAV which can be mapped
+    bool open_mapped(const string& path, double duration_secs, double start_offset_secs, std::unique_lock<std::mutex>& lock);
+    void check_source(const char* what, size_t sample_rate, size_t channel_count) const;
+    void close_source();
+    // Number of `frames_avail` frames to read, limited by duration
+    size_t limit_duration(size_t frames_avail, double duration_secs) const;
+    // Starts reading `frames_avail` frames from the opened source, limited by duration
+    void begin(size_t frames_avail, double duration_secs, std::unique_lock<std::mutex>& lock);
+    void preload();
+    void read_file(Sample* dst, size_t frames);
+    void read_file(const jack_ringbuffer_data_t* vec, size_t frames);
     void work_cycle() override;
+    bool needs_work() const override { return frames_readable() <= watermark_; }
 
 public:
     explicit Reader(
@@ -64,12 +196,57 @@ public:
         size_t channel_count,
         size_t buffer_size,
         double duration_secs = 0.,
-        double start_offset_secs = 0.
+        double start_offset_secs = 0.,
+        Transport transport = Transport::INTERLEAVED,
+        double low_watermark = LOW_WATERMARK_DEFAULT,
+        bool preload = false
     );
+    // Plays `frames` interleaved frames from memory, which must stay valid until finished
+    explicit Reader(
+        const Sample* data,
+        size_t frames,
+        size_t sample_rate,
+        size_t channel_count,
+        size_t buffer_size,
+        double duration_secs = 0.,
+        double start_offset_secs = 0.,
+        Transport transport = Transport::INTERLEAVED,
+        double low_watermark = LOW_WATERMARK_DEFAULT
+    );
+    ~Reader() noexcept(false) override { stop(); }
+
+    // Switches to another file with the same sample rate and channel count, reusing the
+    // ringbuffers and worker thread. Jack thread must not be using the ringbuffers meanwhile.
+    void open(const string& path, double duration_secs = 0., double start_offset_secs = 0.);
+    void open(const Sample* data, size_t frames, double duration_secs = 0., double start_offset_secs = 0.);
+    // Stops reading and lets go of the source, so that memory given to open() may be freed
+    void close();
+
+    // True if the current file was decoded into memory, to be read with read_preloaded()
+    bool preloaded() const { return preloaded_ != nullptr; }
+    // Called by Jack thread to copy up to `frames` frames into `dst` channel buffers, returns
+    // number of frames copied. Doesn't block or take locks.
+    size_t read_preloaded(const Kernels& kernels, Sample* const* dst, size_t frames) noexcept;
 };
 
 class Writer: public IoWorker {
+    // Where interleaved frames are recorded instead of a file, owned by the caller
+    Sample* memory_ = nullptr;
+    // Record files as float WAV written by `wav_` instead of integer one written by libsndfile
+    bool float_ = false;
+    WavIo wav_io_ = WavIo::SYNC;
+    std::unique_ptr<WavWriter> wav_;
+    // Recording file and markers to add to it once it's closed
+    string path_;
+    vector<WavCue> cues_;
+
+    // Records at most `frames` frames, or as many as existing segment holds if 0
+    void open_shared_memory(const string& path, size_t frames);
+    void write_file(const Sample* src, size_t frames);
+    void write_file(const jack_ringbuffer_data_t* vec, size_t frames);
     void work_cycle() override;
+    bool needs_work() const override { return frames_readable() >= watermark_; }
+    void flush() override;
     bool done() const { return needed_ != 0 && done_ == needed_; }
 
 public:
@@ -78,8 +255,33 @@ public:
         size_t sample_rate,
         size_t channel_count,
         size_t buffer_size,
-        double duration_secs = 0.
+        double duration_secs = 0.,
+        Transport transport = Transport::INTERLEAVED,
+        double high_watermark = HIGH_WATERMARK_DEFAULT,
+        bool float_samples = false,
+        WavIo wav_io = WavIo::SYNC
+    );
+    // Records at most `frames` interleaved frames to memory, which must stay valid until closed
+    explicit Writer(
+        Sample* data,
+        size_t frames,
+        size_t sample_rate,
+        size_t channel_count,
+        size_t buffer_size,
+        Transport transport = Transport::INTERLEAVED,
+        double high_watermark = HIGH_WATERMARK_DEFAULT
     );
+    // Worker must be stopped before our part is destroyed, as it calls our virtual methods
+    ~Writer() noexcept(false) override { stop(); }
+
+    // Switches to another file, like Reader::open(). The previous one is closed first.
+    void open(const string& path, double duration_secs = 0.);
+    void open(Sample* data, size_t frames);
+    // Writes out what's left in the ringbuffer and closes the file
+    void close();
+    // Adds marker at `frame` of the recording when it's closed. Only WAV files have markers,
+    // they're ignored for other destinations.
+    void mark(size_t frame, const string& label);
 };
 
 size_t query_audio_file_channels(const string& path);
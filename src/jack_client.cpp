@@ -1,10 +1,19 @@
 #include "jack_client.hpp"
 #include "log.hpp"
 
+#include <boost/format.hpp>
+
 #include <stdexcept>
-#include <cstdio>
 
 namespace olo {
+using std::runtime_error;
+using boost::format;
+
+namespace {
+jack_port_t* jack_port(Port* port) {
+    return reinterpret_cast<jack_port_t*>(port);
+}
+}
 
 JackClient::JackClient(const string& name):
     client_ {
@@ -13,18 +22,35 @@ JackClient::JackClient(const string& name):
     }
 {
     if (!client_) {
-        throw std::runtime_error("unable to create Jack client, is server running?");
+        throw runtime_error("unable to create Jack client, is server running?");
     }
     // Server is free to change client name to make it unique
     name_ = jack_get_client_name(handle());
     sample_rate_ = jack_get_sample_rate(handle());
     ldebug("JackClient: engine is using sample rate %zd\n", sample_rate_);
+    int err;
+    if (0 != (err = jack_set_freewheel_callback(handle(), freewheel_, this))) {
+        throw runtime_error{str(format("failed setting Jack freewheel callback with error %1%") % err)};
+    }
+    // Handlers pass the events on to callbacks set later, if any
+    if (0 != (err = jack_set_xrun_callback(handle(), xrun_, this))) {
+        throw runtime_error{str(format("failed setting Jack xrun callback with error %1%") % err)};
+    }
+    if (0 != (err = jack_set_buffer_size_callback(handle(), buffer_size_changed_, this))) {
+        throw runtime_error{str(format("failed setting Jack buffer size callback with error %1%") % err)};
+    }
+    if (0 != (err = jack_set_sample_rate_callback(handle(), sample_rate_changed_, this))) {
+        throw runtime_error{str(format("failed setting Jack sample rate callback with error %1%") % err)};
+    }
+    if (0 != (err = jack_set_graph_order_callback(handle(), graph_order_, this))) {
+        throw runtime_error{str(format("failed setting Jack graph order callback with error %1%") % err)};
+    }
 }
 
 vector<string> JackClient::enumerate_ports(int type) const {
     const char **ports = jack_get_ports(handle(), NULL, JACK_DEFAULT_AUDIO_TYPE, type);
     if (ports == nullptr) {
-        throw std::runtime_error("enumerating Jack channels failed");
+        throw runtime_error("enumerating Jack channels failed");
     }
     vector<string> res;
     for (auto p = ports; *p != nullptr; ++p) {
@@ -34,18 +60,120 @@ vector<string> JackClient::enumerate_ports(int type) const {
     return res;
 }
 
-void JackClient::dump_ports() const {
-    using std::printf;
-    auto playback = playback_ports();
-    printf("%zd Output (playback) channels:\n", playback.size());
-    for (size_t i = 0; i != playback.size(); ++i) {
-        printf("  %2zd: %s\n", i + 1, playback[i].c_str());
+Port* JackClient::register_port(const string& short_name, PortDirection direction) {
+    unsigned long flags = direction == PortDirection::INPUT ? JackPortIsInput : JackPortIsOutput;
+    auto port = jack_port_register(handle(), short_name.c_str(), JACK_DEFAULT_AUDIO_TYPE, flags, 0);
+    if (port == nullptr) {
+        throw runtime_error{str(format("failed creating port %1%") % short_name)};
+    }
+    return reinterpret_cast<Port*>(port);
+}
+
+void JackClient::unregister_port(Port* port) {
+    jack_port_disconnect(handle(), jack_port(port));
+    jack_port_unregister(handle(), jack_port(port));
+}
+
+int JackClient::connect(const string& source, const string& destination) {
+    return jack_connect(handle(), source.c_str(), destination.c_str());
+}
+
+int JackClient::disconnect(const string& source, const string& destination) {
+    return jack_disconnect(handle(), source.c_str(), destination.c_str());
+}
+
+Sample* JackClient::port_buffer(Port* port, size_t frame_count) noexcept {
+    return static_cast<Sample*>(jack_port_get_buffer(jack_port(port), frame_count));
+}
+
+void JackClient::set_process_callback(ProcessCallback callback, void* arg) {
+    process_callback_ = callback;
+    process_arg_ = arg;
+    int err;
+    if (0 != (err = jack_set_process_callback(handle(), process_, this)))  {
+        throw runtime_error{str(format("failed setting Jack process callback with error %1%") % err)};
     }
-    auto capture = capture_ports();
-    printf("%zd Input (record) channels:\n", capture.size());
-    for (size_t i = 0; i != capture.size(); ++i) {
-        printf("  %2zd: %s\n", i + 1, capture[i].c_str());
+}
+
+void JackClient::set_shutdown_callback(ShutdownCallback callback, void* arg) {
+    jack_on_shutdown(handle(), callback, arg);
+}
+
+void JackClient::set_event_callback(EventCallback callback, void* arg) {
+    std::lock_guard<std::mutex> lock{callbacks_mutex_};
+    event_callback_ = callback;
+    event_arg_ = arg;
+}
+
+void JackClient::set_buffer_size_callback(BufferSizeCallback callback, void* arg) {
+    std::lock_guard<std::mutex> lock{callbacks_mutex_};
+    buffer_size_callback_ = callback;
+    buffer_size_arg_ = arg;
+}
+
+void JackClient::activate() {
+    int err;
+    if (0 != (err = jack_activate(handle()))) {
+        throw runtime_error{str(format("failed activating Jack client with error %1%") % err)};
+    }
+    ldebug("JackClient::activate(): Jack client activated\n");
+}
+
+void JackClient::deactivate() {
+    jack_deactivate(handle());
+    ldebug("JackClient::deactivate(): Jack client deactivated\n");
+}
+
+int JackClient::process_(jack_nframes_t frame_count, void* arg) {
+    auto client = static_cast<JackClient*>(arg);
+    client->process_callback_(frame_count, client->process_arg_);
+    return 0;
+}
+
+void JackClient::freewheel_(int starting, void* arg) {
+    auto client = static_cast<JackClient*>(arg);
+    client->freewheeling_ = starting != 0;
+}
+
+int JackClient::xrun_(void* arg) {
+    auto client = static_cast<JackClient*>(arg);
+    std::lock_guard<std::mutex> lock{client->callbacks_mutex_};
+    if (client->event_callback_ != nullptr) {
+        client->event_callback_(EngineEvent::XRUN, 0, client->event_arg_);
+    }
+    return 0;
+}
+
+int JackClient::buffer_size_changed_(jack_nframes_t frame_count, void* arg) {
+    auto client = static_cast<JackClient*>(arg);
+    std::lock_guard<std::mutex> lock{client->callbacks_mutex_};
+    // Buffers are swapped before the event is reported, it's placed before the first period
+    // of the new size either way
+    if (client->buffer_size_callback_ != nullptr) {
+        client->buffer_size_callback_(frame_count, client->buffer_size_arg_);
+    }
+    if (client->event_callback_ != nullptr) {
+        client->event_callback_(EngineEvent::BUFFER_SIZE, frame_count, client->event_arg_);
+    }
+    return 0;
+}
+
+int JackClient::sample_rate_changed_(jack_nframes_t sample_rate, void* arg) {
+    auto client = static_cast<JackClient*>(arg);
+    std::lock_guard<std::mutex> lock{client->callbacks_mutex_};
+    if (client->event_callback_ != nullptr) {
+        client->event_callback_(EngineEvent::SAMPLE_RATE, sample_rate, client->event_arg_);
+    }
+    return 0;
+}
+
+int JackClient::graph_order_(void* arg) {
+    auto client = static_cast<JackClient*>(arg);
+    std::lock_guard<std::mutex> lock{client->callbacks_mutex_};
+    if (client->event_callback_ != nullptr) {
+        client->event_callback_(EngineEvent::GRAPH_ORDER, 0, client->event_arg_);
     }
+    return 0;
 }
 
 }
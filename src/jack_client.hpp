@@ -1,28 +1,66 @@
 #pragma once
 #include "types.hpp"
+#include "backend.hpp"
 
 #include <jack/jack.h>
 
 #include <memory>
+#include <atomic>
+#include <mutex>
 
 namespace olo {
 
-class JackClient {
+class JackClient: public Backend {
     std::unique_ptr<jack_client_t, decltype(&jack_client_close)> client_;
     const char* name_;
     size_t sample_rate_;
+    ProcessCallback process_callback_ = nullptr;
+    void* process_arg_ = nullptr;
+    // Held by handlers while calling event and buffer size callbacks, and while these are
+    // replaced, so that a callback cleared by its owner is never called afterwards
+    std::mutex callbacks_mutex_;
+    EventCallback event_callback_ = nullptr;
+    void* event_arg_ = nullptr;
+    BufferSizeCallback buffer_size_callback_ = nullptr;
+    void* buffer_size_arg_ = nullptr;
+    // Set by Jack once server has actually entered freewheel mode, by us or any other client
+    std::atomic<bool> freewheeling_{false};
+
+    static int process_(jack_nframes_t frame_count, void* arg);
+    static void freewheel_(int starting, void* arg);
+    static int xrun_(void* arg);
+    static int buffer_size_changed_(jack_nframes_t frame_count, void* arg);
+    static int sample_rate_changed_(jack_nframes_t sample_rate, void* arg);
+    static int graph_order_(void* arg);
 
 public:
     explicit JackClient(const string& name);
 
-    const char* name() const { return name_; }
     jack_client_t* handle() const { return client_.get(); }
-    size_t sample_rate() const { return sample_rate_; }
 
-    void dump_ports() const;
+    const char* name() const override { return name_; }
+    size_t sample_rate() const override { return sample_rate_; }
+    size_t period_size() const override { return jack_get_buffer_size(handle()); }
+    bool realtime() const noexcept override { return !freewheeling_; }
+    int set_freewheel(bool onoff) override { return jack_set_freewheel(handle(), onoff); }
+
     vector<string> enumerate_ports(int type) const;
-    vector<string> capture_ports() const { return enumerate_ports(JackPortIsPhysical | JackPortIsOutput); }
-    vector<string> playback_ports() const { return enumerate_ports(JackPortIsPhysical | JackPortIsInput); }
+    vector<string> capture_ports() const override { return enumerate_ports(JackPortIsPhysical | JackPortIsOutput); }
+    vector<string> playback_ports() const override { return enumerate_ports(JackPortIsPhysical | JackPortIsInput); }
+
+    Port* register_port(const string& short_name, PortDirection direction) override;
+    void unregister_port(Port* port) override;
+    int connect(const string& source, const string& destination) override;
+    int disconnect(const string& source, const string& destination) override;
+    Sample* port_buffer(Port* port, size_t frame_count) noexcept override;
+    std::uint32_t frame_time() const noexcept override { return jack_last_frame_time(handle()); }
+
+    void set_process_callback(ProcessCallback callback, void* arg) override;
+    void set_shutdown_callback(ShutdownCallback callback, void* arg) override;
+    void set_event_callback(EventCallback callback, void* arg) override;
+    void set_buffer_size_callback(BufferSizeCallback callback, void* arg) override;
+    void activate() override;
+    void deactivate() override;
 };
 
-}
\ No newline at end of file
+}
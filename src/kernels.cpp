@@ -0,0 +1,560 @@
+#include "kernels.hpp"
+
+#include <cstring>
+#include <cassert>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+# define OLO_KERNELS_X86 1
+# include <immintrin.h>
+# ifdef _MSC_VER
+#  include <intrin.h>
+# endif
+#endif
+
+// Per-function instruction set selection, so that no global compiler flags are needed and
+// the binary still runs on CPUs lacking the extension. Flatten makes sure the generic block
+// loops and transposes below get inlined and compiled for the target of the entry point.
+// MSVC allows use of any intrinsic without flags.
+#ifdef __GNUC__
+# define OLO_ISA(isa) __attribute__((target(isa)))
+# define OLO_TARGET(isa) __attribute__((target(isa), flatten))
+#else
+# define OLO_ISA(isa)
+# define OLO_TARGET(isa)
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+// False positive on _mm512_undefined_ps() in GCC 12 AVX-512 headers
+# pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+namespace olo {
+
+namespace {
+
+// Number of leading channels out of `n` covered by SIMD blocks of given widths, widest first.
+constexpr size_t blocked_channels(size_t n, size_t c) {
+    return c;
+}
+
+template<class... Widths>
+constexpr size_t blocked_channels(size_t n, size_t c, size_t width, Widths... widths) {
+    return blocked_channels(n, c + (n - c) / width * width, widths...);
+}
+
+// Handles channels from `c` onwards which didn't fit into any SIMD block. With channel count N
+// known at compile time so is the first channel C, and inner loop over channels is unrolled.
+template<size_t N, size_t C>
+void deinterleave_channels(const Sample* src, size_t frames, size_t channels, Sample* const* dst, size_t offset, size_t c) {
+    if (N != 0) {
+        for (size_t n = 0; n != frames; ++n) {
+            for (size_t i = C; i < N; ++i) {
+                dst[i][offset + n] = src[n * N + i];
+            }
+        }
+        return;
+    }
+    for (; c != channels; ++c) {
+        Sample* out = dst[c] + offset;
+        const Sample* in = src + c;
+        for (size_t n = 0; n != frames; ++n, in += channels) {
+            out[n] = *in;
+        }
+    }
+}
+
+template<size_t N, size_t C>
+void interleave_channels(const Sample* const* src, size_t offset, size_t frames, size_t channels, Sample* dst, size_t c) {
+    if (N != 0) {
+        for (size_t n = 0; n != frames; ++n) {
+            for (size_t i = C; i < N; ++i) {
+                dst[n * N + i] = src[i][offset + n];
+            }
+        }
+        return;
+    }
+    for (; c != channels; ++c) {
+        const Sample* in = src[c] + offset;
+        Sample* out = dst + c;
+        for (size_t n = 0; n != frames; ++n, out += channels) {
+            *out = in[n];
+        }
+    }
+}
+
+// Transposes blocks of Isa::width channels by Isa::width frames, starting from channel `c`.
+// Returns index of the first channel which didn't fit in a whole block.
+template<class Isa>
+size_t deinterleave_blocks(const Sample* src, size_t frames, size_t channels, Sample* const* dst, size_t offset, size_t c) {
+    const size_t W = Isa::width;
+    for (; c + W <= channels; c += W) {
+        Sample* out[W];
+        for (size_t i = 0; i != W; ++i) {
+            out[i] = dst[c + i] + offset;
+        }
+        const Sample* in = src + c;
+        size_t n = 0;
+        for (; n + W <= frames; n += W, in += W * channels) {
+            Isa::deinterleave(in, channels, out, n);
+        }
+        for (; n != frames; ++n, in += channels) {
+            for (size_t i = 0; i != W; ++i) {
+                out[i][n] = in[i];
+            }
+        }
+    }
+    return c;
+}
+
+template<class Isa>
+size_t interleave_blocks(const Sample* const* src, size_t offset, size_t frames, size_t channels, Sample* dst, size_t c) {
+    const size_t W = Isa::width;
+    for (; c + W <= channels; c += W) {
+        const Sample* in[W];
+        for (size_t i = 0; i != W; ++i) {
+            in[i] = src[c + i] + offset;
+        }
+        Sample* out = dst + c;
+        size_t n = 0;
+        for (; n + W <= frames; n += W, out += W * channels) {
+            Isa::interleave(in, n, out, channels);
+        }
+        for (; n != frames; ++n, out += channels) {
+            for (size_t i = 0; i != W; ++i) {
+                out[i] = in[i][n];
+            }
+        }
+    }
+    return c;
+}
+
+// Applies block transposes of each Isa in turn (widest first), finishing with scalar code.
+// N is the channel count if known at compile time, 0 otherwise.
+template<size_t N, class... Isa>
+void deinterleave_with(const Sample* src, size_t frames, size_t channels, Sample* const* dst, size_t offset) {
+    assert(N == 0 || N == channels);
+    if (N != 0) {
+        channels = N;
+    }
+    if (channels == 1) {
+        std::memcpy(dst[0] + offset, src, frames * sizeof(Sample));
+        return;
+    }
+    size_t c = 0;
+    using expand = int[];
+    (void)expand{0, (c = deinterleave_blocks<Isa>(src, frames, channels, dst, offset, c), 0)...};
+    deinterleave_channels<N, blocked_channels(N, 0, Isa::width...)>(src, frames, channels, dst, offset, c);
+}
+
+template<size_t N, class... Isa>
+void interleave_with(const Sample* const* src, size_t offset, size_t frames, size_t channels, Sample* dst) {
+    assert(N == 0 || N == channels);
+    if (N != 0) {
+        channels = N;
+    }
+    if (channels == 1) {
+        std::memcpy(dst, src[0] + offset, frames * sizeof(Sample));
+        return;
+    }
+    size_t c = 0;
+    using expand = int[];
+    (void)expand{0, (c = interleave_blocks<Isa>(src, offset, frames, channels, dst, c), 0)...};
+    interleave_channels<N, blocked_channels(N, 0, Isa::width...)>(src, offset, frames, channels, dst, c);
+}
+
+template<size_t N>
+void deinterleave_scalar(const Sample* src, size_t frames, size_t channels, Sample* const* dst, size_t offset) {
+    deinterleave_with<N>(src, frames, channels, dst, offset);
+}
+
+template<size_t N>
+void interleave_scalar(const Sample* const* src, size_t offset, size_t frames, size_t channels, Sample* dst) {
+    interleave_with<N>(src, offset, frames, channels, dst);
+}
+
+#ifdef OLO_KERNELS_X86
+
+struct Sse2 {
+    static const size_t width = 4;
+
+    OLO_ISA("sse2")
+    static void deinterleave(const Sample* in, size_t stride, Sample* const* out, size_t n) {
+        __m128 r0 = _mm_loadu_ps(in);
+        __m128 r1 = _mm_loadu_ps(in + stride);
+        __m128 r2 = _mm_loadu_ps(in + 2 * stride);
+        __m128 r3 = _mm_loadu_ps(in + 3 * stride);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(out[0] + n, r0);
+        _mm_storeu_ps(out[1] + n, r1);
+        _mm_storeu_ps(out[2] + n, r2);
+        _mm_storeu_ps(out[3] + n, r3);
+    }
+
+    OLO_ISA("sse2")
+    static void interleave(const Sample* const* in, size_t n, Sample* out, size_t stride) {
+        __m128 r0 = _mm_loadu_ps(in[0] + n);
+        __m128 r1 = _mm_loadu_ps(in[1] + n);
+        __m128 r2 = _mm_loadu_ps(in[2] + n);
+        __m128 r3 = _mm_loadu_ps(in[3] + n);
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _mm_storeu_ps(out, r0);
+        _mm_storeu_ps(out + stride, r1);
+        _mm_storeu_ps(out + 2 * stride, r2);
+        _mm_storeu_ps(out + 3 * stride, r3);
+    }
+};
+
+// Stereo is common enough and doesn't fit any square block, so it gets dedicated shuffles.
+OLO_ISA("sse2")
+void deinterleave_stereo(const Sample* src, size_t frames, Sample* const* dst, size_t offset) {
+    Sample* left = dst[0] + offset;
+    Sample* right = dst[1] + offset;
+    size_t n = 0;
+    for (; n + 4 <= frames; n += 4, src += 8) {
+        __m128 a = _mm_loadu_ps(src);
+        __m128 b = _mm_loadu_ps(src + 4);
+        _mm_storeu_ps(left + n, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + n, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    for (; n != frames; ++n, src += 2) {
+        left[n] = src[0];
+        right[n] = src[1];
+    }
+}
+
+OLO_ISA("sse2")
+void interleave_stereo(const Sample* const* src, size_t offset, size_t frames, Sample* dst) {
+    const Sample* left = src[0] + offset;
+    const Sample* right = src[1] + offset;
+    size_t n = 0;
+    for (; n + 4 <= frames; n += 4, dst += 8) {
+        __m128 l = _mm_loadu_ps(left + n);
+        __m128 r = _mm_loadu_ps(right + n);
+        _mm_storeu_ps(dst, _mm_unpacklo_ps(l, r));
+        _mm_storeu_ps(dst + 4, _mm_unpackhi_ps(l, r));
+    }
+    for (; n != frames; ++n, dst += 2) {
+        dst[0] = left[n];
+        dst[1] = right[n];
+    }
+}
+
+struct Avx2 {
+    static const size_t width = 8;
+
+    OLO_ISA("avx2")
+    static void transpose(__m256* r) {
+        __m256 t[8], u[8];
+        for (int i = 0; i != 8; i += 2) {
+            t[i] = _mm256_unpacklo_ps(r[i], r[i + 1]);
+            t[i + 1] = _mm256_unpackhi_ps(r[i], r[i + 1]);
+        }
+        for (int i = 0; i != 8; i += 4) {
+            u[i] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(1, 0, 1, 0));
+            u[i + 1] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(3, 2, 3, 2));
+            u[i + 2] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(1, 0, 1, 0));
+            u[i + 3] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(3, 2, 3, 2));
+        }
+        for (int i = 0; i != 4; ++i) {
+            r[i] = _mm256_permute2f128_ps(u[i], u[i + 4], 0x20);
+            r[i + 4] = _mm256_permute2f128_ps(u[i], u[i + 4], 0x31);
+        }
+    }
+
+    OLO_ISA("avx2")
+    static void deinterleave(const Sample* in, size_t stride, Sample* const* out, size_t n) {
+        __m256 r[8];
+        for (size_t i = 0; i != 8; ++i) {
+            r[i] = _mm256_loadu_ps(in + i * stride);
+        }
+        transpose(r);
+        for (size_t i = 0; i != 8; ++i) {
+            _mm256_storeu_ps(out[i] + n, r[i]);
+        }
+    }
+
+    OLO_ISA("avx2")
+    static void interleave(const Sample* const* in, size_t n, Sample* out, size_t stride) {
+        __m256 r[8];
+        for (size_t i = 0; i != 8; ++i) {
+            r[i] = _mm256_loadu_ps(in[i] + n);
+        }
+        transpose(r);
+        for (size_t i = 0; i != 8; ++i) {
+            _mm256_storeu_ps(out + i * stride, r[i]);
+        }
+    }
+};
+
+struct Avx512 {
+    static const size_t width = 16;
+
+    OLO_ISA("avx512f")
+    static void transpose(__m512* r) {
+        __m512 t[16], u[16];
+        // 4x4 transposes within each 128-bit lane...
+        for (int i = 0; i != 16; i += 2) {
+            t[i] = _mm512_unpacklo_ps(r[i], r[i + 1]);
+            t[i + 1] = _mm512_unpackhi_ps(r[i], r[i + 1]);
+        }
+        for (int i = 0; i != 16; i += 4) {
+            u[i] = _mm512_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(1, 0, 1, 0));
+            u[i + 1] = _mm512_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(3, 2, 3, 2));
+            u[i + 2] = _mm512_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(1, 0, 1, 0));
+            u[i + 3] = _mm512_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(3, 2, 3, 2));
+        }
+        // ...followed by 4x4 transpose of the lanes themselves
+        for (int i = 0; i != 4; ++i) {
+            t[i] = _mm512_shuffle_f32x4(u[i], u[i + 4], _MM_SHUFFLE(2, 0, 2, 0));
+            t[i + 4] = _mm512_shuffle_f32x4(u[i], u[i + 4], _MM_SHUFFLE(3, 1, 3, 1));
+            t[i + 8] = _mm512_shuffle_f32x4(u[i + 8], u[i + 12], _MM_SHUFFLE(2, 0, 2, 0));
+            t[i + 12] = _mm512_shuffle_f32x4(u[i + 8], u[i + 12], _MM_SHUFFLE(3, 1, 3, 1));
+        }
+        for (int i = 0; i != 4; ++i) {
+            r[i] = _mm512_shuffle_f32x4(t[i], t[i + 8], _MM_SHUFFLE(2, 0, 2, 0));
+            r[i + 8] = _mm512_shuffle_f32x4(t[i], t[i + 8], _MM_SHUFFLE(3, 1, 3, 1));
+            r[i + 4] = _mm512_shuffle_f32x4(t[i + 4], t[i + 12], _MM_SHUFFLE(2, 0, 2, 0));
+            r[i + 12] = _mm512_shuffle_f32x4(t[i + 4], t[i + 12], _MM_SHUFFLE(3, 1, 3, 1));
+        }
+    }
+
+    OLO_ISA("avx512f")
+    static void deinterleave(const Sample* in, size_t stride, Sample* const* out, size_t n) {
+        __m512 r[16];
+        for (size_t i = 0; i != 16; ++i) {
+            r[i] = _mm512_loadu_ps(in + i * stride);
+        }
+        transpose(r);
+        for (size_t i = 0; i != 16; ++i) {
+            _mm512_storeu_ps(out[i] + n, r[i]);
+        }
+    }
+
+    OLO_ISA("avx512f")
+    static void interleave(const Sample* const* in, size_t n, Sample* out, size_t stride) {
+        __m512 r[16];
+        for (size_t i = 0; i != 16; ++i) {
+            r[i] = _mm512_loadu_ps(in[i] + n);
+        }
+        transpose(r);
+        for (size_t i = 0; i != 16; ++i) {
+            _mm512_storeu_ps(out + i * stride, r[i]);
+        }
+    }
+};
+
+template<size_t N>
+OLO_TARGET("sse2")
+void deinterleave_sse2(const Sample* src, size_t frames, size_t channels, Sample* const* dst, size_t offset) {
+    if (channels == 2) {
+        assert(N == 0 || N == 2);
+        deinterleave_stereo(src, frames, dst, offset);
+    } else {
+        deinterleave_with<N, Sse2>(src, frames, channels, dst, offset);
+    }
+}
+
+template<size_t N>
+OLO_TARGET("sse2")
+void interleave_sse2(const Sample* const* src, size_t offset, size_t frames, size_t channels, Sample* dst) {
+    if (channels == 2) {
+        assert(N == 0 || N == 2);
+        interleave_stereo(src, offset, frames, dst);
+    } else {
+        interleave_with<N, Sse2>(src, offset, frames, channels, dst);
+    }
+}
+
+template<size_t N>
+OLO_TARGET("avx2")
+void deinterleave_avx2(const Sample* src, size_t frames, size_t channels, Sample* const* dst, size_t offset) {
+    if (channels == 2) {
+        assert(N == 0 || N == 2);
+        deinterleave_stereo(src, frames, dst, offset);
+    } else {
+        deinterleave_with<N, Avx2, Sse2>(src, frames, channels, dst, offset);
+    }
+}
+
+template<size_t N>
+OLO_TARGET("avx2")
+void interleave_avx2(const Sample* const* src, size_t offset, size_t frames, size_t channels, Sample* dst) {
+    if (channels == 2) {
+        assert(N == 0 || N == 2);
+        interleave_stereo(src, offset, frames, dst);
+    } else {
+        interleave_with<N, Avx2, Sse2>(src, offset, frames, channels, dst);
+    }
+}
+
+template<size_t N>
+OLO_TARGET("avx512f")
+void deinterleave_avx512(const Sample* src, size_t frames, size_t channels, Sample* const* dst, size_t offset) {
+    if (channels == 2) {
+        assert(N == 0 || N == 2);
+        deinterleave_stereo(src, frames, dst, offset);
+    } else {
+        deinterleave_with<N, Avx512, Avx2, Sse2>(src, frames, channels, dst, offset);
+    }
+}
+
+template<size_t N>
+OLO_TARGET("avx512f")
+void interleave_avx512(const Sample* const* src, size_t offset, size_t frames, size_t channels, Sample* dst) {
+    if (channels == 2) {
+        assert(N == 0 || N == 2);
+        interleave_stereo(src, offset, frames, dst);
+    } else {
+        interleave_with<N, Avx512, Avx2, Sse2>(src, offset, frames, channels, dst);
+    }
+}
+
+#ifdef _MSC_VER
+bool cpu_supports(Isa isa) {
+    int regs[4];
+    __cpuid(regs, 0);
+    const int max_leaf = regs[0];
+    __cpuid(regs, 1);
+    if (isa == Isa::SSE2) {
+        return (regs[3] & (1 << 26)) != 0;
+    }
+    // AVX state must be enabled by the OS, as reported by XGETBV
+    const bool osxsave = (regs[2] & (1 << 27)) != 0;
+    if (!osxsave || max_leaf < 7) {
+        return false;
+    }
+    const unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(regs, 7, 0);
+    if (isa == Isa::AVX2) {
+        return (xcr0 & 0x6) == 0x6 && (regs[1] & (1 << 5)) != 0;
+    }
+    return (xcr0 & 0xe6) == 0xe6 && (regs[1] & (1 << 16)) != 0;
+}
+#else
+bool cpu_supports(Isa isa) {
+    switch (isa) {
+    case Isa::SSE2:
+        return __builtin_cpu_supports("sse2");
+    case Isa::AVX2:
+        return __builtin_cpu_supports("avx2");
+    case Isa::AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        return true;
+    }
+}
+#endif
+
+#endif // OLO_KERNELS_X86
+
+Isa detect_isa() {
+#ifdef OLO_KERNELS_X86
+    for (Isa isa: {Isa::AVX512, Isa::AVX2, Isa::SSE2}) {
+        if (cpu_supports(isa)) {
+            return isa;
+        }
+    }
+#endif
+    return Isa::SCALAR;
+}
+
+template<size_t N>
+Kernels make_kernels(Isa isa) {
+    switch (isa) {
+#ifdef OLO_KERNELS_X86
+    case Isa::AVX512:
+        return {"avx512", N, deinterleave_avx512<N>, interleave_avx512<N>};
+    case Isa::AVX2:
+        return {"avx2", N, deinterleave_avx2<N>, interleave_avx2<N>};
+    case Isa::SSE2:
+        return {"sse2", N, deinterleave_sse2<N>, interleave_sse2<N>};
+#endif
+    default:
+        return {"scalar", N, deinterleave_scalar<N>, interleave_scalar<N>};
+    }
+}
+}
+
+bool isa_supported(Isa isa) {
+#ifdef OLO_KERNELS_X86
+    return isa == Isa::SCALAR || cpu_supports(isa);
+#else
+    return isa == Isa::SCALAR;
+#endif
+}
+
+Kernels select_kernels(size_t channels) {
+    static const Isa isa = detect_isa();
+    return select_kernels(channels, isa);
+}
+
+Kernels select_kernels(size_t channels, Isa isa) {
+    // Channel counts we commonly run with get kernels with fully unrolled channel loops
+    switch (channels) {
+    case 1: return make_kernels<1>(isa);
+    case 2: return make_kernels<2>(isa);
+    case 4: return make_kernels<4>(isa);
+    case 6: return make_kernels<6>(isa);
+    case 8: return make_kernels<8>(isa);
+    case 16: return make_kernels<16>(isa);
+    case 32: return make_kernels<32>(isa);
+    default: return make_kernels<0>(isa);
+    }
+}
+
+void deinterleave_ring(
+    const Kernels& k,
+    const jack_ringbuffer_data_t* vec,
+    size_t frames,
+    size_t channels,
+    Sample* const* dst
+) {
+    const size_t frame_size = channels * sizeof(Sample);
+    const Sample* head = reinterpret_cast<const Sample*>(vec[0].buf);
+    const Sample* tail = reinterpret_cast<const Sample*>(vec[1].buf);
+    size_t n = std::min(frames, vec[0].len / frame_size);
+    k.deinterleave(head, n, channels, dst, 0);
+    if (n == frames) {
+        return;
+    }
+    // Samples of the straddling frame left at the end of the first segment
+    size_t split = (vec[0].len / sizeof(Sample)) % channels;
+    if (split != 0) {
+        head += n * channels;
+        for (size_t c = 0; c != channels; ++c) {
+            dst[c][n] = c < split ? head[c] : tail[c - split];
+        }
+        tail += channels - split;
+        ++n;
+    }
+    k.deinterleave(tail, frames - n, channels, dst, n);
+}
+
+void interleave_ring(
+    const Kernels& k,
+    const Sample* const* src,
+    size_t frames,
+    size_t channels,
+    const jack_ringbuffer_data_t* vec
+) {
+    const size_t frame_size = channels * sizeof(Sample);
+    Sample* head = reinterpret_cast<Sample*>(vec[0].buf);
+    Sample* tail = reinterpret_cast<Sample*>(vec[1].buf);
+    size_t n = std::min(frames, vec[0].len / frame_size);
+    k.interleave(src, 0, n, channels, head);
+    if (n == frames) {
+        return;
+    }
+    size_t split = (vec[0].len / sizeof(Sample)) % channels;
+    if (split != 0) {
+        head += n * channels;
+        for (size_t c = 0; c != channels; ++c) {
+            (c < split ? head[c] : tail[c - split]) = src[c][n];
+        }
+        tail += channels - split;
+        ++n;
+    }
+    k.interleave(src, n, frames - n, channels, tail);
+}
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "types.hpp"
+
+#include <jack/ringbuffer.h>
+
+namespace olo {
+
+// Moves samples between interleaved frames (ringbuffer, sound file layout) and planar channel
+// buffers (Jack port layout). All channel pointers must be valid, there are no null checks.
+struct Kernels {
+    // Name of the instruction set the kernels use, for diagnostics
+    const char* isa;
+    // Channel count the kernels are specialized for, 0 if any
+    size_t channels;
+    // dst[c][offset + n] = src[n * channels + c] for n < frames, c < channels
+    void (*deinterleave)(const Sample* src, size_t frames, size_t channels, Sample* const* dst, size_t offset);
+    // dst[n * channels + c] = src[c][offset + n] for n < frames, c < channels
+    void (*interleave)(const Sample* const* src, size_t offset, size_t frames, size_t channels, Sample* dst);
+};
+
+// Instruction sets there are kernels for
+enum class Isa {
+    SCALAR,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+// True if the CPU runs kernels of `isa`. Scalar ones run anywhere.
+bool isa_supported(Isa isa);
+// Returns kernels for the best instruction set supported by the CPU (detected on first call),
+// specialized for `channels` if that's one of commonly used channel counts.
+Kernels select_kernels(size_t channels);
+// Returns kernels of `isa`, which must be supported by the CPU, specialized as above
+Kernels select_kernels(size_t channels, Isa isa);
+
+// Demultiplexes `frames` frames from ringbuffer read vector `vec` into channel buffers `dst`.
+// Ringbuffer size is a power of 2, so a frame may straddle the boundary between the segments.
+void deinterleave_ring(
+    const Kernels& k,
+    const jack_ringbuffer_data_t* vec,
+    size_t frames,
+    size_t channels,
+    Sample* const* dst
+);
+
+// Multiplexes `frames` frames from channel buffers `src` into ringbuffer write vector `vec`.
+void interleave_ring(
+    const Kernels& k,
+    const Sample* const* src,
+    size_t frames,
+    size_t channels,
+    const jack_ringbuffer_data_t* vec
+);
+
+}
@@ -1,12 +1,24 @@
 #include "log.hpp"
+#include "spsc_queue.hpp"
 
 #include <cstdarg>
 #include <cstdio>
+#include <atomic>
 
 namespace olo {
 
 namespace {
 LogLevel log_level = LINFO;
+
+struct RtLogRecord {
+    LogLevel level;
+    RtEvent event;
+    std::uint32_t frame_time;
+    size_t values[2];
+};
+
+SpscQueue<RtLogRecord, 256> rt_queue;
+std::atomic<size_t> rt_dropped{0};
 }
 
 void set_loglevel(LogLevel l) {
@@ -23,4 +35,45 @@ void log(LogLevel level, const char* format, ...) {
     vfprintf(stderr, format, args);
     va_end(args);
 }
+
+void rt_log(LogLevel level, RtEvent event, std::uint32_t frame_time, size_t value0, size_t value1) noexcept {
+    if (level < log_level) {
+        return;
+    }
+    if (!rt_queue.push({level, event, frame_time, {value0, value1}})) {
+        rt_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void rt_log_drain() {
+    RtLogRecord r;
+    while (rt_queue.pop(r)) {
+        switch (r.event) {
+        case RT_UNDERRUN:
+            log(r.level, "Reactor::playback(): ringbuffer short of %zd of %zd frames at frame time %u, UNDERRUN\n",
+                r.values[0], r.values[1], r.frame_time);
+            break;
+        case RT_OVERRUN:
+            log(r.level, "Reactor::capture(): ringbuffer short of space for %zd of %zd frames at frame time %u, OVERRUN\n",
+                r.values[0], r.values[1], r.frame_time);
+            break;
+        case RT_FINISHED:
+            log(r.level, "Reactor::process(): signalled done to control thread after %zd frames at frame time %u\n",
+                r.values[0], r.frame_time);
+            break;
+        case RT_CANCELLED:
+            log(r.level, "Reactor::process(): run cancelled after %zd frames at frame time %u\n",
+                r.values[0], r.frame_time);
+            break;
+        case RT_LATE_START:
+            log(r.level, "Reactor::process(): run started %zd frames after the requested gap at frame time %u\n",
+                r.values[0], r.frame_time);
+            break;
+        }
+    }
+    size_t dropped = rt_dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped != 0) {
+        lerror("rt_log_drain(): %zd Jack thread log records lost, queue full\n", dropped);
+    }
+}
 }
@@ -1,4 +1,7 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
+
 namespace olo {
 
 // Note: use of boost-logging seems like an overkill, this should be simplistic
@@ -18,4 +21,29 @@ void log(LogLevel level, const char* format, ...);
 #define lerror(...) ::olo::log(::olo::LERROR, __VA_ARGS__)
 
 void set_loglevel(LogLevel l);
-}
\ No newline at end of file
+
+// Events reported from Jack thread, which mustn't format or print anything itself.
+enum RtEvent {
+    // Playback ringbuffer had too few frames; values: frames missing, frames needed
+    RT_UNDERRUN,
+    // Capture ringbuffer had too little space; values: frames dropped, frames needed
+    RT_OVERRUN,
+    // Requested number of frames processed; values: frames processed
+    RT_FINISHED,
+    // Run started after the requested gap had passed; values: frames late
+    RT_LATE_START,
+    // Run ended early on request; values: frames processed
+    RT_CANCELLED
+};
+
+// Queues fixed-size event record for formatting by rt_log_drain(). Lock-free and doesn't
+// allocate, so it's safe to call from Jack thread, but only from a single thread at a time.
+// Records are dropped (and counted) if the queue is full.
+void rt_log(LogLevel level, RtEvent event, std::uint32_t frame_time, std::size_t value0 = 0, std::size_t value1 = 0) noexcept;
+
+// Formats and prints records queued with rt_log(). Call periodically from one non-RT thread.
+void rt_log_drain();
+
+#define rt_ldebug(...) ::olo::rt_log(::olo::LDEBUG, __VA_ARGS__)
+#define rt_lerror(...) ::olo::rt_log(::olo::LERROR, __VA_ARGS__)
+}
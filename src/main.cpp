@@ -1,11 +1,14 @@
 #include "types.hpp"
 #include "cli.hpp"
+#include "calibrate.hpp"
 #include "jack_client.hpp"
+#include "offline.hpp"
 #include "io.hpp"
 #include "reactor.hpp"
+#include "batch.hpp"
+#include "daemon.hpp"
 #include "log.hpp"
-
-#include <jack/jack.h>
+#include "trace.hpp"
 
 #include <memory>
 #include <exception>
@@ -15,70 +18,93 @@
 namespace olo {
 using std::unique_ptr;
 
-namespace {
-void fixup_default_ports(Args& args, const JackClient& client) {
-    if(args.input_ports == Args::PORTS_DEFAULT) {
-        args.input_ports = client.capture_ports();
-        if (args.input_channel_count) {
-            args.input_ports.resize(std::min(*args.input_channel_count, args.input_ports.size()));
-        }
+void run(Args& args) {
+    unique_ptr<Backend> backend;
+    if (args.offline) {
+        OfflineConfig config;
+        config.sample_rate = args.offline_rate;
+        config.period_size = args.offline_period;
+        config.channels = args.offline_channels;
+        config.capture = args.offline_capture;
+        backend.reset(new OfflineBackend{JACK_CLIENT_NAME, config});
+    } else {
+        backend.reset(new JackClient{JACK_CLIENT_NAME});
     }
-    if(args.output_ports == Args::PORTS_DEFAULT) {
-        args.output_ports = client.playback_ports();
-        if (!args.input_file.empty()) {
-            auto channels = query_audio_file_channels(args.input_file);
-            args.output_ports.resize(std::min(args.output_ports.size(), channels));
-        }
+    if (args.show_ports) {
+        backend->dump_ports();
+        return;
     }
-}
-}
 
-void main(int argc, char** argv) {
-    auto args = handle_cli(argc, argv);
-    if (args.debug) {
-        set_loglevel(LDEBUG);
+    if (!args.batch_file.empty()) {
+        run_batch(*backend, args);
+        return;
     }
-    JackClient client(JACK_CLIENT_NAME);
-    if (args.show_ports) {
-        client.dump_ports();
+    if (args.daemon) {
+        run_daemon(*backend, args);
         return;
     }
 
-    fixup_default_ports(args, client);
+    fixup_default_ports(args, *backend);
+    if (args.auto_buffer_ms) {
+        auto_size_buffers({&args}, backend->sample_rate(), backend->period_size(), *args.auto_buffer_ms);
+    }
+    const auto transport = args.planar ? Transport::PLANAR : Transport::INTERLEAVED;
+    const auto wav_io = args.direct_io ? WavIo::URING_DIRECT : args.uring ? WavIo::URING : WavIo::SYNC;
+    const size_t buffer_size = args.buffer_periods != 0 ? args.buffer_periods * backend->period_size() : args.buffer_size;
 
     unique_ptr<Reader> reader;
     if (!args.input_file.empty()) {
         reader.reset(new Reader {
             args.input_file,
-            client.sample_rate(),
+            backend->sample_rate(),
             args.output_ports.size(),
-            args.buffer_size,
+            buffer_size,
             args.duration_secs.value_or(0),
-            args.start_offset_secs
+            args.start_offset_secs,
+            transport,
+            args.low_watermark,
+            args.preload
         });
+        reader->set_buffer_periods(args.buffer_periods);
     }
 
     unique_ptr<Writer> writer;
     if (!args.output_file.empty()) {
         writer.reset(new Writer {
             args.output_file,
-            client.sample_rate(),
+            backend->sample_rate(),
             args.input_ports.size(),
-            args.buffer_size,
-            args.duration_secs.value_or(0)
+            buffer_size,
+            args.duration_secs.value_or(0),
+            transport,
+            args.high_watermark,
+            args.record_float,
+            wav_io
         });
+        writer->set_buffer_periods(args.buffer_periods);
     }
 
     Reactor reactor {
-        client,
+        *backend,
+        writer ? args.input_ports.size() : 0,
+        reader ? args.output_ports.size() : 0,
+        args.freewheel
+    };
+
+    reactor.start(
         args.input_ports,
         args.output_ports,
         reader.get(),
         writer.get(),
         args.duration_secs && 0 == *args.duration_secs
-    };
-
+    );
     reactor.wait_finished();
+    if (!args.stats_file.empty()) {
+        write_stats_file(args.stats_file, reactor.stats(), backend->sample_rate());
+    }
+    if (writer && args.mark_events) {
+        report_events(reactor.events(), *writer, args.output_file, backend->sample_rate());
+    }
 
     if (reader) {
         reader->stop();
@@ -87,10 +113,32 @@ void main(int argc, char** argv) {
     }
     if (writer) {
         writer->stop();
+        // Finishes the file with markers, if any
+        writer->close();
         std::cout << "frames written: " << writer->frames_done() << " ("
             << std::fixed << std::setprecision(3) << writer->frames_done() / (double)writer->sample_rate() << "s)\n";
     }
 }
+
+void main(int argc, char** argv) {
+    auto args = handle_cli(argc, argv);
+    if (args.debug) {
+        set_loglevel(LDEBUG);
+    }
+    if (args.trace_file.empty()) {
+        run(args);
+        return;
+    }
+    trace_enable();
+    try {
+        run(args);
+    } catch (...) {
+        // Timeline leading to the failure is the interesting one
+        trace_write(args.trace_file);
+        throw;
+    }
+    trace_write(args.trace_file);
+}
 }
 
 int main(int argc, char** argv) {
@@ -0,0 +1,274 @@
+#include "offline.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <cerrno>
+#include <cassert>
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+namespace {
+const string SINE_PREFIX = "sine:";
+const double PI = 3.14159265358979323846;
+}
+
+OfflineBackend::OfflineBackend(const string& name, const OfflineConfig& config):
+    name_{name},
+    config_{config},
+    sf_{nullptr, sf_close}
+{
+    if (config_.sample_rate == 0 || config_.period_size == 0) {
+        throw runtime_error{"offline engine sample rate and period size must be positive"};
+    }
+    size_t capture_channels = config_.channels;
+    if (config_.capture == "silence") {
+        source_ = Source::SILENCE;
+    } else if (config_.capture == "noise") {
+        source_ = Source::NOISE;
+    } else if (config_.capture == "loopback") {
+        source_ = Source::LOOPBACK;
+    } else if (config_.capture.compare(0, SINE_PREFIX.size(), SINE_PREFIX) == 0) {
+        source_ = Source::SINE;
+        try {
+            sine_frequency_ = std::stod(config_.capture.substr(SINE_PREFIX.size()));
+        } catch (std::exception&) {
+            throw runtime_error{str(format("invalid sine frequency in offline capture: %1%") % config_.capture)};
+        }
+    } else {
+        source_ = Source::FILE;
+        SF_INFO si = {0};
+        sf_.reset(sf_open(config_.capture.c_str(), SFM_READ, &si));
+        if (!sf_) {
+            throw runtime_error{str(format("can't open offline capture file: %1%") % config_.capture)};
+        }
+        if (static_cast<size_t>(si.samplerate) != config_.sample_rate) {
+            throw runtime_error{str(format("offline capture file sample rate: %1%; engine sample rate: %2%")
+                % si.samplerate % config_.sample_rate)};
+        }
+        capture_channels = si.channels;
+        file_buff_.reset(new Sample[config_.period_size * capture_channels]);
+        kernels_ = select_kernels(capture_channels);
+    }
+    for (size_t i = 0; i != capture_channels; ++i) {
+        capture_names_.push_back(str(format("system:capture_%1%") % (i + 1)));
+        capture_.emplace_back(config_.period_size);
+    }
+    for (size_t i = 0; i != config_.channels; ++i) {
+        playback_names_.push_back(str(format("system:playback_%1%") % (i + 1)));
+        playback_.emplace_back(config_.period_size);
+    }
+    for (auto& buff: capture_) {
+        capture_buffers_.push_back(buff.data());
+    }
+    ldebug("OfflineBackend: running at sample rate %zd with period of %zd frames, %zd capture ports fed with %s\n",
+        config_.sample_rate, config_.period_size, capture_channels, config_.capture.c_str());
+}
+
+OfflineBackend::~OfflineBackend() {
+    deactivate();
+}
+
+OfflineBackend::ClientPort* OfflineBackend::find_port(const string& name) const {
+    for (auto& port: ports_) {
+        if (port->name == name) {
+            return port.get();
+        }
+    }
+    return nullptr;
+}
+
+Port* OfflineBackend::register_port(const string& short_name, PortDirection direction) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto full_name = name_ + ":" + short_name;
+    if (find_port(full_name) != nullptr) {
+        throw runtime_error{str(format("failed creating port %1%") % short_name)};
+    }
+    ports_.emplace_back(new ClientPort{full_name, direction, vector<Sample>(config_.period_size), {}});
+    return reinterpret_cast<Port*>(ports_.back().get());
+}
+
+void OfflineBackend::unregister_port(Port* port) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto p = reinterpret_cast<ClientPort*>(port);
+    ports_.erase(std::remove_if(ports_.begin(), ports_.end(),
+        [p](const std::unique_ptr<ClientPort>& q) { return q.get() == p; }), ports_.end());
+}
+
+bool OfflineBackend::find_connection(const string& source, const string& destination, ClientPort*& port, size_t& index) const {
+    // Only physical capture -> client input and client output -> physical playback are supported
+    auto capture = std::find(capture_names_.begin(), capture_names_.end(), source);
+    auto playback = std::find(playback_names_.begin(), playback_names_.end(), destination);
+    if (capture != capture_names_.end()) {
+        port = find_port(destination);
+        index = capture - capture_names_.begin();
+        return port != nullptr && port->direction == PortDirection::INPUT;
+    }
+    if (playback != playback_names_.end()) {
+        port = find_port(source);
+        index = playback - playback_names_.begin();
+        return port != nullptr && port->direction == PortDirection::OUTPUT;
+    }
+    return false;
+}
+
+int OfflineBackend::connect(const string& source, const string& destination) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    ClientPort* port = nullptr;
+    size_t index = 0;
+    if (!find_connection(source, destination, port, index)) {
+        return -1;
+    }
+    if (std::find(port->connections.begin(), port->connections.end(), index) != port->connections.end()) {
+        return EEXIST;
+    }
+    port->connections.push_back(index);
+    return 0;
+}
+
+int OfflineBackend::disconnect(const string& source, const string& destination) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    ClientPort* port = nullptr;
+    size_t index = 0;
+    if (!find_connection(source, destination, port, index)) {
+        return -1;
+    }
+    auto it = std::find(port->connections.begin(), port->connections.end(), index);
+    if (it == port->connections.end()) {
+        return -1;
+    }
+    port->connections.erase(it);
+    return 0;
+}
+
+Sample* OfflineBackend::port_buffer(Port* port, size_t frame_count) noexcept {
+    assert(frame_count <= config_.period_size);
+    auto p = reinterpret_cast<ClientPort*>(port);
+    if (p->direction == PortDirection::INPUT) {
+        // Like Jack, mix connected ports on request, so that connections made while the
+        // client was waiting in this period are taken into account
+        std::lock_guard<std::mutex> lock{mutex_};
+        std::fill(p->buffer.begin(), p->buffer.end(), 0);
+        for (auto c: p->connections) {
+            for (size_t n = 0; n != frame_count; ++n) {
+                p->buffer[n] += capture_[c][n];
+            }
+        }
+    }
+    return p->buffer.data();
+}
+
+void OfflineBackend::set_process_callback(ProcessCallback callback, void* arg) {
+    process_callback_ = callback;
+    process_arg_ = arg;
+}
+
+void OfflineBackend::set_shutdown_callback(ShutdownCallback callback, void* arg) {
+    shutdown_callback_ = callback;
+    shutdown_arg_ = arg;
+}
+
+void OfflineBackend::activate() {
+    assert(!thread_);
+    running_ = true;
+    thread_.reset(new std::thread(&OfflineBackend::run, this));
+    ldebug("OfflineBackend::activate(): processing thread started\n");
+}
+
+void OfflineBackend::deactivate() {
+    if (thread_) {
+        running_ = false;
+        thread_->join();
+        thread_.reset();
+        ldebug("OfflineBackend::deactivate(): processing thread stopped after %zd frames\n", frame_time_);
+    }
+}
+
+bool OfflineBackend::generate() {
+    const size_t frames = config_.period_size;
+    switch (source_) {
+    case Source::SILENCE:
+        // Buffers are zeroed on construction and never written
+        return true;
+    case Source::NOISE: {
+        std::uniform_real_distribution<Sample> dist{-1, 1};
+        for (auto& buff: capture_) {
+            std::generate(buff.begin(), buff.end(), [&] { return dist(noise_); });
+        }
+        return true;
+    }
+    case Source::SINE: {
+        const double step = 2 * PI * sine_frequency_ / config_.sample_rate;
+        for (size_t n = 0; n != frames; ++n) {
+            capture_[0][n] = std::sin(step * (frame_time_ + n));
+        }
+        for (size_t c = 1; c < capture_.size(); ++c) {
+            capture_[c] = capture_[0];
+        }
+        return true;
+    }
+    case Source::LOOPBACK:
+        // Playback ports still hold what was mixed on the previous period
+        for (size_t c = 0; c != capture_.size(); ++c) {
+            capture_[c] = playback_[c];
+        }
+        return true;
+    case Source::FILE: {
+        size_t read = std::max<sf_count_t>(0, sf_readf_float(sf_.get(), file_buff_.get(), frames));
+        kernels_.deinterleave(file_buff_.get(), read, capture_.size(), capture_buffers_.data(), 0);
+        for (auto& buff: capture_) {
+            std::fill(buff.begin() + read, buff.end(), 0);
+        }
+        return read == frames;
+    }
+    }
+    return true;
+}
+
+void OfflineBackend::cycle() {
+    const size_t frames = config_.period_size;
+    // Like Jack, let connections change while the client processes the period, which may
+    // take a while when it waits for the disk. Ports are only unregistered when inactive.
+    if (process_callback_ != nullptr) {
+        process_callback_(frames, process_arg_);
+    }
+    std::lock_guard<std::mutex> lock{mutex_};
+    // Playback ports get the sum of output ports connected to them
+    for (auto& buff: playback_) {
+        std::fill(buff.begin(), buff.end(), 0);
+    }
+    for (auto& port: ports_) {
+        if (port->direction != PortDirection::OUTPUT) {
+            continue;
+        }
+        for (auto c: port->connections) {
+            for (size_t n = 0; n != frames; ++n) {
+                playback_[c][n] += port->buffer[n];
+            }
+        }
+    }
+    frame_time_ += frames;
+}
+
+void OfflineBackend::run() {
+    bool shutdown_fired = false;
+    while (running_) {
+        bool more = generate();
+        cycle();
+        if (!more && !shutdown_fired) {
+            // Like Jack server going away, the client is expected to deactivate
+            ldebug("OfflineBackend::run(): capture file has ended after %zd frames\n", frame_time_);
+            shutdown_fired = true;
+            if (shutdown_callback_ != nullptr) {
+                shutdown_callback_(shutdown_arg_);
+            }
+        }
+    }
+}
+
+}
@@ -0,0 +1,110 @@
+#pragma once
+#include "types.hpp"
+#include "backend.hpp"
+#include "kernels.hpp"
+
+#include <sndfile.h>
+
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+
+namespace olo {
+
+struct OfflineConfig {
+    size_t sample_rate = OFFLINE_RATE_DEFAULT;
+    size_t period_size = OFFLINE_PERIOD_DEFAULT;
+    // Number of physical capture and playback ports
+    size_t channels = OFFLINE_CHANNELS_DEFAULT;
+    // Signal of capture ports: "silence", "noise", "sine:<frequency in Hz>", "loopback" (what
+    // was played back on the previous period) or path of a sound file to read. With a sound
+    // file there are as many capture ports as it has channels, and the engine shuts down at
+    // its end.
+    string capture = "silence";
+};
+
+// Engine running the process callback in a loop of its own as fast as the disk threads allow,
+// without any audio server. Physical ports are emulated: capture ports are fed from a
+// generator or a file, playback ports mix client ports connected to them.
+class OfflineBackend: public Backend {
+    enum class Source {
+        SILENCE,
+        NOISE,
+        SINE,
+        LOOPBACK,
+        FILE
+    };
+
+    struct ClientPort {
+        string name;
+        PortDirection direction;
+        vector<Sample> buffer;
+        // Indices of physical ports connected to this one
+        vector<size_t> connections;
+    };
+
+    string name_;
+    OfflineConfig config_;
+    Source source_ = Source::SILENCE;
+    double sine_frequency_ = 0;
+    std::minstd_rand noise_;
+    std::unique_ptr<SNDFILE, decltype(&sf_close)> sf_;
+    // Scratch for interleaved frames read from capture file and kernels to demultiplex them
+    std::unique_ptr<Sample[]> file_buff_;
+    Kernels kernels_ = {};
+    vector<string> capture_names_;
+    vector<string> playback_names_;
+    // Samples of physical ports for the current period
+    vector<vector<Sample>> capture_;
+    vector<vector<Sample>> playback_;
+    vector<Sample*> capture_buffers_;
+    vector<std::unique_ptr<ClientPort>> ports_;
+    ProcessCallback process_callback_ = nullptr;
+    void* process_arg_ = nullptr;
+    ShutdownCallback shutdown_callback_ = nullptr;
+    void* shutdown_arg_ = nullptr;
+    // Number of frames processed so far
+    size_t frame_time_ = 0;
+    // Protects ports and their connections while they're mixed
+    std::mutex mutex_;
+    std::unique_ptr<std::thread> thread_;
+    std::atomic<bool> running_{false};
+
+    ClientPort* find_port(const string& name) const;
+    // Resolves connection of a physical port with ours, false if it's not supported
+    bool find_connection(const string& source, const string& destination, ClientPort*& port, size_t& index) const;
+    // Fills physical capture ports, returns false if capture file has ended
+    bool generate();
+    void cycle();
+    void run();
+
+public:
+    explicit OfflineBackend(const string& name, const OfflineConfig& config);
+    ~OfflineBackend() override;
+
+    const char* name() const override { return name_.c_str(); }
+    size_t sample_rate() const override { return config_.sample_rate; }
+    size_t period_size() const override { return config_.period_size; }
+    bool realtime() const noexcept override { return false; }
+    // We're always freewheeling
+    int set_freewheel(bool) override { return 0; }
+
+    vector<string> capture_ports() const override { return capture_names_; }
+    vector<string> playback_ports() const override { return playback_names_; }
+
+    Port* register_port(const string& short_name, PortDirection direction) override;
+    void unregister_port(Port* port) override;
+    int connect(const string& source, const string& destination) override;
+    int disconnect(const string& source, const string& destination) override;
+    Sample* port_buffer(Port* port, size_t frame_count) noexcept override;
+    std::uint32_t frame_time() const noexcept override { return static_cast<std::uint32_t>(frame_time_); }
+
+    void set_process_callback(ProcessCallback callback, void* arg) override;
+    void set_shutdown_callback(ShutdownCallback callback, void* arg) override;
+    void activate() override;
+    void deactivate() override;
+};
+
+}
@@ -0,0 +1,489 @@
+// Python extension module _arrow1, used by arrow1.py when built with ENABLE_PYTHON. Plays from
+// and records to memory of objects supporting buffer protocol, e.g. float32 NumPy arrays,
+// without copying them or going through files.
+
+// Python.h must come first
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "types.hpp"
+#include "backend.hpp"
+#include "jack_client.hpp"
+#include "offline.hpp"
+#include "io.hpp"
+#include "reactor.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+
+namespace olo {
+using std::runtime_error;
+using std::unique_ptr;
+using boost::format;
+
+namespace {
+// How often Python signal handlers get a chance to run while the engine is busy
+const std::chrono::milliseconds CHECK_SIGNALS_INTERVAL{50};
+
+// Releases buffer obtained with PyObject_GetBuffer() on scope exit
+class Buffer {
+    Py_buffer view_;
+    bool valid_ = false;
+
+public:
+    Buffer() { std::memset(&view_, 0, sizeof(view_)); }
+    ~Buffer() {
+        if (valid_) {
+            PyBuffer_Release(&view_);
+        }
+    }
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    // Gets samples of `obj` as frames by channels, returns false with Python error set if
+    // it's not a C-contiguous float32 array of 1 or 2 dimensions
+    bool get(PyObject* obj, bool writable, const char* what) {
+        int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT | (writable ? PyBUF_WRITABLE : 0);
+        if (PyObject_GetBuffer(obj, &view_, flags) != 0) {
+            return false;
+        }
+        valid_ = true;
+        if (view_.itemsize != sizeof(Sample) || view_.format == nullptr || std::strcmp(view_.format, "f") != 0) {
+            PyErr_Format(PyExc_TypeError, "%s must hold float32 samples", what);
+            return false;
+        }
+        if (view_.ndim != 1 && view_.ndim != 2) {
+            PyErr_Format(PyExc_ValueError, "%s must be of shape (frames,) or (frames, channels)", what);
+            return false;
+        }
+        if (frames() == 0 || channels() == 0) {
+            PyErr_Format(PyExc_ValueError, "%s is empty", what);
+            return false;
+        }
+        return true;
+    }
+
+    Sample* data() const { return static_cast<Sample*>(view_.buf); }
+    size_t frames() const { return view_.shape[0]; }
+    size_t channels() const { return view_.ndim == 2 ? view_.shape[1] : 1; }
+};
+
+// Ports, ringbuffers and IO threads kept between runs
+class Engine {
+    unique_ptr<Backend> backend_;
+    unique_ptr<Reactor> reactor_;
+    unique_ptr<Reader> reader_;
+    unique_ptr<Writer> writer_;
+    size_t buffer_size_;
+    Transport transport_;
+
+public:
+    Engine(
+        unique_ptr<Backend> backend,
+        size_t input_count,
+        size_t output_count,
+        size_t buffer_size,
+        Transport transport,
+        bool freewheel
+    ):
+        backend_{std::move(backend)},
+        buffer_size_{buffer_size},
+        transport_{transport}
+    {
+        // Python handles signals itself, we check for them while waiting
+        reactor_.reset(new Reactor{*backend_, input_count, output_count, freewheel, false});
+    }
+
+    ~Engine() noexcept(false) {
+        // IO threads must be done before Reactor goes away
+        if (reader_) {
+            reader_->stop();
+        }
+        if (writer_) {
+            writer_->stop();
+        }
+    }
+
+    Backend& backend() const { return *backend_; }
+
+    void start(
+        const vector<string>& input_ports,
+        const vector<string>& output_ports,
+        const Buffer* play,
+        Buffer* rec
+    ) {
+        if (play == nullptr) {
+            reader_.reset();
+        } else if (reader_ && reader_->channel_count() == play->channels()) {
+            reader_->open(play->data(), play->frames());
+        } else {
+            reader_.reset();
+            reader_.reset(new Reader{play->data(), play->frames(), backend_->sample_rate(),
+                play->channels(), buffer_size_, 0., 0., transport_});
+        }
+        if (rec == nullptr) {
+            writer_.reset();
+        } else if (writer_ && writer_->channel_count() == rec->channels()) {
+            writer_->open(rec->data(), rec->frames());
+        } else {
+            writer_.reset();
+            writer_.reset(new Writer{rec->data(), rec->frames(), backend_->sample_rate(),
+                rec->channels(), buffer_size_, transport_});
+        }
+        reactor_->start(input_ports, output_ports, reader_.get(), writer_.get());
+    }
+
+    bool wait(std::chrono::milliseconds timeout) { return reactor_->wait_finished(timeout); }
+    void cancel() { reactor_->cancel(); }
+
+    // Lets go of the arrays of the last run, which Python may free once play_rec() returns
+    void release() {
+        if (writer_) {
+            writer_->close();
+        }
+        if (reader_) {
+            reader_->close();
+        }
+    }
+
+    // Returns frames read and written by the finished run
+    std::pair<size_t, size_t> finish() {
+        release();
+        if (reactor_->stopped()) {
+            throw runtime_error{"engine has stopped"};
+        }
+        return {reader_ ? reader_->frames_done() : 0, writer_ ? writer_->frames_done() : 0};
+    }
+};
+
+struct EngineObject {
+    PyObject_HEAD
+    Engine* engine;
+    // Set while play_rec() runs without holding the GIL
+    std::atomic<bool> busy;
+};
+
+// Converts exception being handled to Python one
+void set_error() {
+    try {
+        throw;
+    } catch (std::exception& ex) {
+        PyErr_SetString(PyExc_RuntimeError, ex.what());
+    } catch (...) {
+        PyErr_SetString(PyExc_RuntimeError, "unknown error");
+    }
+}
+
+// Returns false with Python error set if `obj` isn't a sequence of strings
+bool get_names(PyObject* obj, vector<string>& names) {
+    PyObject* seq = PySequence_Fast(obj, "port names must be a sequence of strings");
+    if (seq == nullptr) {
+        return false;
+    }
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    for (Py_ssize_t i = 0; i != n; ++i) {
+        const char* name = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+        if (name == nullptr) {
+            Py_DECREF(seq);
+            return false;
+        }
+        names.emplace_back(name);
+    }
+    Py_DECREF(seq);
+    return true;
+}
+
+PyObject* to_list(const vector<string>& names) {
+    PyObject* list = PyList_New(names.size());
+    if (list == nullptr) {
+        return nullptr;
+    }
+    for (size_t i = 0; i != names.size(); ++i) {
+        PyObject* item = PyUnicode_FromString(names[i].c_str());
+        if (item == nullptr) {
+            Py_DECREF(list);
+            return nullptr;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+int engine_init(EngineObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"inputs", "outputs", "buffer_size", "planar", "freewheel",
+        "offline", "offline_rate", "offline_period", "offline_channels", "offline_capture", nullptr};
+    PyObject* inputs = Py_None;
+    PyObject* outputs = Py_None;
+    Py_ssize_t buffer_size = BUFFER_SIZE_DEFAULT;
+    int planar = 0;
+    int freewheel = 0;
+    int offline = 0;
+    OfflineConfig config;
+    Py_ssize_t offline_rate = config.sample_rate;
+    Py_ssize_t offline_period = config.period_size;
+    Py_ssize_t offline_channels = config.channels;
+    const char* offline_capture = config.capture.c_str();
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOnpppnnns", const_cast<char**>(keywords),
+            &inputs, &outputs, &buffer_size, &planar, &freewheel,
+            &offline, &offline_rate, &offline_period, &offline_channels, &offline_capture)) {
+        return -1;
+    }
+    const size_t input_count = inputs != Py_None ? PyLong_AsSize_t(inputs) : 0;
+    const size_t output_count = outputs != Py_None ? PyLong_AsSize_t(outputs) : 0;
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+    if (buffer_size <= 0 || offline_rate <= 0 || offline_period <= 0 || offline_channels < 0) {
+        PyErr_SetString(PyExc_ValueError, "sizes must be positive");
+        return -1;
+    }
+    if (self->engine != nullptr) {
+        PyErr_SetString(PyExc_RuntimeError, "engine is already initialized");
+        return -1;
+    }
+    try {
+        unique_ptr<Backend> backend;
+        if (offline) {
+            config.sample_rate = offline_rate;
+            config.period_size = offline_period;
+            config.channels = offline_channels;
+            config.capture = offline_capture;
+            backend.reset(new OfflineBackend{JACK_CLIENT_NAME, config});
+        } else {
+            backend.reset(new JackClient{JACK_CLIENT_NAME});
+        }
+        // All physical ports by default
+        const size_t input_total = inputs != Py_None ? input_count : backend->capture_ports().size();
+        const size_t output_total = outputs != Py_None ? output_count : backend->playback_ports().size();
+        self->engine = new Engine{std::move(backend), input_total, output_total, static_cast<size_t>(buffer_size),
+            planar ? Transport::PLANAR : Transport::INTERLEAVED, freewheel != 0};
+    } catch (...) {
+        set_error();
+        return -1;
+    }
+    return 0;
+}
+
+void engine_dealloc(EngineObject* self) {
+    try {
+        delete self->engine;
+    } catch (std::exception& ex) {
+        lerror("_arrow1.Engine: %s\n", ex.what());
+    }
+    self->busy.~atomic();
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+PyObject* engine_new(PyTypeObject* type, PyObject*, PyObject*) {
+    auto self = reinterpret_cast<EngineObject*>(type->tp_alloc(type, 0));
+    if (self != nullptr) {
+        self->engine = nullptr;
+        new (&self->busy) std::atomic<bool>{false};
+    }
+    return reinterpret_cast<PyObject*>(self);
+}
+
+Engine* get_engine(EngineObject* self) {
+    if (self->engine == nullptr) {
+        PyErr_SetString(PyExc_RuntimeError, "engine is not initialized");
+    }
+    return self->engine;
+}
+
+PyObject* engine_play_rec(EngineObject* self, PyObject* args, PyObject* kwargs) {
+    static const char* keywords[] = {"play", "rec", "input_ports", "output_ports", nullptr};
+    PyObject* play_obj = Py_None;
+    PyObject* rec_obj = Py_None;
+    PyObject* input_obj = Py_None;
+    PyObject* output_obj = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOO", const_cast<char**>(keywords),
+            &play_obj, &rec_obj, &input_obj, &output_obj)) {
+        return nullptr;
+    }
+    Engine* engine = get_engine(self);
+    if (engine == nullptr) {
+        return nullptr;
+    }
+    Buffer play;
+    Buffer rec;
+    if (play_obj != Py_None && !play.get(play_obj, false, "play")) {
+        return nullptr;
+    }
+    if (rec_obj != Py_None && !rec.get(rec_obj, true, "rec")) {
+        return nullptr;
+    }
+    if (play_obj == Py_None && rec_obj == Py_None) {
+        PyErr_SetString(PyExc_ValueError, "nothing to play or record");
+        return nullptr;
+    }
+    // Ports default to the first physical ones
+    vector<string> input_ports;
+    vector<string> output_ports;
+    if (input_obj != Py_None) {
+        if (!get_names(input_obj, input_ports)) {
+            return nullptr;
+        }
+    } else if (rec_obj != Py_None) {
+        input_ports = engine->backend().capture_ports();
+        input_ports.resize(std::min(input_ports.size(), rec.channels()));
+    }
+    if (output_obj != Py_None) {
+        if (!get_names(output_obj, output_ports)) {
+            return nullptr;
+        }
+    } else if (play_obj != Py_None) {
+        output_ports = engine->backend().playback_ports();
+        output_ports.resize(std::min(output_ports.size(), play.channels()));
+    }
+    if (rec_obj != Py_None && input_ports.size() != rec.channels()) {
+        PyErr_Format(PyExc_ValueError, "rec has %zd channels, but %zd input ports are given",
+            rec.channels(), input_ports.size());
+        return nullptr;
+    }
+    if (play_obj != Py_None && output_ports.size() != play.channels()) {
+        PyErr_Format(PyExc_ValueError, "play has %zd channels, but %zd output ports are given",
+            play.channels(), output_ports.size());
+        return nullptr;
+    }
+    if (self->busy.exchange(true)) {
+        PyErr_SetString(PyExc_RuntimeError, "engine is busy");
+        return nullptr;
+    }
+
+    // Engine runs without the GIL, so that other Python threads may do their work meanwhile
+    PyThreadState* state = PyEval_SaveThread();
+    bool interrupted = false;
+    std::pair<size_t, size_t> frames;
+    try {
+        engine->start(input_ports, output_ports,
+            play_obj != Py_None ? &play : nullptr,
+            rec_obj != Py_None ? &rec : nullptr);
+        while (!engine->wait(CHECK_SIGNALS_INTERVAL)) {
+            if (!interrupted) {
+                PyEval_RestoreThread(state);
+                interrupted = PyErr_CheckSignals() != 0;
+                state = PyEval_SaveThread();
+                if (interrupted) {
+                    // Python error is set, raised once the run has ended
+                    engine->cancel();
+                }
+            }
+        }
+        frames = engine->finish();
+    } catch (...) {
+        try {
+            engine->release();
+        } catch (...) {
+            // The error which ended the run is the one to report
+        }
+        PyEval_RestoreThread(state);
+        self->busy = false;
+        if (!interrupted) {
+            set_error();
+        }
+        return nullptr;
+    }
+    PyEval_RestoreThread(state);
+    self->busy = false;
+    if (interrupted) {
+        return nullptr;
+    }
+    return Py_BuildValue("(nn)", static_cast<Py_ssize_t>(frames.first), static_cast<Py_ssize_t>(frames.second));
+}
+
+PyObject* engine_capture_ports(EngineObject* self, PyObject*) {
+    Engine* engine = get_engine(self);
+    return engine != nullptr ? to_list(engine->backend().capture_ports()) : nullptr;
+}
+
+PyObject* engine_playback_ports(EngineObject* self, PyObject*) {
+    Engine* engine = get_engine(self);
+    return engine != nullptr ? to_list(engine->backend().playback_ports()) : nullptr;
+}
+
+PyObject* engine_sample_rate(EngineObject* self, void*) {
+    Engine* engine = get_engine(self);
+    return engine != nullptr ? PyLong_FromSize_t(engine->backend().sample_rate()) : nullptr;
+}
+
+PyObject* set_debug(PyObject*, PyObject* arg) {
+    int on = PyObject_IsTrue(arg);
+    if (on < 0) {
+        return nullptr;
+    }
+    set_loglevel(on ? LDEBUG : LINFO);
+    Py_RETURN_NONE;
+}
+
+PyMethodDef engine_methods[] = {
+    {"play_rec", reinterpret_cast<PyCFunction>(reinterpret_cast<void(*)()>(engine_play_rec)), METH_VARARGS | METH_KEYWORDS,
+        "play_rec(play=None, rec=None, input_ports=None, output_ports=None)\n--\n\n"
+        "Plays float32 array `play` of shape (frames,) or (frames, channels) and records into\n"
+        "float32 array `rec` until both are done. Ports default to the first physical ones.\n"
+        "Returns tuple of frames played and recorded."},
+    {"capture_ports", reinterpret_cast<PyCFunction>(engine_capture_ports), METH_NOARGS,
+        "Names of physical capture ports"},
+    {"playback_ports", reinterpret_cast<PyCFunction>(engine_playback_ports), METH_NOARGS,
+        "Names of physical playback ports"},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+PyGetSetDef engine_getset[] = {
+    {const_cast<char*>("sample_rate"), reinterpret_cast<getter>(engine_sample_rate), nullptr,
+        const_cast<char*>("Sample rate of the engine"), nullptr},
+    {nullptr, nullptr, nullptr, nullptr, nullptr}
+};
+
+PyTypeObject engine_type = {PyVarObject_HEAD_INIT(nullptr, 0)};
+
+PyMethodDef module_methods[] = {
+    {"set_debug", set_debug, METH_O, "Enables debugging output"},
+    {nullptr, nullptr, 0, nullptr}
+};
+
+PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    "_arrow1",
+    "Play and record multi-channel audio using Jack",
+    -1,
+    module_methods
+};
+}
+}
+
+PyMODINIT_FUNC PyInit__arrow1() {
+    using namespace olo;
+    engine_type.tp_name = "_arrow1.Engine";
+    engine_type.tp_basicsize = sizeof(EngineObject);
+    engine_type.tp_flags = Py_TPFLAGS_DEFAULT;
+    engine_type.tp_doc = "Engine(inputs=None, outputs=None, buffer_size=8192, planar=False, freewheel=False,\n"
+        "       offline=False, offline_rate=48000, offline_period=1024, offline_channels=2,\n"
+        "       offline_capture='silence')\n\n"
+        "Jack client with `inputs` capture and `outputs` playback ports, all physical ones by\n"
+        "default, kept registered between runs. Options mean the same as arrow1 command line ones.";
+    engine_type.tp_new = engine_new;
+    engine_type.tp_init = reinterpret_cast<initproc>(engine_init);
+    engine_type.tp_dealloc = reinterpret_cast<destructor>(engine_dealloc);
+    engine_type.tp_methods = engine_methods;
+    engine_type.tp_getset = engine_getset;
+    if (PyType_Ready(&engine_type) < 0) {
+        return nullptr;
+    }
+    PyObject* module = PyModule_Create(&module_def);
+    if (module == nullptr) {
+        return nullptr;
+    }
+    Py_INCREF(&engine_type);
+    if (PyModule_AddObject(module, "Engine", reinterpret_cast<PyObject*>(&engine_type)) < 0) {
+        Py_DECREF(&engine_type);
+        Py_DECREF(module);
+        return nullptr;
+    }
+    return module;
+}
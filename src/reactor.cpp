@@ -1,9 +1,10 @@
 #include "reactor.hpp"
-#include "jack_client.hpp"
+#include "backend.hpp"
 #include "io.hpp"
+#include "kernels.hpp"
 #include "log.hpp"
 
-#include <jack/jack.h>
+#include <jack/ringbuffer.h>
 
 #include <boost/format.hpp>
 
@@ -12,6 +13,8 @@
 #include <chrono>
 #include <cstring>
 #include <csignal>
+#include <cassert>
+#include <thread>
 
 namespace olo {
 using std::unique_ptr;
@@ -21,23 +24,49 @@ using boost::format;
 
 namespace {
 struct PortDeleter {
-    JackClient& client;
-    void operator()(jack_port_t* port) const {
-        jack_port_unregister(client.handle(), port);
+    Backend& backend;
+    void operator()(Port* port) const {
+        backend.unregister_port(port);
     }
 };
 
-auto create_port(JackClient& client, const string& name, int flags) {
-    unique_ptr<jack_port_t, PortDeleter> port {
-        jack_port_register(client.handle(), name.c_str(), JACK_DEFAULT_AUDIO_TYPE, flags, 0),
-        PortDeleter{client}
+auto create_port(Backend& backend, const string& name, PortDirection direction) {
+    return unique_ptr<Port, PortDeleter> {
+        backend.register_port(name, direction),
+        PortDeleter{backend}
     };
-    if (!port) {
-        throw runtime_error{str(format("failed creating port %1%") % name)};
+}
+
+// Moves connection of our port `ours` from engine port `current` to `wanted`, empty means none
+void reconnect(Backend& backend, const string& ours, bool ours_is_source, string& current, const string& wanted) {
+    if (current == wanted) {
+        return;
+    }
+    if (!current.empty()) {
+        if (ours_is_source) {
+            backend.disconnect(ours, current);
+        } else {
+            backend.disconnect(current, ours);
+        }
+        current.clear();
     }
-    return port;
+    if (wanted.empty()) {
+        return;
+    }
+    const string& source = ours_is_source ? ours : wanted;
+    const string& destination = ours_is_source ? wanted : ours;
+    int err = backend.connect(source, destination);
+    if (0 != err) {
+        throw runtime_error{str(format("failed connecting port %1% to %2% with error %3%")
+            % source % destination % err)};
+    }
+    current = wanted;
 }
 
+const std::chrono::milliseconds RT_LOG_DRAIN_INTERVAL{50};
+// Position of events which happened outside of a run
+const size_t NO_FRAME = SIZE_MAX;
+
 Reactor* instance = nullptr;
 const int SIGNALS_INTERCEPT[] = {
     SIGINT,
@@ -51,303 +80,609 @@ const int SIGNALS_INTERCEPT[] = {
 };
 }
 
-void Reactor::register_ports(const vector<string>& input_ports, const vector<string>& output_ports) {
-    if (writer_ != nullptr) {
-        inputs_.reserve(input_ports.size());
-        input_names_.reserve(input_ports.size());
-        for (size_t i = 0; i != input_ports.size(); ++i) {
-            auto short_name = str(format("input_%1%") % i);
-            auto port = create_port(client_, short_name, JackPortIsInput);
-            input_names_.push_back(string{client_.name()} + ":" + short_name);
-            inputs_.push_back(port.release());
-        }
-        input_buffers_.resize(input_ports.size());
+void Reactor::register_ports(size_t input_count, size_t output_count) {
+    inputs_.reserve(input_count);
+    input_names_.reserve(input_count);
+    for (size_t i = 0; i != input_count; ++i) {
+        auto short_name = str(format("input_%1%") % i);
+        auto port = create_port(backend_, short_name, PortDirection::INPUT);
+        input_names_.push_back(string{backend_.name()} + ":" + short_name);
+        inputs_.push_back(port.release());
     }
-    if (reader_ != nullptr) {
-        outputs_.reserve(output_ports.size());
-        output_names_.reserve(output_ports.size());
-        for (size_t i = 0; i != output_ports.size(); ++i) {
-            auto short_name = str(format("output_%1%") % i);
-            output_names_.push_back(string{client_.name()} + ":" + short_name);
-            if (NULL_OUTPUT != output_ports[i]) {
-                auto port = create_port(client_, short_name, JackPortIsOutput);
-                outputs_.push_back(port.release());
-            } else {
-                outputs_.push_back(nullptr);
-            }
-        }
-        output_buffers_.resize(output_ports.size());
+    input_buffers_.resize(input_count);
+    input_connections_.resize(input_count);
+    outputs_.reserve(output_count);
+    output_names_.reserve(output_count);
+    for (size_t i = 0; i != output_count; ++i) {
+        auto short_name = str(format("output_%1%") % i);
+        auto port = create_port(backend_, short_name, PortDirection::OUTPUT);
+        output_names_.push_back(string{backend_.name()} + ":" + short_name);
+        outputs_.push_back(port.release());
     }
+    output_buffers_.resize(output_count);
+    output_connections_.resize(output_count);
 }
 
 void Reactor::connect_ports(const vector<string>& input_ports, const vector<string>& output_ports) {
-    if (writer_ != nullptr) {
-        for (size_t i = 0; i != input_ports.size(); ++i) {
-            int err = jack_connect(client_.handle(), input_ports[i].c_str(), input_names_[i].c_str());
-            if (0 != err) {
-                throw runtime_error{str(format("failed connecting port %1% to %2% with Jack error %3%")
-                    % input_ports[i] % input_names_[i] % err)};
-            }
-        }
+    // Only connections differing from the previous run are changed
+    for (size_t i = 0; i != inputs_.size(); ++i) {
+        const string wanted = writer_ != nullptr && i < input_ports.size() ? input_ports[i] : string{};
+        reconnect(backend_, input_names_[i], false, input_connections_[i], wanted);
     }
-    if (reader_ != nullptr) {
-        for (size_t i = 0; i != output_ports.size(); ++i) {
-            if (!outputs_[i]) {
-                // This is NULL_OUTPUT, leave disconnected
-                continue;
-            }
-            int err = jack_connect(client_.handle(), output_names_[i].c_str(), output_ports[i].c_str());
-            if (0 != err) {
-                throw runtime_error{str(format("failed connecting port %1% to %2% with Jack error %3%")
-                    % output_names_[i] % output_ports[i] % err)};
-            }
-        }
+    for (size_t i = 0; i != outputs_.size(); ++i) {
+        // NULL_OUTPUT is left disconnected
+        const string wanted = reader_ != nullptr && i < output_ports.size() && NULL_OUTPUT != output_ports[i]
+            ? output_ports[i] : string{};
+        reconnect(backend_, output_names_[i], true, output_connections_[i], wanted);
     }
 }
 
 void Reactor::activate() {
     assert(!activated_);
-    int err;
-    if (0 != (err = jack_activate(client_.handle()))) {
-        throw runtime_error{str(format("failed activating Jack client with error %1%") % err)};
-    } else {
-        ldebug("Reactor::activate(): Jack client activated\n");
-        activated_ = true;
-    }
+    backend_.activate();
+    activated_ = true;
 }
 
 void Reactor::deactivate() {
+    // Engine not paced by wall clock may be waiting for the next run
+    release();
+    if (freewheel_) {
+        int err = backend_.set_freewheel(false);
+        if (0 != err) {
+            lerror("Reactor::deactivate(): failed leaving freewheel mode with error %d\n", err);
+        }
+        freewheel_ = false;
+    }
     if (activated_) {
-        jack_deactivate(client_.handle());
-        ldebug("Reactor::deactivate(): Jack client deactivated\n");
+        backend_.deactivate();
         activated_ = false;
     }
 }
 
 Reactor::Reactor(
-    JackClient& client,
-    const vector<string>& input_ports,
-    const vector<string>& output_ports,
-    Reader* reader,
-    Writer* writer,
-    bool duration_infinite
+    Backend& backend,
+    size_t input_count,
+    size_t output_count,
+    bool freewheel,
+    bool intercept_signals
 ):
-    client_{client},
-    reader_{reader},
-    writer_{writer},
-    needed_{
-        duration_infinite
-            ? 0
-            : std::max(
-                reader ? reader->frames_needed() : 0,
-                writer ? writer->frames_needed() : 0
-            )
-    }
+    backend_{backend}
 {
-    if (needed_ != 0) {
-        ldebug("Reactor::Reactor(): processing at most %zd frames\n", needed_);
-    } else {
-        ldebug("Reactor::Reactor(): processing until explicitly terminated\n");
-    }
     if (instance != nullptr) {
         throw runtime_error{"reactor instance is already present"};
     } else {
         instance = this;
     }
-    register_ports(input_ports, output_ports);
-    int err;
-    if (0 != (err = jack_set_process_callback(client_.handle(), process_, this)))  {
-        throw runtime_error{str(format("failed setting Jack process callback with error %1%") % err)};
-    }
-    jack_on_shutdown(client_.handle(), shutdown_, this);
-    for (int sig: SIGNALS_INTERCEPT) {
-        signal(sig, signal_handler_);
-    }
-    activate();
     try {
-        connect_ports(input_ports, output_ports);
+        trace_ = trace_buffer("jack");
+        register_ports(input_count, output_count);
+        backend_.set_process_callback(process_, this);
+        backend_.set_shutdown_callback(shutdown_, this);
+        backend_.set_event_callback(event_, this);
+        backend_.set_buffer_size_callback(buffer_size_, this);
+        if (intercept_signals) {
+            for (int sig: SIGNALS_INTERCEPT) {
+                signal(sig, signal_handler_);
+            }
+            signals_ = true;
+        }
+        activate();
+        if (freewheel) {
+            int err = backend_.set_freewheel(true);
+            if (0 != err) {
+                lerror("Reactor::Reactor(): failed entering freewheel mode, deactivating\n");
+                throw runtime_error{str(format("failed entering freewheel mode with error %1%") % err)};
+            }
+            freewheel_ = true;
+            ldebug("Reactor::Reactor(): freewheel mode requested\n");
+        }
     } catch (...) {
-        lerror("Reactor::Reactor(): exception while connecting ports, rethrowing after deactivate\n");
-        deactivate();
+        detach();
         throw;
     }
 }
 
 Reactor::~Reactor() {
+    detach();
+}
+
+void Reactor::detach() noexcept {
+    // Engine outlives us, and unregistering ports below is itself reported as an event
+    backend_.set_event_callback(nullptr, nullptr);
+    backend_.set_buffer_size_callback(nullptr, nullptr);
     deactivate();
     // Restore original signal handlers
-    for (int sig: SIGNALS_INTERCEPT) {
-        signal(sig, SIG_DFL);
+    if (signals_) {
+        for (int sig: SIGNALS_INTERCEPT) {
+            signal(sig, SIG_DFL);
+        }
+        signals_ = false;
     }
     for (auto& port: inputs_) {
-        jack_port_disconnect(client_.handle(), port);
-        jack_port_unregister(client_.handle(), port);
+        backend_.unregister_port(port);
     }
+    inputs_.clear();
     for (auto& port: outputs_) {
-        if (!port) {
-            continue;
-        }
-        jack_port_disconnect(client_.handle(), port);
-        jack_port_unregister(client_.handle(), port);
+        backend_.unregister_port(port);
     }
+    outputs_.clear();
     if (instance == this) {
         instance = nullptr;
     }
 }
 
-void Reactor::signal_finished() {
-    if (!finished_fired_) {
-        finished_fired_ = true;
-        finished_.set_value();
+void Reactor::start(
+    const vector<string>& input_ports,
+    const vector<string>& output_ports,
+    Reader* reader,
+    Writer* writer,
+    bool duration_infinite,
+    size_t gap_frames
+) {
+    // Jack thread doesn't touch anything below until running_ is published
+    assert(!running_);
+    if (reader != nullptr && reader->channel_count() > outputs_.size()) {
+        throw runtime_error{str(format("playback of %1% channels, but only %2% output ports are registered")
+            % reader->channel_count() % outputs_.size())};
+    }
+    if (writer != nullptr && writer->channel_count() > inputs_.size()) {
+        throw runtime_error{str(format("recording of %1% channels, but only %2% input ports are registered")
+            % writer->channel_count() % inputs_.size())};
+    }
+    reader_ = reader;
+    writer_ = writer;
+    needed_ = duration_infinite
+        ? 0
+        : std::max(
+            reader ? reader->frames_needed() : 0,
+            writer ? writer->frames_needed() : 0
+        );
+    if (needed_ != 0) {
+        ldebug("Reactor::start(): processing at most %zd frames\n", needed_);
+    } else {
+        ldebug("Reactor::start(): processing until explicitly terminated\n");
+    }
+    if (reader_ != nullptr && !reader_->planar()) {
+        playback_kernels_ = select_kernels(reader_->channel_count());
+        ldebug("Reactor::start(): using %s playback kernels for %zd channels\n",
+            playback_kernels_.isa, playback_kernels_.channels);
+    }
+    if (writer_ != nullptr && !writer_->planar()) {
+        capture_kernels_ = select_kernels(writer_->channel_count());
+        ldebug("Reactor::start(): using %s capture kernels for %zd channels\n",
+            capture_kernels_.isa, capture_kernels_.channels);
+    }
+    connect_ports(input_ports, output_ports);
+    // Period size may have changed since ringbuffers were last fitted to it
+    std::lock_guard<std::mutex> lock{resize_mutex_};
+    const size_t period_size = backend_.period_size();
+    if (reader_ != nullptr) {
+        reader_->fit_period(period_size);
+        stats_.playback_buffer = reader_->buffer_size();
+    }
+    if (writer_ != nullptr) {
+        writer_->fit_period(period_size);
+        stats_.capture_buffer = writer_->buffer_size();
+    }
+    // Whatever is still queued happened before this run
+    collect_events();
+    events_.clear();
+    done_ = 0;
+    underruns_ = 0;
+    overruns_ = 0;
+    gap_ = gap_frames;
+    started_ = false;
+    cancel_ = false;
+    finished_fired_ = false;
+    if (stopping_) {
+        // Stopped meanwhile, don't even start
+        signal_finished();
+        return;
+    }
+    running_.store(true, std::memory_order_release);
+    armed_.post();
+}
+
+void Reactor::signal_finished() noexcept {
+    if (!finished_fired_.exchange(true)) {
+        finished_.post();
+    }
+}
+
+void Reactor::finish(size_t end) noexcept {
+    end_at_ = end;
+    ended_ = true;
+    running_.store(false, std::memory_order_release);
+    signal_finished();
+}
+
+void Reactor::stop() noexcept {
+    stopping_ = true;
+    signal_finished();
+}
+
+void Reactor::release() noexcept {
+    if (!released_.exchange(true)) {
+        armed_.post();
+    }
+}
+
+void Reactor::fail(RtError error, size_t arg) noexcept {
+    // Only Jack thread records errors, so no need for compare-exchange
+    if (error_.load(std::memory_order_relaxed) == RtError::NONE) {
+        error_arg_ = arg;
+        error_.store(error, std::memory_order_release);
+    }
+    stop();
+}
+
+void Reactor::rethrow_error() const {
+    switch (error_.load(std::memory_order_acquire)) {
+    case RtError::NONE:
+        return;
+    case RtError::PLAYBACK_BUFFER:
+        throw runtime_error{str(format("unable to obtain playback buffer for port %1%")
+            % output_names_[error_arg_])};
+    case RtError::CAPTURE_BUFFER:
+        throw runtime_error{str(format("unable to obtain capture buffer for port %1%")
+            % input_names_[error_arg_])};
     }
 }
 
 void Reactor::wait_finished() {
-    finished_.get_future().wait();
-    deactivate();
+    // Jack thread can't print, so meanwhile format whatever it has logged
+    while (!wait_finished(RT_LOG_DRAIN_INTERVAL)) {
+    }
+}
+
+bool Reactor::wait_finished(std::chrono::milliseconds timeout) {
+    if (!finished_.wait_for(timeout)) {
+        rt_log_drain();
+        collect_events();
+        return false;
+    }
+    if (stopping_) {
+        // Run may still be in progress
+        deactivate();
+    }
+    {
+        // Resizing which started before the run ended may still be using its ringbuffers,
+        // which the caller is free to close once we return
+        std::lock_guard<std::mutex> lock{resize_mutex_};
+    }
+    rt_log_drain();
+    collect_events();
     ldebug("Reactor::wait_finished(): done processing %zd frames\n    overruns: %zd\n    underruns: %zd\n", done_, overruns_, underruns_);
+    rethrow_error();
+    return true;
 }
 
-void Reactor::playback(size_t frame_count) {
+bool Reactor::mute_outputs(size_t frame_count, size_t first) noexcept {
+    for (size_t c = first; c < outputs_.size(); ++c) {
+        Sample* buff = backend_.port_buffer(outputs_[c], frame_count);
+        if (buff == nullptr) {
+            fail(RtError::PLAYBACK_BUFFER, c);
+            return false;
+        }
+        std::memset(buff, 0, sizeof(Sample) * frame_count);
+    }
+    return true;
+}
+
+bool Reactor::playback(size_t frame_count, size_t offset) noexcept {
     assert(reader_ != nullptr);
     const auto channels = reader_->channel_count();
-    size_t n, c;
-    // Update buffer pointers
+    // Update buffer pointers, silencing the part of period preceding the start of run
     for (size_t c = 0; c != channels; ++c) {
-        if (!outputs_[c]) {
-            continue;
+        Sample* buff = backend_.port_buffer(outputs_[c], frame_count);
+        if (buff == nullptr) {
+            fail(RtError::PLAYBACK_BUFFER, c);
+            return false;
         }
-        output_buffers_[c] = static_cast<Sample*>(jack_port_get_buffer(outputs_[c], frame_count));
-        if (output_buffers_[c] == nullptr) {
-            throw runtime_error{str(format("unable to obtain playback buffer for port %1%")
-                % output_names_[c])};
+        std::memset(buff, 0, sizeof(Sample) * offset);
+        output_buffers_[c] = buff + offset;
+    }
+    frame_count -= offset;
+    if (reader_->preloaded()) {
+        // Whole file is in memory, nothing to wait for or wake up
+        size_t n = reader_->read_preloaded(playback_kernels_, output_buffers_.data(), frame_count);
+        for (size_t c = 0; c != channels; ++c) {
+            std::memset(output_buffers_[c] + n, 0, sizeof(Sample) * (frame_count - n));
         }
+        return true;
     }
-    // Demultiplex samples into port buffers
-    for (n = 0; n != frame_count; ++n) {
-        bool break_outer = false;
-        for (c = 0; c != channels; ++c) {
-            Sample discard;
-            Sample* buff = outputs_[c] ? &output_buffers_[c][n] : &discard;
-            size_t read = jack_ringbuffer_read(
-                reader_->buffer(),
-                reinterpret_cast<char*>(buff),
-                sizeof(Sample)
-            );
-            if (read != sizeof(Sample)) {
-                if (!reader_->finished()) {
-                    lerror("Reactor::playback(): ringbuffer read failed, UNDERRUN\n");
-                    ++underruns_;
-                }
-                break_outer = true;
-                break;
-            }
+    if (blocking_) {
+        // Wait for the reader instead of underrunning, unless its ringbuffer is already full
+        while (reader_->frames_readable() < frame_count && !reader_->finished()
+                && reader_->frames_writable() != 0) {
+            reader_->wait_progress();
         }
-        if (break_outer) {
-            break;
+    }
+    // Consume only complete frames
+    const size_t readable = reader_->frames_readable();
+    stats_.playback_fill.record(readable);
+    trace(trace_, TR_PLAYBACK_FILL, trace_clock_, trace_clock_, readable);
+    size_t n = std::min(frame_count, readable);
+    if (n != frame_count && !reader_->finished()) {
+        rt_lerror(RT_UNDERRUN, backend_.frame_time(), frame_count - n, frame_count);
+        ++underruns_;
+        bump(stats_.underruns);
+    }
+    if (reader_->planar()) {
+        // Reader has already demultiplexed samples, just copy them into port buffers
+        for (size_t c = 0; c != channels; ++c) {
+            jack_ringbuffer_read(reader_->channel_buffer(c),
+                reinterpret_cast<char*>(output_buffers_[c]), n * sizeof(Sample));
         }
+    } else {
+        // Grab the whole readable region at once and demultiplex samples into port buffers
+        jack_ringbuffer_data_t vec[2];
+        jack_ringbuffer_get_read_vector(reader_->buffer(), vec);
+        deinterleave_ring(playback_kernels_, vec, n, channels, output_buffers_.data());
+        jack_ringbuffer_read_advance(reader_->buffer(), n * reader_->frame_size());
     }
-    // Signal reader we're done
+    // Let reader know it may need to refill
     if (!reader_->finished()) {
-        reader_->wake();
+        reader_->notify();
     }
     // Mute the remaining samples in case of underrun or stream end
     if (n != frame_count) {
-        for (c = 0; c != channels; ++c) {
-            if (!outputs_[c]) {
-                continue;
-            }
-            std::memset(&output_buffers_[c][n], 0, sizeof(Sample) * (frame_count - n));
+        for (size_t c = 0; c != channels; ++c) {
+            std::memset(output_buffers_[c] + n, 0, sizeof(Sample) * (frame_count - n));
         }
     }
+    return true;
 }
 
-void Reactor::capture(size_t frame_count) {
+bool Reactor::capture(size_t frame_count, size_t offset) noexcept {
     assert(writer_ != nullptr);
     if (writer_->finished()) {
         // Don't even bother, drop samples into vacuum
-        return;
+        return true;
     }
     const auto channels = writer_->channel_count();
-    size_t n, c;
-    // Update buffer pointers
+    // Update buffer pointers, skipping the part of period preceding the start of run
     for (size_t c = 0; c != channels; ++c) {
-        input_buffers_[c] = static_cast<const Sample*>(jack_port_get_buffer(inputs_[c], frame_count));
-        if (input_buffers_[c] == nullptr) {
-            throw runtime_error{str(format("unable to obtain capture buffer for port %1%")
-                % input_buffers_[c])};
+        const Sample* buff = backend_.port_buffer(inputs_[c], frame_count);
+        if (buff == nullptr) {
+            fail(RtError::CAPTURE_BUFFER, c);
+            return false;
         }
+        input_buffers_[c] = buff + offset;
     }
-    // Multiplex samples into writer's ringbuffer
-    for (n = 0; n != frame_count; ++n) {
-        bool break_outer = false;
-        for (c = 0; c != channels; ++c) {
-            size_t written = jack_ringbuffer_write(
-                writer_->buffer(),
-                reinterpret_cast<const char*>(&input_buffers_[c][n]),
-                sizeof(Sample)
-            );
-            if (written != sizeof(Sample)) {
-                if (!writer_->finished()) {
-                    lerror("Reactor::capture(): ringbuffer write failed, OVERRUN\n");
-                    ++overruns_;
-                }
-                break_outer = true;
-                break;
-            }
+    frame_count -= offset;
+    if (blocking_) {
+        // Wait for the writer instead of overrunning, unless its ringbuffer is already empty
+        while (writer_->frames_writable() < frame_count && !writer_->finished()
+                && writer_->frames_readable() != 0) {
+            writer_->wait_progress();
         }
-        if (break_outer) {
-            break;
+    }
+    // Only whole frames are committed, so an overrun drops trailing frames but never
+    // leaves a partial one behind, which would misalign channels in the recording
+    size_t n = std::min(frame_count, writer_->frames_writable());
+    if (n != frame_count) {
+        rt_lerror(RT_OVERRUN, backend_.frame_time(), frame_count - n, frame_count);
+        ++overruns_;
+        bump(stats_.overruns);
+    }
+    if (writer_->planar()) {
+        // Writer will multiplex samples itself, just copy port buffers
+        for (size_t c = 0; c != channels; ++c) {
+            jack_ringbuffer_write(writer_->channel_buffer(c),
+                reinterpret_cast<const char*>(input_buffers_[c]), n * sizeof(Sample));
+        }
+    } else {
+        // Multiplex samples into writer's ringbuffer
+        jack_ringbuffer_data_t vec[2];
+        jack_ringbuffer_get_write_vector(writer_->buffer(), vec);
+        interleave_ring(capture_kernels_, input_buffers_.data(), n, channels, vec);
+        jack_ringbuffer_write_advance(writer_->buffer(), n * writer_->frame_size());
+    }
+    const size_t fill = writer_->frames_readable();
+    stats_.capture_fill.record(fill);
+    trace(trace_, TR_CAPTURE_FILL, trace_clock_, trace_clock_, fill);
+    // Let writer know it may need to drain
+    writer_->notify();
+    return true;
+}
+
+void Reactor::process(size_t frame_count) noexcept {
+    // Engine may enter or leave freewheel mode at any period
+    blocking_ = !backend_.realtime();
+    if (blocking_) {
+        // Nothing paces the engine, so rather than run ahead wait for the next run to start
+        while (!running_.load(std::memory_order_acquire) && !released_) {
+            armed_.wait();
+        }
+    }
+    const size_t period_start = clock_;
+    clock_ += frame_count;
+    // Announced before looking at resizing_, so that resize_buffers() either waits for this
+    // period or we see it resizing
+    in_cycle_.store(true);
+    const bool running = running_.load(std::memory_order_acquire);
+    // Events which arrived since the previous period are placed at its end, which is where
+    // samples of the run may be discontinuous. They belong to the run once it's under way.
+    stamp_events(running && done_ != 0);
+    if (!running || resizing_.load()) {
+        if (running) {
+            // Run is paused rather than torn, playback and capture stay aligned
+            resize_skips_.fetch_add(1, std::memory_order_relaxed);
         }
+        mute_outputs(frame_count, 0);
+        in_cycle_.store(false, std::memory_order_release);
+        return;
     }
-    // Signal writer we're done
-    if (!writer_->finished()) {
-        writer_->wake();
+    // Monotonic clock is read through vDSO, without entering the kernel
+    const auto begin = std::chrono::steady_clock::now();
+    if (trace_ != nullptr) {
+        trace_clock_ = trace_time(begin);
     }
+    run_cycle(frame_count, period_start);
+    in_cycle_.store(false, std::memory_order_release);
+    const auto end = std::chrono::steady_clock::now();
+    record_cycle(frame_count, end - begin);
+    trace(trace_, TR_CYCLE, trace_clock_, trace_time(end), frame_count);
 }
 
-void Reactor::process(size_t frame_count) {
-    if (reader_) {
-        playback(frame_count);
+void Reactor::run_cycle(size_t frame_count, size_t period_start) noexcept {
+    if (cancel_.exchange(false)) {
+        // Run ends where this period starts
+        rt_ldebug(RT_CANCELLED, backend_.frame_time(), done_);
+        mute_outputs(frame_count, 0);
+        finish(period_start);
+        return;
+    }
+    if (!started_) {
+        // First period of the run, which starts `gap_` frames after the end of previous one
+        start_at_ = (ended_ ? end_at_ : period_start) + gap_;
+        if (start_at_ < period_start) {
+            if (gap_ != 0) {
+                rt_lerror(RT_LATE_START, backend_.frame_time(), period_start - start_at_);
+            }
+            start_at_ = period_start;
+        }
+        started_ = true;
+    }
+    if (start_at_ >= period_start + frame_count) {
+        // Still in the gap
+        mute_outputs(frame_count, 0);
+        return;
+    }
+    const size_t offset = start_at_ > period_start ? start_at_ - period_start : 0;
+
+    if (reader_ && !playback(frame_count, offset)) {
+        return;
+    }
+    // Outputs not used by this run
+    if (!mute_outputs(frame_count, reader_ ? reader_->channel_count() : 0)) {
+        return;
     }
 
-    if (writer_) {
-        capture(frame_count);
+    if (writer_ && !capture(frame_count, offset)) {
+        return;
     }
 
-    done_ += frame_count;
+    done_ += frame_count - offset;
     if (needed_ != 0 && done_ >= needed_) {
-        ldebug("Reactor::process(): signalling done to control thread after %zd frames\n", done_);
-        signal_finished();
+        rt_ldebug(RT_FINISHED, backend_.frame_time(), done_);
+        finish(start_at_ + needed_);
     }
 }
 
-int Reactor::process_(jack_nframes_t frame_count, void* arg) {
+void Reactor::record_cycle(size_t frame_count, std::chrono::steady_clock::duration elapsed) noexcept {
+    const std::uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    stats_.cycle_ns.record(ns);
+    if (blocking_) {
+        // Nothing to be late for
+        return;
+    }
+    const std::uint64_t period_ns = frame_count * UINT64_C(1000000000) / backend_.sample_rate();
+    if (ns <= period_ns) {
+        stats_.margin_ns.record(period_ns - ns);
+    } else {
+        bump(stats_.missed_deadlines);
+    }
+}
+
+void Reactor::stamp_events(bool in_run) noexcept {
+    RunEvent event;
+    while (engine_events_.pop(event)) {
+        event.frame_time = backend_.frame_time();
+        event.frame = in_run ? done_ : NO_FRAME;
+        if (!stamped_events_.push(event)) {
+            events_dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void Reactor::collect_events() {
+    RunEvent event;
+    while (stamped_events_.pop(event)) {
+        const char* name = engine_event_name(event.event);
+        if (event.frame == NO_FRAME) {
+            ldebug("Reactor::collect_events(): engine %s (%zd) before frame time %u, outside of a run\n",
+                name, event.value, event.frame_time);
+            continue;
+        }
+        log(event.event == EngineEvent::XRUN ? LERROR : LINFO,
+            "Reactor::collect_events(): engine %s (%zd) before frame time %u, %zd frames into the run\n",
+            name, event.value, event.frame_time, event.frame);
+        events_.push_back(event);
+    }
+    size_t dropped = events_dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped != 0) {
+        lerror("Reactor::collect_events(): %zd engine events lost, queue full\n", dropped);
+    }
+}
+
+void Reactor::process_(size_t frame_count, void* arg) noexcept {
     Reactor* reactor = static_cast<Reactor*>(arg);
     assert(reactor != nullptr);
+    reactor->process(frame_count);
+}
+
+void Reactor::event_(EngineEvent event, size_t value, void* arg) noexcept {
+    Reactor* reactor = static_cast<Reactor*>(arg);
+    assert(reactor != nullptr);
+    if (!reactor->engine_events_.push({event, value, 0, NO_FRAME})) {
+        reactor->events_dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void Reactor::resize_buffers(size_t period_size) {
+    std::lock_guard<std::mutex> lock{resize_mutex_};
+    if (!running_) {
+        // Next run fits its ringbuffers when it's started
+        return;
+    }
+    resizing_.store(true);
+    // Engine normally stops running periods around the change, but one may still be finishing
+    while (in_cycle_.load()) {
+        std::this_thread::yield();
+    }
     try {
-        reactor->process(frame_count);
-    } catch (...) {
-        if (!reactor->finished_fired_) {
-            reactor->finished_.set_exception(std::current_exception());
-        } else {
-            // Just let the world burn, we are already done here
-            throw;
+        if (reader_ != nullptr) {
+            reader_->fit_period(period_size);
+            stats_.playback_buffer = reader_->buffer_size();
+        }
+        if (writer_ != nullptr) {
+            writer_->fit_period(period_size);
+            stats_.capture_buffer = writer_->buffer_size();
         }
+    } catch (std::exception& ex) {
+        // Ringbuffers are left as they were, the run goes on with them
+        lerror("Reactor::resize_buffers(): failed resizing ringbuffers for period of %zd frames: %s\n",
+            period_size, ex.what());
+    }
+    resizing_.store(false, std::memory_order_release);
+    const size_t skips = resize_skips_.exchange(0, std::memory_order_relaxed);
+    if (skips != 0) {
+        linfo("Reactor::resize_buffers(): run paused for %zd periods while resizing ringbuffers\n", skips);
+    }
+}
+
+void Reactor::buffer_size_(size_t period_size, void* arg) noexcept {
+    Reactor* reactor = static_cast<Reactor*>(arg);
+    assert(reactor != nullptr);
+    try {
+        reactor->resize_buffers(period_size);
+    } catch (...) {
+        lerror("Reactor::buffer_size_(): unexpected failure while resizing ringbuffers\n");
     }
-    return 0;
 }
 
 void Reactor::shutdown_(void* arg) {
     Reactor* reactor = static_cast<Reactor*>(arg);
     assert(reactor != nullptr);
-    linfo("Reactor::shutdown_(): stopping processing on Jack shutdown\n");
-    reactor->signal_finished();
+    linfo("Reactor::shutdown_(): stopping processing on engine shutdown\n");
+    reactor->stop();
 }
 
 void Reactor::signal_handler_(int sig) {
     assert(instance != nullptr);
     linfo("Reactor::signal_handler_(): stopping on signal %d\n", sig);
-    instance->signal_finished();
+    instance->stop();
 }
 }
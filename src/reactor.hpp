@@ -1,21 +1,57 @@
 #pragma once
 #include "types.hpp"
+#include "kernels.hpp"
+#include "semaphore.hpp"
+#include "backend.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
+#include "spsc_queue.hpp"
 
-#include <jack/jack.h>
-
-#include <exception>
-#include <future>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 
 namespace olo {
 
+// Engine event as seen by Jack thread at the start of the first period after it happened
+struct RunEvent {
+    EngineEvent event;
+    // Argument of the event
+    size_t value;
+    // Engine time of the start of that period
+    std::uint32_t frame_time;
+    // Frames of the run processed before the event, i.e. its offset in the recording
+    size_t frame;
+};
+
+// Moves samples between engine ports and Reader/Writer ringbuffers. Ports are registered once,
+// then any number of runs (jobs) may be started one after another with start().
 class Reactor {
-    JackClient& client_;
-    // Names of client-side Jack ports used for connecting
+    // Failures of Jack thread, reported by control thread as exceptions from wait_finished()
+    enum class RtError {
+        NONE,
+        // Argument is output index
+        PLAYBACK_BUFFER,
+        // Argument is input index
+        CAPTURE_BUFFER
+    };
+
+    Backend& backend_;
+    // True if engine isn't paced by wall clock in the current period, so process callback
+    // may wait for disk threads
+    bool blocking_ = false;
+    // Interleaving kernels for the CPU and channel counts we're running with
+    Kernels playback_kernels_ = {};
+    Kernels capture_kernels_ = {};
+    // Names of client-side ports used for connecting
     vector<string> input_names_;
     vector<string> output_names_;
-    // Client-side Jack ports
-    vector<jack_port_t*> inputs_;
-    vector<jack_port_t*> outputs_;
+    // Client-side ports
+    vector<Port*> inputs_;
+    vector<Port*> outputs_;
+    // Engine ports our ports are connected to, empty if disconnected
+    vector<string> input_connections_;
+    vector<string> output_connections_;
     // Pre-allocated arrays for storing port buffers in RT thread
     vector<Sample*> output_buffers_;
     vector<const Sample*> input_buffers_;
@@ -27,40 +63,135 @@ class Reactor {
     size_t needed_ = 0;
     // Number of frames processed so far
     size_t done_ = 0;
-    // Protects `finished_` from being signalled multiple times which has catastrophical results.
-    bool finished_fired_ = false;
+    // Requested silence between the end of the previous run and the start of this one
+    size_t gap_ = 0;
+    // Frames elapsed since activation, used by Jack thread only
+    size_t clock_ = 0;
+    // Clock values at which the current run has started and the previous one ended
+    size_t start_at_ = 0;
+    size_t end_at_ = 0;
+    bool started_ = false;
+    bool ended_ = false;
+    // Set by control thread to start a run, cleared by Jack thread once it's finished
+    std::atomic<bool> running_{false};
+    // Set by control thread to end the current run early
+    std::atomic<bool> cancel_{false};
+    // Set on signals, engine shutdown and failures, which end the whole session
+    std::atomic<bool> stopping_{false};
+    // Set when engines not paced by wall clock should no longer wait for the next run
+    std::atomic<bool> released_{false};
+    // Posted by control thread when a run is started or released_ is set
+    Semaphore armed_;
+    // Protects `finished_` from being signalled multiple times.
+    std::atomic<bool> finished_fired_{false};
     // Delivers signal that RT thread is finished to the control thread
-    std::promise<void> finished_;
-    // True if jack_activate() succeded and needs to be paired with jack_deactivate()
+    Semaphore finished_;
+    // First failure of Jack thread; `error_arg_` is written before `error_` is published
+    std::atomic<RtError> error_{RtError::NONE};
+    size_t error_arg_ = 0;
+    // True if backend was activated and needs to be deactivated
     bool activated_ = false;
+    // True if we've put engine into freewheel mode and need to take it back
+    bool freewheel_ = false;
+    // True if we've installed signal handlers and need to restore them
+    bool signals_ = false;
+    // Timing and ringbuffer fill levels of periods processed in runs
+    RtStats stats_;
+    // Timeline of Jack thread if tracing, and trace time of the current period
+    TraceBuffer* trace_ = nullptr;
+    std::uint64_t trace_clock_ = 0;
+    // Engine events on their way to Jack thread, which stamps them with run position, and from
+    // there to control thread
+    SpscQueue<RunEvent, 64> engine_events_;
+    SpscQueue<RunEvent, 64> stamped_events_;
+    std::atomic<size_t> events_dropped_{0};
+    // Events which happened within the current run
+    vector<RunEvent> events_;
+    // Set by Jack thread while it may be using ringbuffers of the run
+    std::atomic<bool> in_cycle_{false};
+    // Set while ringbuffers of the run are being resized, Jack thread skips periods meanwhile
+    std::atomic<bool> resizing_{false};
+    std::atomic<size_t> resize_skips_{0};
+    // Serializes resizing with control thread handing a run over to Jack thread and taking
+    // it back
+    std::mutex resize_mutex_;
 
-    void register_ports(const vector<string>& input_ports, const vector<string>& output_ports);
+    void register_ports(size_t input_count, size_t output_count);
     void connect_ports(const vector<string>& input_ports, const vector<string>& output_ports);
 
-    static int process_(jack_nframes_t frame_count, void* arg);
+    static void process_(size_t frame_count, void* arg) noexcept;
     static void shutdown_(void* arg);
+    static void event_(EngineEvent event, size_t value, void* arg) noexcept;
+    static void buffer_size_(size_t period_size, void* arg) noexcept;
     static void signal_handler_(int sig);
 
-    void process(size_t frame_count);
+    // Jack thread path doesn't throw, allocate or lock; failures are recorded with fail()
+    void process(size_t frame_count) noexcept;
+    // Processes period starting at clock value `period_start` of an active run
+    void run_cycle(size_t frame_count, size_t period_start) noexcept;
+    void record_cycle(size_t frame_count, std::chrono::steady_clock::duration elapsed) noexcept;
+    // Passes engine events on to control thread, with position in the run if `in_run`
+    void stamp_events(bool in_run) noexcept;
+    // Logs stamped events and keeps those of the current run
+    void collect_events();
+    // Fits ringbuffers of the current run to the new period size
+    void resize_buffers(size_t period_size);
+    bool playback(size_t frame_count, size_t offset) noexcept;
+    bool capture(size_t frame_count, size_t offset) noexcept;
+    // Silences outputs starting from `first`
+    bool mute_outputs(size_t frame_count, size_t first) noexcept;
+    void fail(RtError error, size_t arg) noexcept;
+    // Ends the current run at clock value `end`
+    void finish(size_t end) noexcept;
+    // Ends the whole session
+    void stop() noexcept;
+    void signal_finished() noexcept;
+    void release() noexcept;
     void deactivate();
     void activate();
-    void signal_finished();
-    void playback(size_t frame_count);
-    void capture(size_t frame_count);
+    // Undoes whatever the constructor has done so far, for the destructor and for constructor
+    // failures, which the destructor doesn't see
+    void detach() noexcept;
+    void rethrow_error() const;
 
 public:
+    // Registers `input_count` capture and `output_count` playback ports and activates engine.
+    // Unless `intercept_signals` is false, SIGINT and friends stop the session. If it throws,
+    // ports, callbacks and signal handlers are gone and another Reactor may be created.
     explicit Reactor(
-        JackClient& client,
+        Backend& backend,
+        size_t input_count,
+        size_t output_count,
+        bool freewheel = false,
+        bool intercept_signals = true
+    );
+
+    ~Reactor();
+
+    // Connects ports and starts moving samples from `reader` and to `writer`, which must
+    // not have more channels than there are ports. The run starts `gap_frames` after the
+    // end of the previous one, or as soon as possible if that has already passed.
+    void start(
         const vector<string>& input_ports,
         const vector<string>& output_ports,
         Reader* reader = nullptr,
         Writer* writer = nullptr,
-        bool duration_infinite = false
+        bool duration_infinite = false,
+        size_t gap_frames = 0
     );
-
-    ~Reactor();
-
+    // Returns when the run has finished or the session was stopped, and no ringbuffer resize
+    // is in progress, so that the caller may close the reader and writer of the run
     void wait_finished();
+    // Like wait_finished(), but returns false if it hasn't happened within `timeout`
+    bool wait_finished(std::chrono::milliseconds timeout);
+    // Ends the current run at the next period
+    void cancel() noexcept { cancel_ = true; }
+    // True if session was stopped by a signal, engine shutdown or failure
+    bool stopped() const { return stopping_; }
+    // Measurements of all runs so far
+    const RtStats& stats() const { return stats_; }
+    // Xruns and other engine events of the finished run, in order
+    const vector<RunEvent>& events() const { return events_; }
 };
 
-}
\ No newline at end of file
+}
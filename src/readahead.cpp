@@ -0,0 +1,143 @@
+#include "readahead.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+ReadAhead::ReadAhead(
+    std::unique_ptr<SNDFILE, decltype(&sf_close)> sf,
+    const string& path,
+    size_t channel_count,
+    size_t file_frames,
+    size_t start_frame,
+    size_t frames,
+    size_t chunk_frames
+):
+    sf_{std::move(sf)},
+    channel_count_{channel_count},
+    chunk_frames_{chunk_frames},
+    file_frame_{start_frame},
+    remaining_{frames}
+{
+    for (auto& stage: stages_) {
+        stage.data.reset(new Sample[chunk_frames_ * channel_count_]);
+        free_.post();
+    }
+#ifdef __linux__
+    fd_ = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd_ >= 0 && fstat(fd_, &st) == 0 && file_frames != 0) {
+        // Compressed files have no fixed frame size, an average is good enough for hints
+        file_frame_size_ = static_cast<double>(st.st_size) / file_frames;
+        posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+#else
+    (void) path;
+    (void) file_frames;
+#endif
+    ldebug("ReadAhead: decoding %zd frames of %s in chunks of %zd frames\n",
+        frames, path.c_str(), chunk_frames_);
+    trace_ = trace_buffer("decoder");
+    thread_ = std::thread{&ReadAhead::run, this};
+}
+
+ReadAhead::~ReadAhead() {
+    quit_ = true;
+    free_.post();
+    thread_.join();
+#ifdef __linux__
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+#endif
+}
+
+void ReadAhead::advise(size_t frames) {
+#ifdef __linux__
+    if (file_frame_size_ == 0) {
+        return;
+    }
+    // Ask for the chunk after this one, so that it's in page cache by the time it's decoded
+    const off_t offset = (file_frame_ + frames) * file_frame_size_;
+    const off_t length = chunk_frames_ * file_frame_size_ + 1;
+    posix_fadvise(fd_, offset, length, POSIX_FADV_WILLNEED);
+#else
+    (void) frames;
+#endif
+}
+
+void ReadAhead::run() {
+    size_t index = 0;
+    try {
+        for (; remaining_ != 0; index ^= 1) {
+            free_.wait();
+            if (quit_) {
+                return;
+            }
+            Stage& stage = stages_[index];
+            const size_t frames = std::min(chunk_frames_, remaining_);
+            advise(frames);
+            const std::uint64_t begin = trace_ != nullptr ? trace_now() : 0;
+            auto read = sf_readf_float(sf_.get(), stage.data.get(), frames);
+            if (read != static_cast<sf_count_t>(frames)) {
+                throw runtime_error{str(format("unexpected read of %1% frames when requested %2%, premature EOF?")
+                    % read % frames)};
+            }
+            if (trace_ != nullptr) {
+                trace(trace_, TR_DECODE, begin, trace_now(), frames);
+            }
+            stage.frames = frames;
+            stage.pos = 0;
+            file_frame_ += frames;
+            remaining_ -= frames;
+            full_.post();
+        }
+    } catch (...) {
+        lerror("ReadAhead::run(): exception in decoder thread, will be rethrown on read\n");
+        // Empty stage in place of the chunk tells consumer to rethrow
+        stages_[index].frames = 0;
+        stages_[index].pos = 0;
+        ex_ = std::current_exception();
+        full_.post();
+    }
+}
+
+void ReadAhead::read(Sample* dst, size_t frames) {
+    while (frames != 0) {
+        if (!holding_) {
+            full_.wait();
+            if (stages_[current_].frames == 0) {
+                // Decoder is gone, keep failing if called again
+                full_.post();
+                std::rethrow_exception(ex_);
+            }
+            holding_ = true;
+        }
+        Stage& stage = stages_[current_];
+        const size_t n = std::min(frames, stage.frames - stage.pos);
+        std::memcpy(dst, stage.data.get() + stage.pos * channel_count_, n * channel_count_ * sizeof(Sample));
+        stage.pos += n;
+        dst += n * channel_count_;
+        frames -= n;
+        if (stage.pos == stage.frames) {
+            holding_ = false;
+            current_ ^= 1;
+            free_.post();
+        }
+    }
+}
+
+}
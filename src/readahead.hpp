@@ -0,0 +1,71 @@
+#pragma once
+#include "types.hpp"
+#include "semaphore.hpp"
+#include "trace.hpp"
+
+#include <sndfile.h>
+
+#include <memory>
+#include <thread>
+#include <atomic>
+
+namespace olo {
+
+// Decodes a sound file ahead of the reader in a thread of its own, one large chunk after
+// another into a pair of stage buffers. Disk and decoder stalls are absorbed by up to two
+// chunks of decoded frames rather than by the ringbuffer. The kernel is asked to read the file
+// ahead of the decoder, too.
+class ReadAhead {
+    struct Stage {
+        std::unique_ptr<Sample[]> data;
+        size_t frames = 0;
+        size_t pos = 0;
+    };
+
+    std::unique_ptr<SNDFILE, decltype(&sf_close)> sf_;
+    // Descriptor of the same file used for readahead hints only
+    int fd_ = -1;
+    size_t channel_count_;
+    size_t chunk_frames_;
+    // Average size of a frame in the file and offset of the next frame to decode
+    double file_frame_size_ = 0;
+    size_t file_frame_ = 0;
+    // Frames left to decode
+    size_t remaining_;
+    Stage stages_[2];
+    // Stage being consumed and whether it's been handed over by decoder yet
+    size_t current_ = 0;
+    bool holding_ = false;
+    // Posted by consumer when a stage may be decoded into, by decoder when it's filled
+    Semaphore free_;
+    Semaphore full_;
+    std::atomic<bool> quit_{false};
+    // Failure of decoder, rethrown by read() in place of the chunk it was decoding
+    std::exception_ptr ex_;
+    // Timeline of decoder if tracing
+    TraceBuffer* trace_ = nullptr;
+    std::thread thread_;
+
+    void run();
+    void advise(size_t frames);
+
+public:
+    // Takes over `sf` positioned at `start_frame` of `file_frames` and decodes `frames` of it
+    explicit ReadAhead(
+        std::unique_ptr<SNDFILE, decltype(&sf_close)> sf,
+        const string& path,
+        size_t channel_count,
+        size_t file_frames,
+        size_t start_frame,
+        size_t frames,
+        size_t chunk_frames
+    );
+    ~ReadAhead();
+    ReadAhead(const ReadAhead&) = delete;
+    ReadAhead& operator=(const ReadAhead&) = delete;
+
+    // Copies next `frames` interleaved frames to `dst`, waiting for the decoder if needed
+    void read(Sample* dst, size_t frames);
+};
+
+}
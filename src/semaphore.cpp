@@ -0,0 +1,121 @@
+#include "semaphore.hpp"
+
+#include <stdexcept>
+#include <cerrno>
+
+#if defined(_WIN32)
+# include <windows.h>
+#elif defined(__APPLE__)
+# include <dispatch/dispatch.h>
+#else
+# include <ctime>
+// sem_clockwait() appeared in glibc 2.30
+# if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+#  define OLO_HAVE_SEM_CLOCKWAIT
+# endif
+#endif
+
+namespace olo {
+using std::runtime_error;
+
+#if defined(_WIN32)
+
+Semaphore::Semaphore():
+    handle_{CreateSemaphore(nullptr, 0, LONG_MAX, nullptr)}
+{
+    if (handle_ == nullptr) {
+        throw runtime_error{"unable to create semaphore"};
+    }
+}
+
+Semaphore::~Semaphore() {
+    CloseHandle(handle_);
+}
+
+void Semaphore::post() noexcept {
+    ReleaseSemaphore(handle_, 1, nullptr);
+}
+
+void Semaphore::wait() {
+    WaitForSingleObject(handle_, INFINITE);
+}
+
+bool Semaphore::wait_for(std::chrono::milliseconds timeout) {
+    return WAIT_OBJECT_0 == WaitForSingleObject(handle_, static_cast<DWORD>(timeout.count()));
+}
+
+#elif defined(__APPLE__)
+
+// Unnamed POSIX semaphores are not supported on macOS
+Semaphore::Semaphore():
+    handle_{dispatch_semaphore_create(0)}
+{
+    if (handle_ == nullptr) {
+        throw runtime_error{"unable to create semaphore"};
+    }
+}
+
+Semaphore::~Semaphore() {
+    dispatch_release(static_cast<dispatch_semaphore_t>(handle_));
+}
+
+void Semaphore::post() noexcept {
+    dispatch_semaphore_signal(static_cast<dispatch_semaphore_t>(handle_));
+}
+
+void Semaphore::wait() {
+    dispatch_semaphore_wait(static_cast<dispatch_semaphore_t>(handle_), DISPATCH_TIME_FOREVER);
+}
+
+bool Semaphore::wait_for(std::chrono::milliseconds timeout) {
+    auto when = dispatch_time(DISPATCH_TIME_NOW, std::chrono::nanoseconds(timeout).count());
+    return 0 == dispatch_semaphore_wait(static_cast<dispatch_semaphore_t>(handle_), when);
+}
+
+#else
+
+Semaphore::Semaphore() {
+    if (0 != sem_init(&sem_, 0, 0)) {
+        throw runtime_error{"unable to create semaphore"};
+    }
+}
+
+Semaphore::~Semaphore() {
+    sem_destroy(&sem_);
+}
+
+void Semaphore::post() noexcept {
+    sem_post(&sem_);
+}
+
+void Semaphore::wait() {
+    while (0 != sem_wait(&sem_) && errno == EINTR) {
+    }
+}
+
+bool Semaphore::wait_for(std::chrono::milliseconds timeout) {
+#ifdef OLO_HAVE_SEM_CLOCKWAIT
+    // Monotonic deadline isn't stretched or cut short by wall clock steps
+    const clockid_t clock = CLOCK_MONOTONIC;
+#else
+    const clockid_t clock = CLOCK_REALTIME;
+#endif
+    timespec ts;
+    clock_gettime(clock, &ts);
+    auto ns = ts.tv_nsec + std::chrono::nanoseconds(timeout).count();
+    ts.tv_sec += ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    int err;
+#ifdef OLO_HAVE_SEM_CLOCKWAIT
+    while (0 != (err = sem_clockwait(&sem_, clock, &ts)) && errno == EINTR) {
+    }
+#else
+    while (0 != (err = sem_timedwait(&sem_, &ts)) && errno == EINTR) {
+    }
+#endif
+    return err == 0;
+}
+
+#endif
+
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "types.hpp"
+
+#include <chrono>
+
+#if !defined(_WIN32) && !defined(__APPLE__)
+# include <semaphore.h>
+#endif
+
+namespace olo {
+
+// Counting semaphore used for waking IO threads from Jack thread. Unlike condition_variable
+// it doesn't touch any mutex when posted and doesn't lose wakeups posted before wait.
+class Semaphore {
+#if defined(_WIN32) || defined(__APPLE__)
+    void* handle_;
+#else
+    sem_t sem_;
+#endif
+
+public:
+    Semaphore();
+    ~Semaphore();
+    Semaphore(const Semaphore&) = delete;
+    Semaphore& operator=(const Semaphore&) = delete;
+
+    // Lock-free and async-signal-safe, may be called from Jack thread and signal handlers.
+    void post() noexcept;
+    void wait();
+    // Returns false if timeout expired before semaphore was posted.
+    bool wait_for(std::chrono::milliseconds timeout);
+};
+
+}
@@ -0,0 +1,157 @@
+#include "shm.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+static_assert(sizeof(ShmHeader) <= SHM_DATA_OFFSET, "shared memory header doesn't fit");
+// Other processes see frames_done as a plain integer
+static_assert(sizeof(std::atomic<std::uint64_t>) == sizeof(std::uint64_t), "atomic counter isn't plain integer");
+
+namespace {
+string segment_name(const string& path) {
+    auto name = path.substr(SHM_PREFIX.size());
+    if (name.empty()) {
+        throw runtime_error{str(format("no shared memory name in %1%") % path)};
+    }
+    // Portable names have a single leading slash
+    return name[0] == '/' ? name : "/" + name;
+}
+
+// True if `frames` frames of `channels` channels fit in a segment of `size` bytes. Divides
+// rather than multiplies, as the counts may come from another process and overflow.
+bool segment_fits(std::uint64_t channels, std::uint64_t frames, size_t size) {
+    return channels != 0 && size >= SHM_DATA_OFFSET
+        && frames <= (size - SHM_DATA_OFFSET) / (channels * sizeof(Sample));
+}
+}
+
+bool is_shared_memory(const string& path) {
+    return path.compare(0, SHM_PREFIX.size(), SHM_PREFIX) == 0;
+}
+
+#ifdef _WIN32
+
+bool shared_memory_exists(const string&) {
+    return false;
+}
+
+SharedMemory::SharedMemory(const string&, bool) {
+    throw runtime_error{"shared memory is not supported on this platform"};
+}
+
+SharedMemory::SharedMemory(const string&, size_t, size_t, size_t) {
+    throw runtime_error{"shared memory is not supported on this platform"};
+}
+
+SharedMemory::~SharedMemory() {
+}
+
+#else
+
+bool shared_memory_exists(const string& path) {
+    int fd = shm_open(segment_name(path).c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        return errno != ENOENT;
+    }
+    close(fd);
+    return true;
+}
+
+void SharedMemory::map(int fd, size_t size, bool writable) {
+    int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+    void* data = mmap(nullptr, size, prot, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw runtime_error{str(format("can't map shared memory %1%: %2%") % name_ % std::strerror(err))};
+    }
+    data_ = data;
+    size_ = size;
+}
+
+SharedMemory::SharedMemory(const string& path, bool writable):
+    name_{segment_name(path)}
+{
+    int fd = shm_open(name_.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+    if (fd < 0) {
+        throw runtime_error{str(format("can't open shared memory %1%: %2%") % name_ % std::strerror(errno))};
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < SHM_DATA_OFFSET) {
+        close(fd);
+        throw runtime_error{str(format("shared memory %1% is too small for header") % name_)};
+    }
+    map(fd, st.st_size, writable);
+    const auto& h = header();
+    if (std::memcmp(h.magic, SHM_MAGIC, sizeof(h.magic)) != 0 || h.version != SHM_VERSION) {
+        munmap(data_, size_);
+        throw runtime_error{str(format("shared memory %1% has no arrow1 header of version %2%")
+            % name_ % SHM_VERSION)};
+    }
+    if (!segment_fits(h.channels, h.frames, size_)) {
+        // Header is gone with the mapping
+        const auto message = str(format("shared memory %1% is too small for %2% frames of %3% channels")
+            % name_ % h.frames % h.channels);
+        munmap(data_, size_);
+        throw runtime_error{message};
+    }
+    ldebug("SharedMemory: mapped %s with %zd frames of %u channels\n", name_.c_str(), static_cast<size_t>(h.frames), h.channels);
+}
+
+SharedMemory::SharedMemory(const string& path, size_t sample_rate, size_t channels, size_t frames):
+    name_{segment_name(path)}
+{
+    if (channels == 0 || frames > (SIZE_MAX - SHM_DATA_OFFSET) / (channels * sizeof(Sample))) {
+        throw runtime_error{str(format("shared memory %1% can't hold %2% frames of %3% channels")
+            % name_ % frames % channels)};
+    }
+    const size_t size = SHM_DATA_OFFSET + channels * frames * sizeof(Sample);
+    // Replace rather than resize, in case somebody still has the old one mapped
+    shm_unlink(name_.c_str());
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        throw runtime_error{str(format("can't create shared memory %1%: %2%") % name_ % std::strerror(errno))};
+    }
+    if (ftruncate(fd, size) != 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(name_.c_str());
+        throw runtime_error{str(format("can't allocate %1% bytes of shared memory %2%: %3%")
+            % size % name_ % std::strerror(err))};
+    }
+    map(fd, size, true);
+    auto& h = header();
+    std::memcpy(h.magic, SHM_MAGIC, sizeof(h.magic));
+    h.version = SHM_VERSION;
+    h.channels = channels;
+    h.sample_rate = sample_rate;
+    h.frames = frames;
+    h.frames_done = 0;
+    ldebug("SharedMemory: created %s for %zd frames of %zd channels\n", name_.c_str(), frames, channels);
+}
+
+SharedMemory::~SharedMemory() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+}
+
+#endif
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "types.hpp"
+
+#include <atomic>
+#include <cstdint>
+
+namespace olo {
+
+// Playback and record "files" given as shm:<name> are POSIX shared memory segments, so that
+// other processes may hand over and receive audio without going through the filesystem.
+const string SHM_PREFIX = "shm:";
+
+// Layout of the start of a segment, followed by interleaved float32 frames at SHM_DATA_OFFSET.
+// Integers are native endian. For playback the producer fills everything; for recording the
+// segment may be created by the consumer with `frames` being the capacity, or by us.
+struct ShmHeader {
+    // SHM_MAGIC, without terminating zero
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t channels;
+    std::uint64_t sample_rate;
+    // Frames of playback data or capacity of recording segment
+    std::uint64_t frames;
+    // Frames recorded so far, updated by us while recording
+    std::atomic<std::uint64_t> frames_done;
+};
+
+const char SHM_MAGIC[] = "ARROW1SH";
+const std::uint32_t SHM_VERSION = 1;
+const size_t SHM_DATA_OFFSET = 64;
+
+bool is_shared_memory(const string& path);
+// True if segment given by shm:<name> path exists
+bool shared_memory_exists(const string& path);
+
+// Mapping of a shared memory segment, which itself outlives us
+class SharedMemory {
+    string name_;
+    void* data_ = nullptr;
+    size_t size_ = 0;
+
+    void map(int fd, size_t size, bool writable);
+
+public:
+    // Maps segment given by shm:<name> path and validates its header
+    explicit SharedMemory(const string& path, bool writable);
+    // Creates recording segment, replacing existing one. Segments created by us are left for
+    // the consumer to unlink.
+    explicit SharedMemory(const string& path, size_t sample_rate, size_t channels, size_t frames);
+    ~SharedMemory();
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    ShmHeader& header() const { return *static_cast<ShmHeader*>(data_); }
+    Sample* samples() const { return reinterpret_cast<Sample*>(static_cast<char*>(data_) + SHM_DATA_OFFSET); }
+    const string& name() const { return name_; }
+};
+
+}
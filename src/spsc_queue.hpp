@@ -0,0 +1,43 @@
+#pragma once
+#include "types.hpp"
+
+#include <atomic>
+
+namespace olo {
+
+// Fixed-capacity lock-free queue for a single producer and a single consumer thread. Neither
+// push() nor pop() allocates or blocks, so either end may be the Jack thread.
+template<class T, size_t N>
+class SpscQueue {
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of 2");
+
+    T items_[N];
+    // Monotonic counters, wrapped into items_ on access
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+
+public:
+    // Returns false if queue is full.
+    bool push(const T& item) noexcept {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        items_[tail & (N - 1)] = item;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Returns false if queue is empty.
+    bool pop(T& item) noexcept {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if (tail_.load(std::memory_order_acquire) == head) {
+            return false;
+        }
+        item = items_[head & (N - 1)];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+}
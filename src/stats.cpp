@@ -0,0 +1,132 @@
+#include "stats.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+namespace {
+size_t bucket_index(std::uint64_t value) {
+    if (value == 0) {
+        return 0;
+    }
+#if defined(__GNUC__)
+    return 64 - __builtin_clzll(value);
+#else
+    size_t index = 0;
+    for (; value != 0; value >>= 1) {
+        ++index;
+    }
+    return index;
+#endif
+}
+
+// Lowest value of the bucket
+std::uint64_t bucket_floor(size_t index) {
+    return index == 0 ? 0 : std::uint64_t{1} << (index - 1);
+}
+
+std::uint64_t bucket_limit(size_t index) {
+    if (index == 0) {
+        return 0;
+    }
+    return index < 64 ? std::uint64_t{1} << index : UINT64_MAX;
+}
+}
+
+void Histogram::record(std::uint64_t value) noexcept {
+    // Only one thread records, so plain loads and stores are enough
+    const auto relaxed = std::memory_order_relaxed;
+    auto& bucket = buckets_[bucket_index(value)];
+    bucket.store(bucket.load(relaxed) + 1, relaxed);
+    count_.store(count_.load(relaxed) + 1, relaxed);
+    sum_.store(sum_.load(relaxed) + value, relaxed);
+    if (value < min_.load(relaxed)) {
+        min_.store(value, relaxed);
+    }
+    if (value > max_.load(relaxed)) {
+        max_.store(value, relaxed);
+    }
+}
+
+std::uint64_t Histogram::percentile(double fraction) const {
+    const std::uint64_t total = count();
+    if (total == 0) {
+        return 0;
+    }
+    const double rank = fraction * total;
+    std::uint64_t seen = 0;
+    for (size_t i = 0; i != BUCKETS; ++i) {
+        const std::uint64_t in_bucket = bucket(i);
+        if (in_bucket != 0 && seen + in_bucket >= rank) {
+            // Values are taken as spread evenly over the bucket. Recorded extremes are exact,
+            // so they bound the estimate.
+            const double floor = bucket_floor(i);
+            const double width = static_cast<double>(bucket_limit(i)) - floor;
+            const double position = std::max(rank - seen, 0.) / in_bucket;
+            // Clamped before conversion, which is undefined past UINT64_MAX
+            const double estimate = std::min(floor + width * position, static_cast<double>(max()));
+            return std::max(std::min(static_cast<std::uint64_t>(estimate), max()), min());
+        }
+        seen += in_bucket;
+    }
+    return max();
+}
+
+void Histogram::write_json(std::ostream& out) const {
+    const std::uint64_t n = count();
+    out << "{\"count\": " << n
+        << ", \"min\": " << (n != 0 ? min() : 0)
+        << ", \"max\": " << max()
+        << ", \"mean\": " << (n != 0 ? sum() / n : 0)
+        << ", \"p50\": " << percentile(.5)
+        << ", \"p90\": " << percentile(.9)
+        << ", \"p99\": " << percentile(.99)
+        << ", \"p999\": " << percentile(.999)
+        << ", \"buckets\": [";
+    const char* separator = "";
+    for (size_t i = 0; i != BUCKETS; ++i) {
+        if (bucket(i) != 0) {
+            out << separator << "[" << bucket_limit(i) << ", " << bucket(i) << "]";
+            separator = ", ";
+        }
+    }
+    out << "]}";
+}
+
+void RtStats::write_json(std::ostream& out, size_t sample_rate) const {
+    out << "{\n  \"sample_rate\": " << sample_rate
+        << ",\n  \"cycles\": " << cycle_ns.count()
+        << ",\n  \"missed_deadlines\": " << missed_deadlines.load()
+        << ",\n  \"underruns\": " << underruns.load()
+        << ",\n  \"overruns\": " << overruns.load()
+        << ",\n  \"playback_buffer\": " << playback_buffer.load()
+        << ",\n  \"capture_buffer\": " << capture_buffer.load()
+        << ",\n  \"cycle_ns\": ";
+    cycle_ns.write_json(out);
+    out << ",\n  \"margin_ns\": ";
+    margin_ns.write_json(out);
+    out << ",\n  \"playback_fill\": ";
+    playback_fill.write_json(out);
+    out << ",\n  \"capture_fill\": ";
+    capture_fill.write_json(out);
+    out << "\n}\n";
+}
+
+void write_stats_file(const string& path, const RtStats& stats, size_t sample_rate) {
+    std::ofstream out{path};
+    stats.write_json(out, sample_rate);
+    out.close();
+    if (!out) {
+        throw runtime_error{str(format("failed writing statistics to %1%") % path)};
+    }
+    ldebug("write_stats_file(): %zd cycles written to %s\n", static_cast<size_t>(stats.cycle_ns.count()), path.c_str());
+}
+
+}
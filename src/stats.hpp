@@ -0,0 +1,68 @@
+#pragma once
+#include "types.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+namespace olo {
+
+// Histogram of non-negative values in power-of-two buckets. Updated by a single thread
+// without locks, may be read by others at any time.
+class Histogram {
+public:
+    // Bucket 0 holds zeroes, bucket i values in [2^(i-1), 2^i)
+    static const size_t BUCKETS = 65;
+
+    void record(std::uint64_t value) noexcept;
+    std::uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    std::uint64_t min() const { return min_.load(std::memory_order_relaxed); }
+    std::uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    std::uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    std::uint64_t bucket(size_t index) const { return buckets_[index].load(std::memory_order_relaxed); }
+    // Value below which `fraction` of recorded values fall, interpolated linearly within its
+    // bucket and kept within min() and max()
+    std::uint64_t percentile(double fraction) const;
+    // Writes JSON object with totals, percentiles and non-empty buckets as [upper bound, count]
+    void write_json(std::ostream& out) const;
+
+private:
+    std::atomic<std::uint64_t> buckets_[BUCKETS] = {};
+    std::atomic<std::uint64_t> count_{0};
+    std::atomic<std::uint64_t> sum_{0};
+    std::atomic<std::uint64_t> min_{UINT64_MAX};
+    std::atomic<std::uint64_t> max_{0};
+};
+
+// Measurements of Jack thread over all runs of a Reactor, for telling how close to xruns a
+// configuration gets
+struct RtStats {
+    // Time spent in process callback for periods of runs, in ns
+    Histogram cycle_ns;
+    // Time left until the end of period once the callback is done, in ns. Only recorded
+    // when the engine is paced by wall clock.
+    Histogram margin_ns;
+    // Periods whose callback took longer than the period itself
+    std::atomic<std::uint64_t> missed_deadlines{0};
+    // Frames in playback ringbuffer before it's read, in capture ringbuffer after it's written
+    Histogram playback_fill;
+    Histogram capture_fill;
+    // Ringbuffer sizes of the latest run
+    std::atomic<std::uint64_t> playback_buffer{0};
+    std::atomic<std::uint64_t> capture_buffer{0};
+    std::atomic<std::uint64_t> underruns{0};
+    std::atomic<std::uint64_t> overruns{0};
+
+    // Writes JSON summary
+    void write_json(std::ostream& out, size_t sample_rate) const;
+};
+
+// Writes JSON summary of `stats` to file at `path`
+void write_stats_file(const string& path, const RtStats& stats, size_t sample_rate);
+
+// Single writer increment without a locked instruction
+inline void bump(std::atomic<std::uint64_t>& counter) noexcept {
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+}
@@ -0,0 +1,153 @@
+#include "trace.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+namespace {
+// Enough for a few minutes of Jack thread activity with small periods
+const size_t TRACE_BUFFER_EVENTS = 1 << 19;
+
+struct TraceRecord {
+    std::uint64_t begin;
+    std::uint32_t duration;
+    TraceEvent event;
+    std::uint64_t value;
+};
+
+struct EventInfo {
+    const char* name;
+    // Name of the value in event arguments
+    const char* unit;
+    bool counter;
+};
+
+EventInfo event_info(TraceEvent event) {
+    switch (event) {
+    case TR_CYCLE: return {"cycle", "frames", false};
+    case TR_PLAYBACK_FILL: return {"playback ringbuffer", "frames", true};
+    case TR_CAPTURE_FILL: return {"capture ringbuffer", "frames", true};
+    case TR_WAKE: return {"wake", nullptr, false};
+    case TR_READ_CYCLE: return {"read cycle", "frames", false};
+    case TR_WRITE_CYCLE: return {"write cycle", "frames", false};
+    case TR_FILE_READ: return {"file read", "bytes", false};
+    case TR_FILE_WRITE: return {"file write", "bytes", false};
+    case TR_DECODE: return {"decode", "frames", false};
+    }
+    return {"unknown", nullptr, false};
+}
+
+std::atomic<bool> enabled{false};
+std::chrono::steady_clock::time_point epoch;
+}
+
+class TraceBuffer {
+public:
+    string name;
+    // Value-initialized so that Jack thread doesn't fault pages in
+    std::unique_ptr<TraceRecord[]> records{new TraceRecord[TRACE_BUFFER_EVENTS]()};
+    // Published after the record is written
+    std::atomic<size_t> size{0};
+    std::atomic<size_t> dropped{0};
+
+    explicit TraceBuffer(const char* name): name{name} {}
+};
+
+namespace {
+std::mutex registry_mutex;
+vector<std::unique_ptr<TraceBuffer>> registry;
+}
+
+void trace_enable() {
+    epoch = std::chrono::steady_clock::now();
+    enabled = true;
+}
+
+TraceBuffer* trace_buffer(const char* name) {
+    if (!enabled) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock{registry_mutex};
+    for (auto& buffer: registry) {
+        if (buffer->name == name) {
+            return buffer.get();
+        }
+    }
+    registry.emplace_back(new TraceBuffer{name});
+    return registry.back().get();
+}
+
+std::uint64_t trace_now() noexcept {
+    return trace_time(std::chrono::steady_clock::now());
+}
+
+std::uint64_t trace_time(std::chrono::steady_clock::time_point time) noexcept {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time - epoch).count();
+}
+
+void trace(TraceBuffer* buffer, TraceEvent event, std::uint64_t begin, std::uint64_t end, std::uint64_t value) noexcept {
+    if (buffer == nullptr) {
+        return;
+    }
+    const size_t n = buffer->size.load(std::memory_order_relaxed);
+    if (n == TRACE_BUFFER_EVENTS) {
+        buffer->dropped.store(buffer->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+    }
+    const std::uint64_t duration = std::min<std::uint64_t>(end - begin, UINT32_MAX);
+    buffer->records[n] = {begin, static_cast<std::uint32_t>(duration), event, value};
+    buffer->size.store(n + 1, std::memory_order_release);
+}
+
+void trace_write(const string& path) {
+    std::ofstream out{path};
+    // Trace event timestamps are in microseconds
+    out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+    std::lock_guard<std::mutex> lock{registry_mutex};
+    size_t events = 0;
+    for (size_t tid = 1; tid <= registry.size(); ++tid) {
+        const auto& buffer = *registry[tid - 1];
+        out << (tid != 1 ? ",\n" : "") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+            << ", \"args\": {\"name\": \"" << buffer.name << "\"}}";
+        const size_t size = buffer.size.load(std::memory_order_acquire);
+        for (size_t i = 0; i != size; ++i) {
+            const auto& r = buffer.records[i];
+            const auto info = event_info(r.event);
+            out << ",\n{\"name\": \"" << info.name << "\", \"pid\": 1, \"tid\": " << tid
+                << ", \"ts\": " << r.begin / 1e3;
+            if (info.counter) {
+                out << ", \"ph\": \"C\"";
+            } else {
+                out << ", \"ph\": \"X\", \"dur\": " << r.duration / 1e3;
+            }
+            if (info.unit != nullptr) {
+                out << ", \"args\": {\"" << info.unit << "\": " << r.value << "}";
+            }
+            out << "}";
+        }
+        events += size;
+        if (buffer.dropped != 0) {
+            lerror("trace_write(): %zd events of %s thread lost, buffer full\n", buffer.dropped.load(), buffer.name.c_str());
+        }
+    }
+    out << "\n]}\n";
+    out.close();
+    if (!out) {
+        throw runtime_error{str(format("failed writing trace to %1%") % path)};
+    }
+    ldebug("trace_write(): %zd events of %zd threads written to %s\n", events, registry.size(), path.c_str());
+}
+
+}
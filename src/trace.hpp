@@ -0,0 +1,48 @@
+#pragma once
+#include "types.hpp"
+
+#include <cstdint>
+#include <chrono>
+
+namespace olo {
+
+// Timeline of Jack and IO thread activity, written as Chrome trace event JSON which can be
+// opened in chrome://tracing or Perfetto. Each thread records into a buffer of its own,
+// without locks or allocation; events which don't fit are dropped.
+
+enum TraceEvent: std::uint16_t {
+    // Process callback of a run; value: frames
+    TR_CYCLE,
+    // Ringbuffer fill levels sampled in Jack thread; value: frames
+    TR_PLAYBACK_FILL,
+    TR_CAPTURE_FILL,
+    // From Jack thread posting the worker to the worker running; no value
+    TR_WAKE,
+    // Work cycle of Reader/Writer worker; value: frames moved
+    TR_READ_CYCLE,
+    TR_WRITE_CYCLE,
+    // Single read from/write to the source or destination; value: bytes of samples
+    TR_FILE_READ,
+    TR_FILE_WRITE,
+    // Chunk decoded ahead of Reader; value: frames
+    TR_DECODE
+};
+
+class TraceBuffer;
+
+// Starts the trace clock, buffers are only handed out from now on
+void trace_enable();
+// Returns buffer named `name` for events of one thread at a time, or nullptr if tracing
+// isn't enabled. Threads which replace one another get the same buffer by asking for the same
+// name. Buffers live until the process exits.
+TraceBuffer* trace_buffer(const char* name);
+// Nanoseconds since tracing was enabled, now or at `time`
+std::uint64_t trace_now() noexcept;
+std::uint64_t trace_time(std::chrono::steady_clock::time_point time) noexcept;
+// Records event spanning from `begin` to `end`, instant one if they are equal. Lock-free and
+// doesn't allocate, so it may be called from Jack thread. Does nothing if `buffer` is nullptr.
+void trace(TraceBuffer* buffer, TraceEvent event, std::uint64_t begin, std::uint64_t end, std::uint64_t value = 0) noexcept;
+// Writes events of all buffers as trace event JSON, threads must not be recording meanwhile
+void trace_write(const string& path);
+
+}
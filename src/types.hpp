@@ -24,6 +24,16 @@ using Sample = jack_default_audio_sample_t;
 using boost::optional;
 
 const size_t BUFFER_SIZE_DEFAULT = 65536 / 8;
+// Playback ringbuffer is refilled when its fill drops to this fraction of buffer size
+const double LOW_WATERMARK_DEFAULT = .75;
+// Recording ringbuffer is drained when its fill reaches this fraction of buffer size
+const double HIGH_WATERMARK_DEFAULT = .25;
+// Engine parameters used with --offline unless specified otherwise
+const size_t OFFLINE_RATE_DEFAULT = 48000;
+const size_t OFFLINE_PERIOD_DEFAULT = 1024;
+const size_t OFFLINE_CHANNELS_DEFAULT = 2;
+// Control socket of --daemon unless specified otherwise
+const string DAEMON_SOCKET_DEFAULT = "/tmp/arrow1.sock";
 const string JACK_CLIENT_NAME = "arrow1";
 const string VERSION = "2.0";
 const string NAME_DISPLAY = "   _                      _\n"
@@ -37,6 +47,7 @@ const string NULL_OUTPUT = "null";
 
 class Reader;
 class Writer;
+class Backend;
 class JackClient;
 
 }
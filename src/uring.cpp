@@ -0,0 +1,178 @@
+#include "uring.hpp"
+
+#include <boost/format.hpp>
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+// IORING_OP_WRITE needs kernel headers of 5.6 or later, older ones get the stub which makes
+// --uring fall back to plain writes
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/version.h>
+#  if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+#   define OLO_HAVE_IO_URING
+#  endif
+# endif
+#endif
+
+#ifdef OLO_HAVE_IO_URING
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+#ifndef OLO_HAVE_IO_URING
+
+Uring::Uring(size_t) {
+    throw runtime_error{"io_uring is not supported by this build"};
+}
+
+Uring::~Uring() {
+}
+
+void Uring::unmap() {
+}
+
+void Uring::write(int, const void*, size_t, std::uint64_t, std::uint64_t) {
+}
+
+int Uring::wait(std::uint64_t&) {
+    return -ENOSYS;
+}
+
+#else
+
+namespace {
+int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+void* map_ring(int fd, size_t size, off_t offset) {
+    void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? nullptr : p;
+}
+}
+
+Uring::Uring(size_t entries) {
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    fd_ = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd_ < 0) {
+        throw runtime_error{str(format("io_uring setup failed: %1%") % std::strerror(errno))};
+    }
+    entries_ = p.sq_entries;
+    sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    // Newer kernels share a single mapping between both rings
+    const bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+    sq_ring_ = map_ring(fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+    if (sq_ring_ != nullptr) {
+        cq_ring_ = single ? sq_ring_ : map_ring(fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+    }
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    if (cq_ring_ != nullptr) {
+        sqes_ = static_cast<io_uring_sqe*>(map_ring(fd_, sqes_size_, IORING_OFF_SQES));
+    }
+    if (sqes_ == nullptr) {
+        int err = errno;
+        unmap();
+        close(fd_);
+        throw runtime_error{str(format("io_uring mapping failed: %1%") % std::strerror(err))};
+    }
+    auto sq = static_cast<char*>(sq_ring_);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    auto cq = static_cast<char*>(cq_ring_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+}
+
+Uring::~Uring() {
+    // Kernel may still be reading buffers of the caller, which are going away after us
+    std::uint64_t tag;
+    while (in_flight_ != 0) {
+        try {
+            wait(tag);
+        } catch (runtime_error&) {
+            break;
+        }
+    }
+    unmap();
+    close(fd_);
+}
+
+void Uring::unmap() {
+    if (sqes_ != nullptr) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ != nullptr && cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_ != nullptr) {
+        munmap(sq_ring_, sq_ring_size_);
+    }
+}
+
+void Uring::write(int fd, const void* data, size_t size, std::uint64_t offset, std::uint64_t tag) {
+    assert(in_flight_ < entries_);
+    // We're the only producer of submissions
+    const unsigned tail = *sq_tail_;
+    const unsigned index = tail & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<std::uintptr_t>(data);
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    sq_array_[index] = index;
+    // Publish the entry before the tail
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = enter(fd_, 1, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        throw runtime_error{str(format("io_uring submission failed: %1%") % std::strerror(errno))};
+    }
+    ++in_flight_;
+}
+
+int Uring::wait(std::uint64_t& tag) {
+    assert(in_flight_ != 0);
+    for (;;) {
+        // We're the only consumer of completions
+        const unsigned head = *cq_head_;
+        if (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe* cqe = &cqes_[head & cq_mask_];
+            tag = cqe->user_data;
+            const int res = cqe->res;
+            __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+            --in_flight_;
+            return res;
+        }
+        if (enter(fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            throw runtime_error{str(format("io_uring wait failed: %1%") % std::strerror(errno))};
+        }
+    }
+}
+
+#endif
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "types.hpp"
+
+#include <cstdint>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace olo {
+
+// Minimal io_uring instance for queueing file writes, talking to the kernel directly so that
+// liburing isn't needed. Not thread safe.
+class Uring {
+    int fd_ = -1;
+    void* sq_ring_ = nullptr;
+    size_t sq_ring_size_ = 0;
+    void* cq_ring_ = nullptr;
+    size_t cq_ring_size_ = 0;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+    // Shared with the kernel
+    unsigned* sq_tail_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned cq_mask_ = 0;
+    io_uring_cqe* cqes_ = nullptr;
+    // Requests submitted and not reaped yet
+    size_t in_flight_ = 0;
+    size_t entries_ = 0;
+
+    void unmap();
+
+public:
+    // Throws if io_uring isn't available, e.g. on old kernels or when disabled by seccomp
+    explicit Uring(size_t entries);
+    ~Uring();
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    // Submits write of `size` bytes at `offset` of `fd`, identified by `tag` on completion.
+    // At most `entries` requests may be in flight.
+    void write(int fd, const void* data, size_t size, std::uint64_t offset, std::uint64_t tag);
+    // Waits for a request to complete, stores its tag and returns its result: number of bytes
+    // written or negated errno
+    int wait(std::uint64_t& tag);
+    size_t in_flight() const { return in_flight_; }
+};
+
+}
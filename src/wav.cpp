@@ -0,0 +1,562 @@
+#include "wav.hpp"
+#include "log.hpp"
+
+#include <boost/format.hpp>
+
+#include <stdexcept>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#ifndef _WIN32
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+namespace olo {
+using std::runtime_error;
+using boost::format;
+
+namespace {
+const std::uint16_t FORMAT_PCM = 1;
+const std::uint16_t FORMAT_FLOAT = 3;
+const std::uint16_t FORMAT_EXTENSIBLE = 0xfffe;
+
+std::uint32_t le16(const unsigned char* p) {
+    return p[0] | p[1] << 8;
+}
+
+std::uint32_t le32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<std::uint32_t>(p[3]) << 24;
+}
+
+std::uint64_t le64(const unsigned char* p) {
+    return le32(p) | static_cast<std::uint64_t>(le32(p + 4)) << 32;
+}
+
+void put16(unsigned char* p, std::uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+void put32(unsigned char* p, std::uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+void put64(unsigned char* p, std::uint64_t v) {
+    put32(p, v);
+    put32(p + 4, v >> 32);
+}
+
+// Layout of WavWriter header: RIFF, JUNK holding room for ds64, fmt, fact, JUNK padding and
+// data, so that samples start at a page boundary
+const size_t DS64_OFFSET = 12;
+const size_t DS64_SIZE = 28;
+const size_t FMT_OFFSET = DS64_OFFSET + 8 + DS64_SIZE;
+const size_t HEADER_SIZE = 4096;
+const std::uint32_t RIFF_SIZE_MAX = 0xffffffff;
+// Blocks written through io_uring and how many of them may be in flight
+const size_t URING_BLOCK_SIZE = 1 << 20;
+const size_t URING_DEPTH = 8;
+// Alignment of memory, offsets and sizes of direct IO, a multiple of any device block size
+const size_t DIRECT_ALIGNMENT = 4096;
+// KSDATAFORMAT_SUBTYPE_IEEE_FLOAT with the format tag left out
+const unsigned char SUBTYPE_GUID_TAIL[14] = {
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+bool host_little_endian() {
+    const std::uint32_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+}
+
+size_t WavLayout::frame_size() const {
+    switch (encoding) {
+    case WavEncoding::PCM_16: return channels * 2;
+    case WavEncoding::PCM_24: return channels * 3;
+    case WavEncoding::PCM_32: return channels * 4;
+    case WavEncoding::FLOAT: return channels * sizeof(Sample);
+    }
+    return 0;
+}
+
+optional<WavLayout> parse_wav(const unsigned char* data, size_t size) {
+    if (!host_little_endian() || size < 12 || std::memcmp(data + 8, "WAVE", 4) != 0) {
+        return boost::none;
+    }
+    const bool rf64 = std::memcmp(data, "RF64", 4) == 0;
+    if (!rf64 && std::memcmp(data, "RIFF", 4) != 0) {
+        return boost::none;
+    }
+    optional<WavLayout> layout;
+    size_t block_align = 0;
+    // RF64 keeps sizes which don't fit chunk headers in ds64 chunk
+    std::uint64_t data_size64 = RIFF_SIZE_MAX;
+    for (size_t pos = 12; pos + 8 <= size;) {
+        const unsigned char* chunk = data + pos;
+        std::uint64_t chunk_size = le32(chunk + 4);
+        if (rf64 && std::memcmp(chunk, "ds64", 4) == 0) {
+            if (chunk_size < DS64_SIZE || pos + 8 + chunk_size > size) {
+                return boost::none;
+            }
+            data_size64 = le64(chunk + 16);
+        } else if (std::memcmp(chunk, "fmt ", 4) == 0) {
+            if (chunk_size < 16 || pos + 8 + chunk_size > size) {
+                return boost::none;
+            }
+            const unsigned char* fmt = chunk + 8;
+            std::uint32_t tag = le16(fmt);
+            const size_t channels = le16(fmt + 2);
+            const size_t bits = le16(fmt + 14);
+            block_align = le16(fmt + 12);
+            if (tag == FORMAT_EXTENSIBLE) {
+                // Sub-format GUID starts with the format tag, valid bits must fill the container
+                if (chunk_size < 40 || le16(fmt + 18) != bits) {
+                    return boost::none;
+                }
+                tag = le16(fmt + 24);
+            }
+            WavLayout l = {WavEncoding::FLOAT, channels, le32(fmt + 4), 0, 0};
+            if (tag == FORMAT_FLOAT && bits == 32) {
+                l.encoding = WavEncoding::FLOAT;
+            } else if (tag == FORMAT_PCM && bits == 16) {
+                l.encoding = WavEncoding::PCM_16;
+            } else if (tag == FORMAT_PCM && bits == 24) {
+                l.encoding = WavEncoding::PCM_24;
+            } else if (tag == FORMAT_PCM && bits == 32) {
+                l.encoding = WavEncoding::PCM_32;
+            } else {
+                return boost::none;
+            }
+            if (channels == 0 || block_align != l.frame_size()) {
+                return boost::none;
+            }
+            layout = l;
+        } else if (std::memcmp(chunk, "data", 4) == 0) {
+            if (!layout) {
+                return boost::none;
+            }
+            if (chunk_size == RIFF_SIZE_MAX) {
+                chunk_size = data_size64;
+            }
+            layout->data_offset = pos + 8;
+            // Truncated files and ones still being written claim more than there is
+            layout->frames = std::min<std::uint64_t>(chunk_size, size - layout->data_offset) / block_align;
+            return layout;
+        }
+        // Chunks are padded to even size
+        pos += 8 + chunk_size + (chunk_size & 1);
+    }
+    return boost::none;
+}
+
+void convert_samples(WavEncoding encoding, const unsigned char* src, size_t count, Sample* dst) {
+    switch (encoding) {
+    case WavEncoding::PCM_16:
+        for (size_t i = 0; i != count; ++i, src += 2) {
+            dst[i] = static_cast<std::int16_t>(le16(src)) * (1.f / 0x8000);
+        }
+        break;
+    case WavEncoding::PCM_24:
+        for (size_t i = 0; i != count; ++i, src += 3) {
+            // Shift into the top bytes to sign-extend
+            const std::uint32_t u = static_cast<std::uint32_t>(src[0]) << 8 | src[1] << 16 | static_cast<std::uint32_t>(src[2]) << 24;
+            dst[i] = static_cast<std::int32_t>(u) * (1.f / 0x80000000);
+        }
+        break;
+    case WavEncoding::PCM_32:
+        for (size_t i = 0; i != count; ++i, src += 4) {
+            dst[i] = static_cast<float>(static_cast<std::int32_t>(le32(src))) * (1.f / 0x80000000);
+        }
+        break;
+    case WavEncoding::FLOAT:
+        // Only parsed on little-endian hosts
+        std::memcpy(dst, src, count * sizeof(Sample));
+        break;
+    }
+}
+
+void append_wav_cues(const string& path, const vector<WavCue>& cues) {
+    std::fstream file{path, std::ios::in | std::ios::out | std::ios::binary};
+    unsigned char riff[12];
+    if (!file.read(reinterpret_cast<char*>(riff), sizeof(riff)) || std::memcmp(riff + 8, "WAVE", 4) != 0) {
+        throw runtime_error{str(format("can't add markers to %1%: not a WAV file") % path)};
+    }
+    const bool rf64 = std::memcmp(riff, "RF64", 4) == 0;
+    unsigned char ds64[16];
+    if (rf64 && (!file.read(reinterpret_cast<char*>(ds64), sizeof(ds64)) || std::memcmp(ds64, "ds64", 4) != 0)) {
+        throw runtime_error{str(format("can't add markers to %1%: RF64 file without ds64 chunk") % path)};
+    }
+    // Cue chunk positions the points, labels in associated data list name them
+    vector<unsigned char> cue(12);
+    vector<unsigned char> list(12);
+    std::uint32_t id = 0;
+    for (const auto& c: cues) {
+        if (c.frame > RIFF_SIZE_MAX) {
+            linfo("append_wav_cues(): %s at frame %zd is past the reach of cue points, left out\n",
+                c.label.c_str(), static_cast<size_t>(c.frame));
+            continue;
+        }
+        ++id;
+        unsigned char point[24] = {0};
+        put32(point, id);
+        put32(point + 4, c.frame);
+        std::memcpy(point + 8, "data", 4);
+        put32(point + 20, c.frame);
+        cue.insert(cue.end(), point, point + sizeof(point));
+        const size_t text_size = c.label.size() + 1;
+        unsigned char label[12];
+        std::memcpy(label, "labl", 4);
+        put32(label + 4, 4 + text_size);
+        put32(label + 8, id);
+        list.insert(list.end(), label, label + sizeof(label));
+        list.insert(list.end(), c.label.begin(), c.label.end());
+        list.resize(list.size() + 1 + (text_size & 1));
+    }
+    if (id == 0) {
+        return;
+    }
+    std::memcpy(cue.data(), "cue ", 4);
+    put32(cue.data() + 4, cue.size() - 8);
+    put32(cue.data() + 8, id);
+    std::memcpy(list.data(), "LIST", 4);
+    put32(list.data() + 4, list.size() - 8);
+    std::memcpy(list.data() + 8, "adtl", 4);
+
+    file.seekp(0, std::ios::end);
+    const std::uint64_t end = file.tellp();
+    // Samples may end on an odd byte, chunks start on even ones
+    const std::uint64_t riff_size = end + (end & 1) + cue.size() + list.size() - 8;
+    if (!rf64 && riff_size > RIFF_SIZE_MAX) {
+        throw runtime_error{str(format("can't add markers to %1%: no room left in RIFF file") % path)};
+    }
+    if (end & 1) {
+        file.put(0);
+    }
+    file.write(reinterpret_cast<const char*>(cue.data()), cue.size());
+    file.write(reinterpret_cast<const char*>(list.data()), list.size());
+    if (rf64) {
+        put64(ds64 + 8, riff_size);
+        file.seekp(DS64_OFFSET + 8);
+        file.write(reinterpret_cast<const char*>(ds64 + 8), 8);
+    } else {
+        put32(riff + 4, riff_size);
+        file.seekp(4);
+        file.write(reinterpret_cast<const char*>(riff + 4), 4);
+    }
+    file.close();
+    if (!file) {
+        throw runtime_error{str(format("failed adding markers to %1%") % path)};
+    }
+    ldebug("append_wav_cues(): %zd markers added to %s\n", static_cast<size_t>(id), path.c_str());
+}
+
+#ifdef _WIN32
+
+WavWriter::WavWriter(const string&, size_t, size_t, size_t, WavIo) {
+    throw runtime_error{"writing float WAV files is not supported on this platform"};
+}
+
+WavWriter::~WavWriter() {
+}
+
+void WavWriter::write(const Sample*, size_t) {
+}
+
+void WavWriter::close() {
+}
+
+MappedFile::MappedFile(const string&) {
+    throw runtime_error{"file mapping is not supported on this platform"};
+}
+
+MappedFile::~MappedFile() {
+}
+
+void MappedFile::prefetch(size_t, size_t) const {
+}
+
+#else
+
+WavWriter::WavWriter(
+    const string& path,
+    size_t sample_rate,
+    size_t channel_count,
+    size_t expected_frames,
+    WavIo io
+):
+    path_{path},
+    frame_size_{channel_count * sizeof(Sample)},
+    header_(HEADER_SIZE)
+{
+    // Plain float format tag for mono and stereo, like libsndfile, extensible one otherwise
+    const bool extensible = channel_count > 2;
+    const size_t fmt_size = extensible ? 40 : 18;
+    const size_t fact_offset = FMT_OFFSET + 8 + fmt_size;
+    const size_t pad_offset = fact_offset + 12;
+    const size_t data_offset = HEADER_SIZE - 8;
+    unsigned char* h = header_.data();
+    std::memcpy(h, "RIFF", 4);
+    std::memcpy(h + 8, "WAVE", 4);
+    std::memcpy(h + DS64_OFFSET, "JUNK", 4);
+    put32(h + DS64_OFFSET + 4, DS64_SIZE);
+    unsigned char* fmt = h + FMT_OFFSET;
+    std::memcpy(fmt, "fmt ", 4);
+    put32(fmt + 4, fmt_size);
+    put16(fmt + 8, extensible ? FORMAT_EXTENSIBLE : FORMAT_FLOAT);
+    put16(fmt + 10, channel_count);
+    put32(fmt + 12, sample_rate);
+    put32(fmt + 16, sample_rate * frame_size_);
+    put16(fmt + 20, frame_size_);
+    put16(fmt + 22, 8 * sizeof(Sample));
+    put16(fmt + 24, fmt_size - 18);
+    if (extensible) {
+        // Valid bits, no speaker positions, sub-format
+        put16(fmt + 26, 8 * sizeof(Sample));
+        put32(fmt + 28, 0);
+        put16(fmt + 32, FORMAT_FLOAT);
+        std::memcpy(fmt + 34, SUBTYPE_GUID_TAIL, sizeof(SUBTYPE_GUID_TAIL));
+    }
+    std::memcpy(h + fact_offset, "fact", 4);
+    put32(h + fact_offset + 4, 4);
+    std::memcpy(h + pad_offset, "JUNK", 4);
+    put32(h + pad_offset + 4, data_offset - pad_offset - 8);
+    std::memcpy(h + data_offset, "data", 4);
+
+    if (io != WavIo::SYNC) {
+        try {
+            uring_.reset(new Uring{URING_DEPTH});
+        } catch (runtime_error& ex) {
+            linfo("WavWriter: %s, writing %s synchronously\n", ex.what(), path.c_str());
+            io = WavIo::SYNC;
+        }
+    }
+    if (uring_) {
+        void* pool = nullptr;
+        if (posix_memalign(&pool, DIRECT_ALIGNMENT, URING_DEPTH * URING_BLOCK_SIZE) != 0) {
+            throw std::bad_alloc{};
+        }
+        pool_.reset(static_cast<unsigned char*>(pool));
+        pending_.assign(URING_DEPTH, 0);
+    }
+    const int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    direct_ = io == WavIo::URING_DIRECT;
+    fd_ = open(path.c_str(), flags | (direct_ ? O_DIRECT : 0), 0666);
+    if (fd_ < 0 && direct_ && errno == EINVAL) {
+        ldebug("WavWriter: %s doesn't support direct IO, going through page cache\n", path.c_str());
+        direct_ = false;
+        fd_ = open(path.c_str(), flags, 0666);
+    }
+    if (fd_ < 0) {
+        throw runtime_error{str(format("can't open recording file: %1%: %2%") % path % std::strerror(errno))};
+    }
+#ifdef __linux__
+    if (expected_frames != 0) {
+        // Reserve contiguous space up front without changing file size, so that an aborted
+        // recording is still a valid file. Not all filesystems support this.
+        const off_t size = HEADER_SIZE + expected_frames * frame_size_;
+        if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, size) != 0) {
+            ldebug("WavWriter: not preallocating %s: %s\n", path.c_str(), std::strerror(errno));
+        }
+    }
+#endif
+    try {
+        write_header();
+    } catch (...) {
+        ::close(fd_);
+        throw;
+    }
+}
+
+WavWriter::~WavWriter() {
+    if (fd_ < 0) {
+        return;
+    }
+    try {
+        close();
+    } catch (runtime_error& ex) {
+        lerror("WavWriter: %s\n", ex.what());
+    }
+}
+
+unsigned char* WavWriter::block(size_t index) const {
+    return pool_.get() + index * URING_BLOCK_SIZE;
+}
+
+void WavWriter::write_at(const void* data, size_t size, size_t offset) {
+    const char* p = static_cast<const char*>(data);
+    while (size != 0) {
+        ssize_t n = pwrite(fd_, p, size, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw runtime_error{str(format("failed writing %1%: %2%") % path_ % std::strerror(errno))};
+        }
+        p += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+void WavWriter::write_header() {
+    if (!pool_) {
+        write_at(header_.data(), header_.size(), 0);
+        return;
+    }
+    // Direct IO needs aligned memory, all blocks are free when the header is written
+    std::memcpy(block(0), header_.data(), header_.size());
+    write_at(block(0), header_.size(), 0);
+}
+
+void WavWriter::write(const Sample* src, size_t count) {
+    const size_t size = count * sizeof(Sample);
+    if (!uring_) {
+        write_at(src, size, HEADER_SIZE + written_);
+        written_ += size;
+        return;
+    }
+    auto p = reinterpret_cast<const unsigned char*>(src);
+    for (size_t left = size; left != 0;) {
+        while (pending_[block_] != 0) {
+            complete();
+        }
+        const size_t n = std::min(left, URING_BLOCK_SIZE - fill_);
+        std::memcpy(block(block_) + fill_, p, n);
+        fill_ += n;
+        p += n;
+        left -= n;
+        if (fill_ == URING_BLOCK_SIZE) {
+            submit(fill_);
+        }
+    }
+    written_ += size;
+}
+
+void WavWriter::submit(size_t size) {
+    uring_->write(fd_, block(block_), size, HEADER_SIZE + submitted_, block_);
+    pending_[block_] = size;
+    submitted_ += size;
+    block_ = (block_ + 1) % URING_DEPTH;
+    fill_ = 0;
+}
+
+void WavWriter::complete() {
+    std::uint64_t index;
+    const int res = uring_->wait(index);
+    const size_t size = pending_[index];
+    pending_[index] = 0;
+    if (res < 0) {
+        throw runtime_error{str(format("failed writing %1%: %2%") % path_ % std::strerror(-res))};
+    }
+    if (static_cast<size_t>(res) != size) {
+        throw runtime_error{str(format("unexpected write of %1% bytes when requested %2%, no more space?")
+            % res % size)};
+    }
+}
+
+void WavWriter::close() {
+    try {
+        finish();
+    } catch (...) {
+        ::close(fd_);
+        fd_ = -1;
+        throw;
+    }
+    const int ret = ::close(fd_);
+    fd_ = -1;
+    if (ret != 0) {
+        throw runtime_error{str(format("failed closing %1%: %2%") % path_ % std::strerror(errno))};
+    }
+}
+
+void WavWriter::finish() {
+    if (uring_) {
+        if (fill_ != 0) {
+            // Direct IO writes whole blocks of the device, padding is truncated below
+            size_t size = fill_;
+            if (direct_) {
+                size = (size + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+                std::memset(block(block_) + fill_, 0, size - fill_);
+            }
+            submit(size);
+        }
+        while (uring_->in_flight() != 0) {
+            complete();
+        }
+    }
+    const size_t frames = written_ / frame_size_;
+    const std::uint64_t riff_size = HEADER_SIZE - 8 + written_;
+    unsigned char* h = header_.data();
+    const size_t fact_offset = FMT_OFFSET + 8 + le32(h + FMT_OFFSET + 4);
+    const size_t data_offset = HEADER_SIZE - 8;
+    if (riff_size <= RIFF_SIZE_MAX) {
+        put32(h + 4, riff_size);
+        put32(h + fact_offset + 8, frames);
+        put32(h + data_offset + 4, written_);
+    } else {
+        ldebug("WavWriter: %s has %zd bytes of samples, writing it as RF64\n", path_.c_str(), written_);
+        std::memcpy(h, "RF64", 4);
+        put32(h + 4, RIFF_SIZE_MAX);
+        std::memcpy(h + DS64_OFFSET, "ds64", 4);
+        put64(h + DS64_OFFSET + 8, riff_size);
+        put64(h + DS64_OFFSET + 16, written_);
+        put64(h + DS64_OFFSET + 24, frames);
+        // No table of other large chunks
+        put32(h + DS64_OFFSET + 32, 0);
+        put32(h + fact_offset + 8, RIFF_SIZE_MAX);
+        put32(h + data_offset + 4, RIFF_SIZE_MAX);
+    }
+    write_header();
+    // Give back preallocated space which wasn't used
+    if (ftruncate(fd_, HEADER_SIZE + written_) != 0) {
+        throw runtime_error{str(format("failed finishing %1%: %2%") % path_ % std::strerror(errno))};
+    }
+}
+
+MappedFile::MappedFile(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error{str(format("can't open %1%: %2%") % path % std::strerror(errno))};
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        throw runtime_error{str(format("can't map %1%: not a regular file") % path)};
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw runtime_error{str(format("can't map %1%: %2%") % path % std::strerror(err))};
+    }
+    data_ = data;
+    size_ = st.st_size;
+    // Readahead is requested explicitly with prefetch()
+    madvise(data_, size_, MADV_SEQUENTIAL);
+}
+
+MappedFile::~MappedFile() {
+    munmap(data_, size_);
+}
+
+void MappedFile::prefetch(size_t offset, size_t length) const {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    if (offset >= size_) {
+        return;
+    }
+    length = std::min(length, size_ - offset);
+    const size_t begin = offset / page_size * page_size;
+    madvise(static_cast<char*>(data_) + begin, offset + length - begin, MADV_WILLNEED);
+}
+
+#endif
+
+}
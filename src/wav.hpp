@@ -0,0 +1,127 @@
+#pragma once
+#include "types.hpp"
+#include "uring.hpp"
+
+#include <memory>
+#include <cstdlib>
+#include <cstdint>
+
+namespace olo {
+
+// Sample encodings of uncompressed WAV files which are read without libsndfile
+enum class WavEncoding {
+    PCM_16,
+    PCM_24,
+    PCM_32,
+    FLOAT
+};
+
+struct WavLayout {
+    WavEncoding encoding;
+    size_t channels;
+    size_t sample_rate;
+    // Offset of the first frame in the file
+    size_t data_offset;
+    size_t frames;
+
+    size_t frame_size() const;
+};
+
+// Returns layout of a RIFF WAVE file holding samples of one of WavEncoding, none for any other
+// format or if it's not supported on this host
+optional<WavLayout> parse_wav(const unsigned char* data, size_t size);
+
+// Converts `count` little-endian samples to floats, scaled exactly like libsndfile does
+void convert_samples(WavEncoding encoding, const unsigned char* src, size_t count, Sample* dst);
+
+// Point in a WAV file shown as a marker by editors
+struct WavCue {
+    std::uint64_t frame;
+    string label;
+};
+
+// Appends cue and labels chunks with `cues` to a finished RIFF or RF64 WAVE file. Cues past
+// what 32-bit positions can express are left out.
+void append_wav_cues(const string& path, const vector<WavCue>& cues);
+
+// How WavWriter gets samples to disk
+enum class WavIo {
+    // Synchronous writes straight from the caller's memory
+    SYNC,
+    // Samples are gathered into large blocks, several of which are written through io_uring
+    // at a time, so that a slow write doesn't hold up the caller until blocks run out
+    URING,
+    // Like URING, bypassing page cache with O_DIRECT where the filesystem supports it
+    URING_DIRECT
+};
+
+// Writes 32-bit float WAV files without libsndfile, samples go to disk as they are. The file
+// is promoted to RF64 on close if it has grown past what RIFF sizes can express.
+class WavWriter {
+    int fd_ = -1;
+    string path_;
+    size_t frame_size_;
+    vector<unsigned char> header_;
+    // Bytes of samples written so far
+    size_t written_ = 0;
+    // Aligned blocks for writing through `uring_`, declared first to outlive requests in flight
+    std::unique_ptr<unsigned char, void (*)(void*)> pool_{nullptr, std::free};
+    std::unique_ptr<Uring> uring_;
+    // Bytes being written from each block, 0 if the block is free
+    vector<size_t> pending_;
+    // Block being filled and bytes in it
+    size_t block_ = 0;
+    size_t fill_ = 0;
+    // Bytes of samples handed to the kernel so far
+    size_t submitted_ = 0;
+    bool direct_ = false;
+
+    unsigned char* block(size_t index) const;
+    void write_at(const void* data, size_t size, size_t offset);
+    void write_header();
+    // Hands `size` bytes of the current block to the kernel and moves to the next block
+    void submit(size_t size);
+    // Waits for a block to be written
+    void complete();
+    void finish();
+
+public:
+    // Preallocates room for `expected_frames` if given, throws if the file can't be created.
+    // Falls back to synchronous writes if io_uring isn't available.
+    explicit WavWriter(
+        const string& path,
+        size_t sample_rate,
+        size_t channel_count,
+        size_t expected_frames = 0,
+        WavIo io = WavIo::SYNC
+    );
+    // Finishes the file if close() wasn't called, failures are only logged
+    ~WavWriter();
+    WavWriter(const WavWriter&) = delete;
+    WavWriter& operator=(const WavWriter&) = delete;
+
+    // Appends `count` interleaved samples, which needn't make whole frames
+    void write(const Sample* src, size_t count);
+    // Fills in sizes in the header, releases unused preallocation and closes the file
+    void close();
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+    void* data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    // Throws if the file can't be mapped
+    explicit MappedFile(const string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return static_cast<const unsigned char*>(data_); }
+    size_t size() const { return size_; }
+    // Hints the kernel that the range is going to be read sequentially soon
+    void prefetch(size_t offset, size_t length) const;
+};
+
+}
@@ -0,0 +1,24 @@
+# Plays STIMULUS through the loopback of the offline engine, records it to OUTPUT and checks
+# the recording with WAVCMP. ARGS are further arrow1 options, separated by commas.
+#
+# cmake -DARROW1=... -DWAVCMP=... -DSTIMULUS=... -DOUTPUT=... -DCHANNELS=... -DPERIOD=... -DARGS=... -P loopback.cmake
+
+string(REPLACE "," ";" args "${ARGS}")
+file(REMOVE "${OUTPUT}")
+execute_process(
+    COMMAND "${ARROW1}" --offline --offline-rate 44100 --offline-period ${PERIOD}
+        --offline-channels ${CHANNELS} --offline-capture loopback
+        -r "${STIMULUS}" -w "${OUTPUT}" ${args}
+    RESULT_VARIABLE result
+)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "arrow1 failed: ${result}")
+endif()
+# Loopback returns what was played in the previous period
+execute_process(
+    COMMAND "${WAVCMP}" "${STIMULUS}" "${OUTPUT}" ${PERIOD}
+    RESULT_VARIABLE result
+)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "recording differs from stimulus")
+endif()
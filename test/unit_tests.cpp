@@ -0,0 +1,455 @@
+// Checks of the parts of arrow1 which don't need an engine: (de)interleaving kernels, WAV
+// parsing, sample conversion, float WAV writing with cue points, histogram percentiles and
+// ringbuffer resizing.
+// Exits with non-zero status if any check fails.
+
+#include "kernels.hpp"
+#include "wav.hpp"
+#include "stats.hpp"
+#include "io.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+
+using namespace olo;
+
+namespace {
+size_t failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        ++failures; \
+    } \
+} while (false)
+
+// Specialized channel counts and some generic ones
+const size_t CHANNEL_COUNTS[] = {1, 2, 3, 4, 5, 6, 8, 16, 32};
+
+vector<Sample> ramp(size_t count) {
+    vector<Sample> samples(count);
+    for (size_t i = 0; i != count; ++i) {
+        samples[i] = i + .5f;
+    }
+    return samples;
+}
+
+const Isa ISAS[] = {Isa::SCALAR, Isa::SSE2, Isa::AVX2, Isa::AVX512};
+
+// Round trip of `channels` channels through kernels `k`
+void check_kernels(const Kernels& k, size_t channels) {
+    const size_t OFFSET = 5;
+    // Sizes around vector widths and unrolled loop lengths
+    for (size_t frames: {0, 1, 2, 3, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 63, 64, 65, 100}) {
+        const vector<Sample> interleaved = ramp(frames * channels);
+        vector<vector<Sample>> planes(channels, vector<Sample>(OFFSET + frames, -1.f));
+        vector<Sample*> dst;
+        for (auto& plane: planes) {
+            dst.push_back(plane.data());
+        }
+        k.deinterleave(interleaved.data(), frames, channels, dst.data(), OFFSET);
+        bool ok = true;
+        for (size_t c = 0; c != channels; ++c) {
+            for (size_t n = 0; n != OFFSET; ++n) {
+                ok = ok && planes[c][n] == -1.f;
+            }
+            for (size_t n = 0; n != frames; ++n) {
+                ok = ok && planes[c][OFFSET + n] == interleaved[n * channels + c];
+            }
+        }
+        CHECK(ok);
+
+        vector<Sample> back(frames * channels + 1, -1.f);
+        k.interleave(dst.data(), OFFSET, frames, channels, back.data());
+        CHECK(std::equal(interleaved.begin(), interleaved.end(), back.begin()));
+        // Nothing written past the frames
+        CHECK(back.back() == -1.f);
+        if (!ok) {
+            std::fprintf(stderr, "  %s kernels, %zd channels, %zd frames\n", k.isa, channels, frames);
+        }
+    }
+}
+
+void test_kernels() {
+    // Every instruction set the CPU has, not only the one picked at run time
+    for (Isa isa: ISAS) {
+        if (!isa_supported(isa)) {
+            continue;
+        }
+        for (size_t channels: CHANNEL_COUNTS) {
+            check_kernels(select_kernels(channels, isa), channels);
+        }
+    }
+}
+
+void test_ring_kernels() {
+    const size_t FRAMES = 13;
+    for (size_t channels: CHANNEL_COUNTS) {
+        const Kernels k = select_kernels(channels);
+        const vector<Sample> interleaved = ramp(FRAMES * channels);
+        // Every split of the ringbuffer, including ones through the middle of a frame
+        for (size_t split = 0; split <= FRAMES * channels; ++split) {
+            vector<Sample> segments = interleaved;
+            jack_ringbuffer_data_t vec[2];
+            vec[0].buf = reinterpret_cast<char*>(segments.data());
+            vec[0].len = split * sizeof(Sample);
+            vec[1].buf = reinterpret_cast<char*>(segments.data() + split);
+            vec[1].len = (FRAMES * channels - split) * sizeof(Sample);
+
+            vector<vector<Sample>> planes(channels, vector<Sample>(FRAMES));
+            vector<Sample*> dst;
+            for (auto& plane: planes) {
+                dst.push_back(plane.data());
+            }
+            deinterleave_ring(k, vec, FRAMES, channels, dst.data());
+            bool ok = true;
+            for (size_t c = 0; c != channels; ++c) {
+                for (size_t n = 0; n != FRAMES; ++n) {
+                    ok = ok && planes[c][n] == interleaved[n * channels + c];
+                }
+            }
+            CHECK(ok);
+
+            std::fill(segments.begin(), segments.end(), -1.f);
+            interleave_ring(k, dst.data(), FRAMES, channels, vec);
+            CHECK(segments == interleaved);
+            if (!ok || segments != interleaved) {
+                std::fprintf(stderr, "  %zd channels, split after %zd samples\n", channels, split);
+            }
+        }
+    }
+}
+
+void put16(vector<unsigned char>& v, std::uint32_t x) {
+    v.push_back(x);
+    v.push_back(x >> 8);
+}
+
+void put32(vector<unsigned char>& v, std::uint32_t x) {
+    put16(v, x);
+    put16(v, x >> 16);
+}
+
+void put_id(vector<unsigned char>& v, const char* id) {
+    v.insert(v.end(), id, id + 4);
+}
+
+// RIFF WAVE file with format chunk of `tag` and `bits`, an odd-sized chunk in front of it and
+// `data_size` bytes of silence
+vector<unsigned char> make_wav(std::uint16_t tag, size_t channels, size_t bits, size_t data_size, bool extensible = false) {
+    vector<unsigned char> wav;
+    put_id(wav, "RIFF");
+    put32(wav, 0);
+    put_id(wav, "WAVE");
+    put_id(wav, "junk");
+    put32(wav, 3);
+    wav.insert(wav.end(), {1, 2, 3, 0});
+    put_id(wav, "fmt ");
+    put32(wav, extensible ? 40 : 16);
+    put16(wav, extensible ? 0xfffe : tag);
+    put16(wav, channels);
+    put32(wav, 44100);
+    put32(wav, 44100 * channels * bits / 8);
+    put16(wav, channels * bits / 8);
+    put16(wav, bits);
+    if (extensible) {
+        put16(wav, 22);
+        put16(wav, bits);
+        put32(wav, 0);
+        // Sub-format GUID, of which only the leading format tag is looked at
+        put16(wav, tag);
+        wav.insert(wav.end(), {0, 0, 0, 0, 0x10, 0, 0x80, 0, 0, 0xaa, 0, 0x38, 0x9b, 0x71});
+    }
+    put_id(wav, "data");
+    put32(wav, data_size);
+    wav.resize(wav.size() + data_size);
+    vector<unsigned char> riff_size;
+    put32(riff_size, wav.size() - 8);
+    std::copy(riff_size.begin(), riff_size.end(), wav.begin() + 4);
+    return wav;
+}
+
+void test_parse_wav() {
+    const size_t DATA_OFFSET = 12 + 12 + 24 + 8;
+    {
+        const auto wav = make_wav(1, 2, 16, 400);
+        const auto layout = parse_wav(wav.data(), wav.size());
+        CHECK(layout);
+        if (layout) {
+            CHECK(layout->encoding == WavEncoding::PCM_16);
+            CHECK(layout->channels == 2);
+            CHECK(layout->sample_rate == 44100);
+            CHECK(layout->data_offset == DATA_OFFSET);
+            CHECK(layout->frames == 100);
+        }
+    }
+    {
+        const auto wav = make_wav(1, 6, 24, 6 * 3 * 10, true);
+        const auto layout = parse_wav(wav.data(), wav.size());
+        CHECK(layout && layout->encoding == WavEncoding::PCM_24 && layout->channels == 6 && layout->frames == 10);
+    }
+    {
+        const auto wav = make_wav(1, 1, 32, 40);
+        const auto layout = parse_wav(wav.data(), wav.size());
+        CHECK(layout && layout->encoding == WavEncoding::PCM_32 && layout->frames == 10);
+    }
+    {
+        const auto wav = make_wav(3, 3, 32, 3 * 4 * 7, true);
+        const auto layout = parse_wav(wav.data(), wav.size());
+        CHECK(layout && layout->encoding == WavEncoding::FLOAT && layout->frames == 7);
+    }
+    // Truncated file claims more samples than there are
+    {
+        auto wav = make_wav(1, 2, 16, 400);
+        wav.resize(wav.size() - 101);
+        const auto layout = parse_wav(wav.data(), wav.size());
+        CHECK(layout && layout->frames == 74);
+    }
+    // Formats read by libsndfile instead
+    CHECK(!parse_wav(make_wav(1, 2, 8, 400).data(), DATA_OFFSET + 400));
+    CHECK(!parse_wav(make_wav(3, 2, 64, 400).data(), DATA_OFFSET + 400));
+    CHECK(!parse_wav(make_wav(6, 2, 16, 400).data(), DATA_OFFSET + 400));
+    // Broken headers
+    {
+        auto wav = make_wav(1, 2, 16, 400);
+        std::memcpy(wav.data(), "RIFX", 4);
+        CHECK(!parse_wav(wav.data(), wav.size()));
+    }
+    {
+        auto wav = make_wav(1, 2, 16, 400);
+        // Block align not matching channels and bits
+        wav[12 + 12 + 8 + 12] = 6;
+        CHECK(!parse_wav(wav.data(), wav.size()));
+    }
+    {
+        auto wav = make_wav(1, 0, 16, 400);
+        CHECK(!parse_wav(wav.data(), wav.size()));
+    }
+    {
+        const auto wav = make_wav(1, 2, 16, 400);
+        // Cut inside the format chunk
+        CHECK(!parse_wav(wav.data(), 30));
+        CHECK(!parse_wav(wav.data(), 8));
+    }
+}
+
+void test_parse_rf64() {
+    vector<unsigned char> wav;
+    put_id(wav, "RF64");
+    put32(wav, 0xffffffff);
+    put_id(wav, "WAVE");
+    put_id(wav, "ds64");
+    put32(wav, 28);
+    put32(wav, 0xffffffff);
+    put32(wav, 0);
+    // Data size, the only one looked at
+    put32(wav, 2 * 4 * 5);
+    put32(wav, 0);
+    put32(wav, 5);
+    put32(wav, 0);
+    put32(wav, 0);
+    put_id(wav, "fmt ");
+    put32(wav, 16);
+    put16(wav, 3);
+    put16(wav, 2);
+    put32(wav, 48000);
+    put32(wav, 48000 * 8);
+    put16(wav, 8);
+    put16(wav, 32);
+    put_id(wav, "data");
+    put32(wav, 0xffffffff);
+    // More than ds64 claims, as if the writer was still going
+    wav.resize(wav.size() + 2 * 4 * 9);
+    const auto layout = parse_wav(wav.data(), wav.size());
+    CHECK(layout && layout->encoding == WavEncoding::FLOAT && layout->frames == 5);
+}
+
+void test_convert_samples() {
+    {
+        const unsigned char src[] = {0x00, 0x80, 0xff, 0x7f, 0x01, 0x00, 0x00, 0x00};
+        Sample dst[4];
+        convert_samples(WavEncoding::PCM_16, src, 4, dst);
+        CHECK(dst[0] == -1.f);
+        CHECK(dst[1] == 32767.f / 32768);
+        CHECK(dst[2] == 1.f / 32768);
+        CHECK(dst[3] == 0.f);
+    }
+    {
+        const unsigned char src[] = {0x00, 0x00, 0x80, 0xff, 0xff, 0x7f, 0xff, 0xff, 0xff};
+        Sample dst[3];
+        convert_samples(WavEncoding::PCM_24, src, 3, dst);
+        CHECK(dst[0] == -1.f);
+        CHECK(dst[1] == 8388607.f / 8388608);
+        CHECK(dst[2] == -1.f / 8388608);
+    }
+    {
+        const unsigned char src[] = {0x00, 0x00, 0x00, 0x80, 0x00, 0x00, 0x01, 0x00};
+        Sample dst[2];
+        convert_samples(WavEncoding::PCM_32, src, 2, dst);
+        CHECK(dst[0] == -1.f);
+        CHECK(dst[1] == 65536.f / 2147483648.f);
+    }
+    {
+        const Sample values[] = {.25f, -1.5f, 1e-20f};
+        Sample dst[3];
+        convert_samples(WavEncoding::FLOAT, reinterpret_cast<const unsigned char*>(values), 3, dst);
+        CHECK(std::equal(values, values + 3, dst));
+    }
+}
+
+vector<unsigned char> read_file(const char* path) {
+    std::ifstream in{path, std::ios::binary};
+    return {std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+}
+
+std::uint32_t get32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<std::uint32_t>(p[3]) << 24;
+}
+
+void test_wav_writer_cues() {
+    const char* path = "unit_tests_cues.wav";
+    const size_t CHANNELS = 3;
+    const size_t FRAMES = 1001;
+    const vector<Sample> samples = ramp(CHANNELS * FRAMES);
+    {
+        WavWriter writer{path, 48000, CHANNELS};
+        // Writes needn't make whole frames
+        writer.write(samples.data(), 7);
+        writer.write(samples.data() + 7, samples.size() - 7);
+        writer.close();
+    }
+    auto wav = read_file(path);
+    auto layout = parse_wav(wav.data(), wav.size());
+    CHECK(layout && layout->encoding == WavEncoding::FLOAT && layout->channels == CHANNELS && layout->frames == FRAMES);
+    if (!layout) {
+        return;
+    }
+    CHECK(layout->sample_rate == 48000);
+    CHECK(std::memcmp(wav.data() + layout->data_offset, samples.data(), samples.size() * sizeof(Sample)) == 0);
+
+    append_wav_cues(path, {{0, "start"}, {500, "xrun"}});
+    wav = read_file(path);
+    CHECK(get32(wav.data() + 4) == wav.size() - 8);
+    layout = parse_wav(wav.data(), wav.size());
+    CHECK(layout && layout->frames == FRAMES);
+    // Cue chunk follows samples, with the list of labels after it
+    const size_t cue = layout->data_offset + samples.size() * sizeof(Sample);
+    CHECK(wav.size() > cue + 12 + 2 * 24 + 12);
+    if (wav.size() <= cue + 12 + 2 * 24 + 12) {
+        return;
+    }
+    CHECK(std::memcmp(wav.data() + cue, "cue ", 4) == 0);
+    CHECK(get32(wav.data() + cue + 8) == 2);
+    CHECK(get32(wav.data() + cue + 12 + 4) == 0);
+    CHECK(get32(wav.data() + cue + 12 + 24 + 4) == 500);
+    const size_t list = cue + 8 + get32(wav.data() + cue + 4);
+    CHECK(std::memcmp(wav.data() + list, "LIST", 4) == 0);
+    CHECK(std::memcmp(wav.data() + list + 8, "adtl", 4) == 0);
+    CHECK(list + 8 + get32(wav.data() + list + 4) == wav.size());
+    // Odd-sized label is padded, the next one starts on an even offset
+    CHECK(std::memcmp(wav.data() + list + 12, "labl", 4) == 0);
+    CHECK(std::memcmp(wav.data() + list + 12 + 12, "start", 6) == 0);
+    CHECK(std::memcmp(wav.data() + list + 12 + 12 + 6, "labl", 4) == 0);
+    std::remove(path);
+}
+
+void test_histogram() {
+    Histogram h;
+    CHECK(h.percentile(.5) == 0);
+    for (std::uint64_t v: {0, 1, 2, 3, 4, 1000}) {
+        h.record(v);
+    }
+    CHECK(h.count() == 6 && h.min() == 0 && h.max() == 1000 && h.sum() == 1010);
+    CHECK(h.bucket(0) == 1 && h.bucket(1) == 1 && h.bucket(2) == 2 && h.bucket(3) == 1 && h.bucket(10) == 1);
+    // Halfway through bucket [2, 4), which holds the third and fourth value
+    CHECK(h.percentile(.5) == 3);
+    CHECK(h.percentile(1.) == 1000);
+}
+
+void test_percentile() {
+    // All of 1000..1999 in bucket [1024, 2048) but the first 24, in [512, 1024)
+    Histogram h;
+    for (std::uint64_t v = 1000; v != 2000; ++v) {
+        h.record(v);
+    }
+    CHECK(h.percentile(0.) == 1000);
+    CHECK(h.percentile(1.) == 1999);
+    // Median is the 476th of 976 values in the top bucket, at 1024 + 476 / 976 of 1024
+    CHECK(h.percentile(.5) == 1523);
+    CHECK(h.percentile(.9) == 1943);
+
+    Histogram single;
+    single.record(700);
+    CHECK(single.percentile(.5) == 700);
+    CHECK(single.percentile(.99) == 700);
+}
+
+// Checks that `reader` ringbuffer holds the leading frames of interleaved `data`
+bool ring_holds(const Reader& reader, const vector<Sample>& data) {
+    const size_t frames = reader.frames_readable();
+    const size_t channels = reader.channel_count();
+    for (size_t c = 0; c != (reader.planar() ? channels : 1); ++c) {
+        jack_ringbuffer_t* ring = reader.planar() ? reader.channel_buffer(c) : reader.buffer();
+        const size_t count = reader.planar() ? frames : frames * channels;
+        vector<Sample> peeked(count);
+        jack_ringbuffer_peek(ring, reinterpret_cast<char*>(peeked.data()), count * sizeof(Sample));
+        for (size_t i = 0; i != count; ++i) {
+            const Sample expected = reader.planar() ? data[i * channels + c] : data[i];
+            if (peeked[i] != expected) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void test_fit_period() {
+    const size_t CHANNELS = 3;
+    const size_t FRAMES = 100000;
+    const vector<Sample> data = ramp(CHANNELS * FRAMES);
+    for (auto transport: {Transport::INTERLEAVED, Transport::PLANAR}) {
+        Reader reader{data.data(), FRAMES, 48000, CHANNELS, 4096, 0., 0., transport};
+        const size_t prefilled = reader.frames_readable();
+        CHECK(prefilled != 0);
+        // Size is kept until asked for periods
+        reader.fit_period(256);
+        CHECK(reader.buffer_size() == 4096);
+
+        reader.set_buffer_periods(4);
+        reader.fit_period(4096);
+        CHECK(reader.buffer_size() == 4 * 4096);
+        CHECK(reader.frames_readable() == prefilled);
+        CHECK(ring_holds(reader, data));
+
+        // Shrinking keeps whole periods holding what's buffered
+        reader.fit_period(256);
+        CHECK(reader.buffer_size() % 256 == 0);
+        CHECK(reader.buffer_size() > prefilled);
+        CHECK(reader.frames_readable() == prefilled);
+        CHECK(ring_holds(reader, data));
+        reader.stop();
+    }
+}
+}
+
+int main() {
+    test_kernels();
+    test_ring_kernels();
+    test_parse_wav();
+    test_parse_rf64();
+    test_convert_samples();
+    test_wav_writer_cues();
+    test_histogram();
+    test_percentile();
+    test_fit_period();
+    if (failures != 0) {
+        std::fprintf(stderr, "%zd checks failed\n", failures);
+        return 1;
+    }
+    std::printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Checks that a recording holds a stimulus delayed by a number of frames, as the loopback of the
+// offline engine returns it. Frames past the delayed stimulus must be silent.
+//
+// Usage: wavcmp <stimulus> <recording> <delay>
+//
+// Float recordings must match bit for bit. Integer ones are scaled by libsndfile on the way
+// in and out, so they may be off by a few units of 32-bit resolution, far below the 16 bits of
+// the stimuli.
+
+#include <sndfile.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+namespace {
+const float INTEGER_TOLERANCE = 1.f / (1 << 23);
+
+bool read_all(const char* path, SF_INFO& info, std::vector<float>& samples) {
+    info = SF_INFO{};
+    SNDFILE* sf = sf_open(path, SFM_READ, &info);
+    if (sf == nullptr) {
+        std::fprintf(stderr, "wavcmp: can't open %s\n", path);
+        return false;
+    }
+    samples.resize(static_cast<size_t>(info.frames) * info.channels);
+    const sf_count_t read = sf_readf_float(sf, samples.data(), info.frames);
+    sf_close(sf);
+    if (read != info.frames) {
+        std::fprintf(stderr, "wavcmp: read %lld of %lld frames of %s\n",
+            static_cast<long long>(read), static_cast<long long>(info.frames), path);
+        return false;
+    }
+    return true;
+}
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        std::fprintf(stderr, "usage: wavcmp <stimulus> <recording> <delay>\n");
+        return 2;
+    }
+    SF_INFO stimulus_info;
+    SF_INFO recording_info;
+    std::vector<float> stimulus;
+    std::vector<float> recording;
+    if (!read_all(argv[1], stimulus_info, stimulus) || !read_all(argv[2], recording_info, recording)) {
+        return 1;
+    }
+    const size_t delay = std::strtoul(argv[3], nullptr, 10);
+    const size_t channels = stimulus_info.channels;
+    if (recording_info.channels != stimulus_info.channels || recording_info.samplerate != stimulus_info.samplerate) {
+        std::fprintf(stderr, "wavcmp: recording has %d channels at %d Hz, stimulus %d channels at %d Hz\n",
+            recording_info.channels, recording_info.samplerate, stimulus_info.channels, stimulus_info.samplerate);
+        return 1;
+    }
+    // Recording stops with playback, so the stimulus is cut short by the delay
+    if (recording_info.frames < stimulus_info.frames) {
+        std::fprintf(stderr, "wavcmp: recording has %lld frames, stimulus %lld\n",
+            static_cast<long long>(recording_info.frames), static_cast<long long>(stimulus_info.frames));
+        return 1;
+    }
+    const bool exact = (recording_info.format & SF_FORMAT_SUBMASK) == SF_FORMAT_FLOAT;
+    const size_t frames = recording_info.frames;
+    size_t mismatches = 0;
+    for (size_t i = 0; i != frames; ++i) {
+        for (size_t c = 0; c != channels; ++c) {
+            const size_t j = i - delay;
+            const float expected = i >= delay && j < static_cast<size_t>(stimulus_info.frames) ? stimulus[j * channels + c] : 0.f;
+            const float actual = recording[i * channels + c];
+            const bool match = exact ? actual == expected : std::fabs(actual - expected) <= INTEGER_TOLERANCE;
+            if (!match && mismatches++ < 10) {
+                std::fprintf(stderr, "wavcmp: frame %zu channel %zu: expected %.9g, recorded %.9g\n",
+                    i, c, expected, actual);
+            }
+        }
+    }
+    if (mismatches != 0) {
+        std::fprintf(stderr, "wavcmp: %zu of %zu samples differ\n", mismatches, frames * channels);
+        return 1;
+    }
+    std::printf("wavcmp: %zu frames of %zu channels match\n", frames, channels);
+    return 0;
+}